@@ -26,16 +26,22 @@
 #include "jconf.h"
 #include "console.h"
 #include "donate-level.h"
+#include "proxy.h"
+#include "jobbus.h"
+#include "httpd.h"
+#include "statshm.h"
+#include "flightrec.h"
 #ifndef CONF_NO_HWLOC
 #   include "autoAdjustHwloc.hpp"
 #else
 #   include "autoAdjust.hpp"
 #endif
 #include "version.h"
+#include "stratum.h"
+#include "hexcodec.h"
 
-#ifndef CONF_NO_HTTPD
-#   include "httpd.h"
-#endif
+#include "rapidjson/document.h"
+#include "jext.h"
 
 #include "colors.hpp"
 
@@ -77,6 +83,7 @@ void win_exit() { return; }
 #endif // _WIN32
 
 void do_benchmark();
+void do_parser_benchmark();
 
 int main(int argc, char *argv[])
 {
@@ -113,6 +120,13 @@ int main(int argc, char *argv[])
             return 0;
         }
 
+        if(strcasecmp(argv[1], "parser_benchmark") == 0)
+        {
+            do_parser_benchmark();
+            win_exit();
+            return 0;
+        }
+
         if(argc >= 3 && strcasecmp(argv[1], "-c") == 0)
         {
             sFilename = argv[2];
@@ -153,7 +167,6 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-#ifndef CONF_NO_HTTPD
     if(jconf::inst()->GetHttpdPort() != 0)
     {
         if (!httpd::inst()->start_daemon())
@@ -162,7 +175,33 @@ int main(int argc, char *argv[])
             return 0;
         }
     }
-#endif
+
+    if(jconf::inst()->GetProxyPort() != 0)
+    {
+        if (!proxy::inst()->start(jconf::inst()->GetProxyPort()))
+        {
+            win_exit();
+            return 0;
+        }
+    }
+
+    if(jconf::inst()->GetJobBusRole() == jconf::bus_leader)
+    {
+        if (!job_bus::inst()->start_leader(jconf::inst()->GetJobBusName()))
+        {
+            win_exit();
+            return 0;
+        }
+    }
+
+    if(jconf::inst()->GetStatsShmName()[0] != '\0')
+    {
+        if (!stats_shm::inst()->start(jconf::inst()->GetStatsShmName()))
+        {
+            win_exit();
+            return 0;
+        }
+    }
 
     printer::inst()->print_str(CYAN("-------------------------------------------------------------------\n"));
     printer::inst()->print_str(GREEN( XMR_STAK_NAME " " XMR_STAK_VERSION) CYAN(" by ") GREEN("Dead2") CYAN(" CPU mining software under ") RED("GPLv3\n"));
@@ -190,6 +229,7 @@ int main(int argc, char *argv[])
     if(strlen(jconf::inst()->GetOutputFile()) != 0)
         printer::inst()->open_logfile(jconf::inst()->GetOutputFile());
 
+    flight_recorder::inst()->catch_signal();
     executor::inst()->ex_start(jconf::inst()->DaemonMode());
 
     using namespace std::chrono;
@@ -240,10 +280,10 @@ void do_benchmark()
     printer::inst()->print_msg(L0, "Running a 60 second benchmark...");
 
     uint8_t work[76] = {0};
-    minethd::miner_work oWork = minethd::miner_work("", work, sizeof(work), 0, 0, false, 0);
+    minethd::miner_work oWork = minethd::miner_work(0, work, sizeof(work), 0, 0, false, 0);
     pvThreads = minethd::thread_starter(oWork);
 
-    uint64_t iStartStamp = time_point_cast<milliseconds>(high_resolution_clock::now()).time_since_epoch().count();
+    uint64_t iStartStamp = tsc_clock::now_ms();
 
     std::this_thread::sleep_for(std::chrono::seconds(60));
 
@@ -253,8 +293,8 @@ void do_benchmark()
     double fTotalHps = 0.0;
     for (uint32_t i = 0; i < pvThreads->size(); i++)
     {
-        double fHps = pvThreads->at(i)->iHashCount;
-        fHps /= (pvThreads->at(i)->iTimestamp - iStartStamp) / 1000.0;
+        double fHps = pvThreads->at(i)->get_hash_count();
+        fHps /= (pvThreads->at(i)->get_timestamp() - iStartStamp) / 1000.0;
 
         printer::inst()->print_msg(L0, "Thread %u: %.1f H/S", i, fHps);
         fTotalHps += fHps;
@@ -262,3 +302,109 @@ void do_benchmark()
 
     printer::inst()->print_msg(L0, "Total: %.1f H/S", fTotalHps);
 }
+
+static const char sBenchJobLine[] =
+    "{\"jsonrpc\":\"2.0\",\"method\":\"job\",\"params\":{\"blob\":\""
+    "0606a3e2a5cc05d2b5e3dab8c8dbe0a5d7a36f11f2ca4f5a5e28c47d8e0fb2a4e6b0b5e8e7a5c8a600000000"
+    "a4f3c4dd2b3d6c0f5e1ab78a6c5dce8d3b1a4a0e5e8b7f4c1b3d1a6f0a2e1c3d04\","
+    "\"job_id\":\"V3nsKq8hAgBpm1Z7oVrbkDQzX1a4\",\"target\":\"b88d0600\","
+    "\"id\":\"413768271924321\"}}";
+
+static const char sBenchReplyLine[] =
+    "{\"id\":17,\"jsonrpc\":\"2.0\",\"error\":null,\"result\":{\"status\":\"OK\"}}";
+
+typedef GenericDocument<UTF8<>, MemoryPoolAllocator<>, MemoryPoolAllocator<>> MemDocument;
+
+template<typename F>
+double bench_ns(size_t iters, F fun)
+{
+    using namespace std::chrono;
+    steady_clock::time_point start = steady_clock::now();
+    for(size_t i = 0; i < iters; i++)
+        fun();
+    return (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / iters;
+}
+
+void do_parser_benchmark()
+{
+    constexpr size_t iIters = 500000;
+    char line[sizeof(sBenchJobLine)];
+    unsigned char blob[128];
+    size_t iCheck = 0;
+
+    printer::inst()->print_msg(L0, "Running a network parser benchmark...");
+
+    /* Job notification, both paths end with the blob decoded */
+    double fFast = bench_ns(iIters, [&]() {
+        memcpy(line, sBenchJobLine, sizeof(sBenchJobLine));
+        stratum_msg msg;
+        if(stratum_fast_parse(line, sizeof(sBenchJobLine) - 1, msg))
+            iCheck += hex2bin_selector()(msg.oBlob.str, msg.oBlob.len, blob);
+    });
+
+    std::unique_ptr<uint8_t[]> bParseMem(new uint8_t[4096]);
+    std::unique_ptr<uint8_t[]> bRecvMem(new uint8_t[4096]);
+    MemoryPoolAllocator<> parseAllocator(bParseMem.get(), 4096);
+    MemoryPoolAllocator<> recvAllocator(bRecvMem.get(), 4096);
+    MemDocument doc(&recvAllocator, 4096, &parseAllocator);
+
+    double fDom = bench_ns(iIters, [&]() {
+        memcpy(line, sBenchJobLine, sizeof(sBenchJobLine));
+        doc.SetNull();
+        parseAllocator.Clear();
+        if(doc.ParseInsitu(line).HasParseError() || !doc.IsObject())
+            return;
+        const Value* params = GetObjectMember(doc, "params");
+        const Value* b = params != nullptr ? GetObjectMember(*params, "blob") : nullptr;
+        if(b != nullptr && GetObjectMember(*params, "job_id") != nullptr && GetObjectMember(*params, "target") != nullptr)
+            iCheck += hex2bin_scalar(b->GetString(), b->GetStringLength(), blob);
+    });
+
+    printer::inst()->print_msg(L0, "Job   - fast path: %6.1f ns, DOM: %6.1f ns", fFast, fDom);
+
+    fFast = bench_ns(iIters, [&]() {
+        memcpy(line, sBenchReplyLine, sizeof(sBenchReplyLine));
+        stratum_msg msg;
+        if(stratum_fast_parse(line, sizeof(sBenchReplyLine) - 1, msg))
+            iCheck += msg.iCallId;
+    });
+
+    fDom = bench_ns(iIters, [&]() {
+        memcpy(line, sBenchReplyLine, sizeof(sBenchReplyLine));
+        doc.SetNull();
+        parseAllocator.Clear();
+        if(doc.ParseInsitu(line).HasParseError() || !doc.IsObject())
+            return;
+        const Value* id = GetObjectMember(doc, "id");
+        if(id != nullptr && id->IsUint64() && GetObjectMember(doc, "result") != nullptr)
+            iCheck += id->GetUint64();
+    });
+
+    printer::inst()->print_msg(L0, "Reply - fast path: %6.1f ns, DOM: %6.1f ns", fFast, fDom);
+
+    /* Hex codec on a 76 byte work blob */
+    const char* sHex = strstr(sBenchJobLine, "0606");
+    char hexout[256];
+    const char* names[3] = { "scalar", "ssse3", "avx2" };
+    hex2bin_fun h2b[3] = { hex2bin_scalar, hex2bin_ssse3_selector(), hex2bin_avx2_selector() };
+    bin2hex_fun b2h[3] = { bin2hex_scalar, bin2hex_ssse3_selector(), bin2hex_avx2_selector() };
+
+    for(size_t i = 0; i < 3; i++)
+    {
+        if(h2b[i] == nullptr || b2h[i] == nullptr)
+        {
+            printer::inst()->print_msg(L0, "Hex %-6s - not supported by this CPU", names[i]);
+            continue;
+        }
+
+        double fDec = bench_ns(iIters * 4, [&]() { iCheck += h2b[i](sHex, 152, blob); });
+        double fEnc = bench_ns(iIters * 4, [&]() { b2h[i](blob, 76, hexout); iCheck += hexout[7]; });
+
+        if(memcmp(hexout, sHex, 152) != 0)
+            printer::inst()->print_msg(L0, "Hex %-6s - round trip FAILED", names[i]);
+
+        printer::inst()->print_msg(L0, "Hex %-6s - decode: %6.1f ns, encode: %6.1f ns", names[i], fDec, fEnc);
+    }
+
+    printer::inst()->print_msg(L4, "Checksum %llu", int_port(iCheck));
+}
@@ -51,6 +51,7 @@ extern "C"
 }
 #include "jh.hpp"
 #include "../common.h"
+#include "../probes.h"
 #include "cryptonight.h"
 #include "cryptonight_aesni.h"
 
@@ -204,6 +205,7 @@ cryptonight_ctx* cryptonight_alloc_ctx(size_t use_fast_mem, size_t use_mlock, al
         ptr->long_state = (uint8_t*)_mm_malloc(MEMORY, 2*1024*1024);
         ptr->ctx_info[0] = 0;
         ptr->ctx_info[1] = 0;
+        CG_PROBE3(alloc_ctx, 0, 0, 0);
         return ptr;
     }
 
@@ -223,11 +225,13 @@ cryptonight_ctx* cryptonight_alloc_ctx(size_t use_fast_mem, size_t use_mlock, al
             msg->warning = "VirtualAlloc failed. Reboot might help.";
         else
             msg->warning = "VirtualAlloc failed.";
+        CG_PROBE3(alloc_ctx, 1, 0, 1);
         return NULL;
     }
     else
     {
         ptr->ctx_info[0] = 1;
+        CG_PROBE3(alloc_ctx, 1, 0, 0);
         return ptr;
     }
 #else
@@ -247,6 +251,7 @@ cryptonight_ctx* cryptonight_alloc_ctx(size_t use_fast_mem, size_t use_mlock, al
     {
         _mm_free(ptr);
         msg->warning = "mmap failed";
+        CG_PROBE3(alloc_ctx, 1, use_mlock, 1);
         return NULL;
     }
 
@@ -267,6 +272,7 @@ cryptonight_ctx* cryptonight_alloc_ctx(size_t use_fast_mem, size_t use_mlock, al
         ptr->ctx_info[1] = 1;
     }
 
+    CG_PROBE3(alloc_ctx, 1, ptr->ctx_info[1], 0);
     return ptr;
 #endif // _WIN32
 }
@@ -6,6 +6,7 @@
  * Example of how it works for the default setting of 1.0:
  * You miner will mine into your usual pool for 99 minutes, then switch to the developer's pool for 1.0 minute.
  * Switching is instant, and only happens after a successful connection, so you never loose any hashes.
+ * With donation_split enabled in config.txt, 1.0% of the hashes go to the developer's pool all the time instead.
  *
  * If you plan on changing this setting to 0.0 please consider making a one off donation to our wallets:
  *
@@ -29,6 +29,12 @@
 #include <time.h>
 #include "executor.h"
 #include "jpsock.h"
+#include "proxy.h"
+#include "httpd.h"
+#include "statshm.h"
+#include "flightrec.h"
+#include "probes.h"
+#include "jobbus.h"
 #include "minethd.h"
 #include "jconf.h"
 #include "console.h"
@@ -42,6 +48,8 @@
 #endif // _WIN32
 
 executor* executor::oInst = NULL;
+constexpr std::array<size_t, 11> executor::iSubmitLatBuckets;
+constexpr std::array<size_t, 5> executor::iReportWindows;
 
 executor::executor()
 {
@@ -67,6 +75,10 @@ void executor::ex_clock_thd()
     if(iDevPortion != 0)
         iDevPortion += sec_to_ticks(2);
 
+    // With a split there is nothing to switch
+    if(jconf::inst()->DonationSplit())
+        iDevPortion = 0;
+
     while (true)
     {
         std::this_thread::sleep_for(std::chrono::milliseconds(size_t(iTickTime)));
@@ -105,8 +117,18 @@ void executor::ex_clock_thd()
     }
 }
 
-void executor::sched_reconnect()
+void executor::sched_reconnect(size_t pool_id)
 {
+    long long unsigned int rt = jconf::inst()->GetNetRetry();
+    get_pool_state(pool_id).bWaitRetry = true;
+    flight_recorder::inst()->record(flight_recorder::ev_reconnect, pool_id);
+    CG_PROBE2(reconnect, pool_id, rt);
+    push_timed_event(ex_event(EV_RECONNECT, pool_id), rt);
+
+    // As long as we have something to mine on, a pool that is down is not a problem
+    if(current_pool_id != invalid_pool_id && pick_pool_by_id(current_pool_id)->have_current_job())
+        return;
+
     iReconnectAttempts++;
     size_t iLimit = jconf::inst()->GetGiveUpLimit();
     if(iLimit != 0 && iReconnectAttempts > iLimit)
@@ -115,20 +137,28 @@ void executor::sched_reconnect()
         exit(0);
     }
 
-    long long unsigned int rt = jconf::inst()->GetNetRetry();
     printer::inst()->print_msg(L1, RED("Pool connection lost. Waiting %lld s before retry (attempt %llu)."),
         rt, int_port(iReconnectAttempts));
 
-    auto work = minethd::miner_work();
-    minethd::switch_work(work);
-
-    push_timed_event(ex_event(EV_RECONNECT, usr_pool_id), rt);
+    // Until the first retry we keep hashing on the last job, the shares wait in vShareBuffer
+    if(iReconnectAttempts > 1 || pool_id != current_pool_id)
+        stall_miners();
 }
 
 void executor::log_socket_error(std::string&& sError)
 {
-    vSocketLog.emplace_back(std::move(sError));
-    printer::inst()->print_msg(L1, RED("SOCKET ERROR - %s"), vSocketLog.back().msg.c_str());
+    iSocketErrors++;
+    printer::inst()->print_msg(L1, RED("SOCKET ERROR - %s"), sError.c_str());
+
+    if(vSocketLog.size() < iSocketLogSize)
+    {
+        vSocketLog.emplace_back(std::move(sError));
+    }
+    else
+    {
+        vSocketLog[iSocketLogNext] = sck_error_log(std::move(sError));
+        iSocketLogNext = (iSocketLogNext + 1) % iSocketLogSize;
+    }
 }
 
 void executor::log_result_error(std::string&& sError)
@@ -166,11 +196,261 @@ void executor::log_result_ok(uint64_t iActualDiff)
 jpsock* executor::pick_pool_by_id(size_t pool_id)
 {
     assert(pool_id != invalid_pool_id);
+    assert(pool_id <= pools.size());
 
-    if(pool_id == dev_pool_id)
-        return dev_pool;
+    return pools[pool_id - 1];
+}
+
+/*
+ * Pool selection. The score is the configured weight, scaled down by the reject rate and
+ * by the round trip time in seconds. A pool that was never measured keeps its full weight.
+ */
+double executor::pool_score(size_t pool_id)
+{
+    pool_state& st = get_pool_state(pool_id);
+    double fGood = double(st.iAccepted + 1) / double(st.iAccepted + st.iRejected + 1);
+    return pick_pool_by_id(pool_id)->get_pool_weight() * fGood / (1.0 + st.fRttMs / 1000.0);
+}
+
+// Should cand_id replace inc_id? Clearly better always does, the pool higher up in the list only has to be as good
+bool executor::pool_beats(size_t cand_id, size_t inc_id)
+{
+    double fCand = pool_score(cand_id);
+    double fInc = pool_score(inc_id);
+
+    if(fCand > fInc * fPoolSwitchMargin)
+        return true;
+
+    return cand_id < inc_id && fCand >= fInc;
+}
+
+void executor::add_rtt_sample(size_t pool_id, size_t iCallMs)
+{
+    pool_state& st = get_pool_state(pool_id);
+
+    // Same smoothing as the TCP round trip estimate
+    if(st.fRttMs == 0.0)
+        st.fRttMs = double(iCallMs);
     else
-        return usr_pool;
+        st.fRttMs += (double(iCallMs) - st.fRttMs) / 8.0;
+}
+
+size_t executor::pick_standby()
+{
+    size_t best = invalid_pool_id;
+    for(size_t i = usr_pool_id; i <= pools.size(); i++)
+    {
+        pool_state& st = get_pool_state(i);
+        if(i == active_pool_id || st.bWaitRetry || st.bClosing)
+            continue;
+
+        if(best == invalid_pool_id || pool_score(i) > pool_score(best))
+            best = i;
+    }
+
+    // Don't drop a working standby for a pool that is only slightly better
+    if(best != invalid_pool_id && standby_pool_id != invalid_pool_id && best != standby_pool_id)
+    {
+        pool_state& st = get_pool_state(standby_pool_id);
+        if(!st.bWaitRetry && !st.bClosing && pick_pool_by_id(standby_pool_id)->is_logged_in() &&
+            !pool_beats(best, standby_pool_id))
+            best = standby_pool_id;
+    }
+
+    return best;
+}
+
+size_t executor::pick_failover()
+{
+    size_t best = invalid_pool_id;
+    for(size_t i = usr_pool_id; i <= pools.size(); i++)
+    {
+        if(i == active_pool_id || !pick_pool_by_id(i)->is_logged_in() || !pick_pool_by_id(i)->have_current_job())
+            continue;
+
+        if(best == invalid_pool_id || pool_score(i) > pool_score(best))
+            best = i;
+    }
+    return best;
+}
+
+void executor::connect_pool(size_t pool_id)
+{
+    jpsock* pool = pick_pool_by_id(pool_id);
+    pool_state& st = get_pool_state(pool_id);
+
+    if(pool->is_running() || st.bWaitRetry || st.bClosing)
+        return;
+
+    printer::inst()->print_msg(L1, "Connecting to pool %s ...", pool->get_pool_addr());
+
+    std::string error;
+    if(!pool->connect(error))
+    {
+        log_socket_error(std::move(error));
+        sched_reconnect(pool_id);
+    }
+}
+
+// Keeps the active pool and the standby connected, and only those two
+void executor::eval_pools()
+{
+    connect_pool(active_pool_id);
+
+    // Wait for the active pool before bringing up the standby, so that the better pool wins the race at start
+    pool_state& act = get_pool_state(active_pool_id);
+    size_t standby = invalid_pool_id;
+    if(act.bWaitRetry || pick_pool_by_id(active_pool_id)->is_logged_in())
+        standby = pick_standby();
+
+    for(size_t i = usr_pool_id; i <= pools.size(); i++)
+    {
+        jpsock* pool = pick_pool_by_id(i);
+        if(i == active_pool_id || i == standby || !pool->is_running())
+            continue;
+
+        get_pool_state(i).bClosing = true;
+        pool->disconnect();
+    }
+
+    standby_pool_id = standby;
+    if(standby_pool_id != invalid_pool_id)
+        connect_pool(standby_pool_id);
+}
+
+// Promotes the standby if it clearly does better than the pool we are on
+void executor::eval_active_pool()
+{
+    if(standby_pool_id == invalid_pool_id || !pick_pool_by_id(standby_pool_id)->have_current_job())
+        return;
+
+    if(!pool_beats(standby_pool_id, active_pool_id))
+        return;
+
+    printer::inst()->print_msg(L1, "Pool %s ranks better than %s. Switching work.",
+        pick_pool_by_id(standby_pool_id)->get_pool_addr(), pick_pool_by_id(active_pool_id)->get_pool_addr());
+
+    set_active_pool(standby_pool_id);
+    eval_pools();
+}
+
+void executor::set_active_pool(size_t pool_id)
+{
+    size_t old_id = active_pool_id;
+
+    active_pool_id = pool_id;
+    standby_pool_id = invalid_pool_id;
+    reset_stats();
+
+    // The pool we leave is still good as a standby if it is up
+    if(old_id != invalid_pool_id && pick_pool_by_id(old_id)->is_logged_in())
+        standby_pool_id = old_id;
+
+    pool_job oPoolJob;
+    if(jconf::inst()->GetProxyPort() != 0 && pick_pool_by_id(pool_id)->get_current_job(oPoolJob))
+        proxy::inst()->push_job(oPoolJob, pool_id, oJobRegistry.intern(pool_id, oPoolJob));
+
+    // During dev time we pick it up when switching back
+    if(current_pool_id != dev_pool_id)
+        mine_active_pool();
+}
+
+void executor::mine_active_pool()
+{
+    current_pool_id = active_pool_id;
+    jpsock* pool = pick_pool_by_id(active_pool_id);
+    pool_job oPoolJob;
+
+    if(!pool->get_current_job(oPoolJob))
+    {
+        size_t failover_id = pick_failover();
+        if(failover_id != invalid_pool_id)
+            return set_active_pool(failover_id);
+
+        // Nothing to mine on, it starts again with the next job
+        stall_miners();
+        return;
+    }
+
+    iPoolDiff = pool->get_current_diff();
+    mine_pool_job(active_pool_id, oPoolJob, oJobRegistry.intern(active_pool_id, oPoolJob));
+}
+
+void executor::mine_pool_job(size_t pool_id, pool_job& oPoolJob, uint32_t iJobHandle)
+{
+    // Proxy workers and job bus followers own the other values of the top nonce byte, we keep to 0.
+    // Proxy workers never see the dev pool, the followers do.
+    bool bBusLeader = jconf::inst()->GetJobBusRole() == jconf::bus_leader;
+    bool bSlots = bBusLeader || (pool_id != dev_pool_id && jconf::inst()->GetProxyPort() != 0);
+    if(bSlots && oPoolJob.iWorkLen > minethd::iNonceTopByte)
+        oPoolJob.bWorkBlob[minethd::iNonceTopByte] = 0;
+
+    minethd::miner_work oWork(iJobHandle, oPoolJob.bWorkBlob,
+        oPoolJob.iWorkLen, oPoolJob.iResumeCnt, oPoolJob.iTarget,
+        bSlots || (pool_id != dev_pool_id && jconf::inst()->NiceHashMode()), pool_id);
+
+    minethd::switch_work(oWork);
+    iJobSwitches++;
+
+    if(bBusLeader)
+        job_bus::inst()->publish(oWork);
+}
+
+/* Difficulty that gives us a share every auto_difficulty_time seconds, or zero if the pool should decide.
+   We take the 60 second average if we have one, so that a reconnect after a short glitch doesn't
+   go by the few seconds we were stalled. Nothing is known on the first connect. */
+uint64_t executor::calc_auto_diff()
+{
+    uint64_t iTime = jconf::inst()->GetAutoDiffTime();
+    if(iTime == 0 || jconf::inst()->GetFixedDiff() != 0)
+        return 0;
+
+    double fHps = 0.0;
+    for(size_t i = 0; i < pvThreads->size(); i++)
+    {
+        double fTelem = telem->calc_telemetry_data(60000, i);
+        if(!std::isnormal(fTelem))
+            fTelem = telem->calc_telemetry_data(5000, i);
+        if(!std::isnormal(fTelem))
+            return 0;
+        fHps += fTelem;
+    }
+
+    uint64_t iDiff = (uint64_t)(fHps * iTime);
+    return iDiff > 0 ? iDiff : 1;
+}
+
+void executor::stall_miners()
+{
+    minethd::miner_work oWork;
+    minethd::switch_work(oWork);
+
+    if(jconf::inst()->GetJobBusRole() == jconf::bus_leader)
+        job_bus::inst()->publish(oWork);
+}
+
+void executor::mine_split_job(size_t pool_id, pool_job& oPoolJob, uint32_t iJobHandle, uint32_t iShare)
+{
+    // Job bus followers mine the split too, so we keep to our top nonce byte like in mine_pool_job
+    bool bBusLeader = jconf::inst()->GetJobBusRole() == jconf::bus_leader;
+    if(bBusLeader && oPoolJob.iWorkLen > minethd::iNonceTopByte)
+        oPoolJob.bWorkBlob[minethd::iNonceTopByte] = 0;
+
+    minethd::miner_work oWork(iJobHandle, oPoolJob.bWorkBlob, oPoolJob.iWorkLen, oPoolJob.iResumeCnt,
+        oPoolJob.iTarget, bBusLeader, pool_id);
+    minethd::switch_split_work(oWork, iShare);
+
+    if(bBusLeader)
+        job_bus::inst()->publish_split(oWork, iShare);
+}
+
+void executor::stall_split()
+{
+    minethd::miner_work oWork;
+    minethd::switch_split_work(oWork, 0);
+
+    if(jconf::inst()->GetJobBusRole() == jconf::bus_leader)
+        job_bus::inst()->publish_split(oWork, 0);
 }
 
 void executor::on_sock_ready(size_t pool_id)
@@ -179,28 +459,49 @@ void executor::on_sock_ready(size_t pool_id)
 
     if(pool_id == dev_pool_id)
     {
-        if(!pool->cmd_login("", ""))
+        if(!pool->cmd_login(0))
+        {
             pool->disconnect();
+            return;
+        }
+
+        if(jconf::inst()->DonationSplit())
+        {
+            printer::inst()->print_msg(L1, "Dev pool logged in. It gets %.1f%% of the hashes.", 100.0 * iDevSplitShare / minethd::iSplitScale);
+            return;
+        }
 
         current_pool_id = dev_pool_id;
         printer::inst()->print_msg(L1, "Dev pool logged in. Switching work.");
         return;
     }
 
-    printer::inst()->print_msg(L1, "Connected. Logging in...");
+    printer::inst()->print_msg(L1, "Connected to %s. Logging in...", pool->get_pool_addr());
+
+    uint64_t iAutoDiff = calc_auto_diff();
+    if(iAutoDiff != 0)
+        printer::inst()->print_msg(L2, "Asking %s for difficulty %llu.", pool->get_pool_addr(), (long long unsigned int)iAutoDiff);
 
-    if (!pool->cmd_login(jconf::inst()->GetWalletAddress(), jconf::inst()->GetPoolPwd()))
+    using namespace std::chrono;
+    steady_clock::time_point tStart = steady_clock::now();
+
+    if (!pool->cmd_login(iAutoDiff))
     {
         if(!pool->have_sock_error())
         {
             log_socket_error(pool->get_call_error());
             pool->disconnect();
         }
+        return;
     }
-    else
+
+    add_rtt_sample(pool_id, duration_cast<milliseconds>(steady_clock::now() - tStart).count());
+    iReconnectAttempts = 0;
+
+    if(pool_id == active_pool_id)
     {
-        iReconnectAttempts = 0;
         reset_stats();
+        eval_pools();
     }
 }
 
@@ -212,6 +513,13 @@ void executor::on_sock_error(size_t pool_id, std::string&& sError)
     {
         pool->disconnect();
 
+        if(jconf::inst()->DonationSplit())
+        {
+            stall_split();
+            push_timed_event(ex_event(EV_RECONNECT, dev_pool_id), iDevSplitRetry);
+            return;
+        }
+
         if(current_pool_id != dev_pool_id)
             return;
 
@@ -220,26 +528,75 @@ void executor::on_sock_error(size_t pool_id, std::string&& sError)
         return;
     }
 
-    log_socket_error(std::move(sError));
     pool->disconnect();
-    sched_reconnect();
+
+    pool_state& st = get_pool_state(pool_id);
+    if(st.bClosing)
+    {
+        // We hung up on it ourselves, it is free to be picked again
+        st.bClosing = false;
+        eval_pools();
+        return;
+    }
+
+    if(pools.size() > 2)
+        sError = std::string(pool->get_pool_addr()) + " " + sError;
+    log_socket_error(std::move(sError));
+
+    if(pool_id == standby_pool_id)
+        standby_pool_id = invalid_pool_id;
+
+    if(pool_id == active_pool_id)
+    {
+        size_t failover_id = pick_failover();
+        if(failover_id != invalid_pool_id)
+        {
+            printer::inst()->print_msg(L1, "Pool %s lost. Switching over to %s.",
+                pool->get_pool_addr(), pick_pool_by_id(failover_id)->get_pool_addr());
+            set_active_pool(failover_id);
+        }
+    }
+
+    sched_reconnect(pool_id);
+    eval_pools();
 }
 #pragma GCC reset_options
 
 #pragma GCC optimize ("O2")
 void executor::on_pool_have_job(size_t pool_id, pool_job& oPoolJob)
 {
+    // Standby jobs too, so that we know when shares for the standby go stale
+    uint32_t iJobHandle = oJobRegistry.intern(pool_id, oPoolJob);
+
+    // Proxy workers stay on the user pool, dev time or not
+    if(jconf::inst()->GetProxyPort() != 0 && pool_id == active_pool_id)
+        proxy::inst()->push_job(oPoolJob, pool_id, iJobHandle);
+
+    if(!vShareBuffer.empty())
+        replay_shares(pool_id, iJobHandle);
+
+    if(pool_id == dev_pool_id && jconf::inst()->DonationSplit())
+    {
+        mine_split_job(dev_pool_id, oPoolJob, iJobHandle, iDevSplitShare);
+        return;
+    }
+
     if(pool_id != current_pool_id)
+    {
+        // A standby that gets a job while the active pool has nothing takes over
+        if(pool_id != dev_pool_id && current_pool_id == active_pool_id &&
+            !pick_pool_by_id(active_pool_id)->have_current_job())
+        {
+            printer::inst()->print_msg(L1, "Pool %s has work. Switching over.", pick_pool_by_id(pool_id)->get_pool_addr());
+            set_active_pool(pool_id);
+            eval_pools();
+        }
         return;
+    }
 
     jpsock* pool = pick_pool_by_id(pool_id);
 
-    minethd::miner_work oWork(oPoolJob.sJobID, oPoolJob.bWorkBlob,
-        oPoolJob.iWorkLen, oPoolJob.iResumeCnt, oPoolJob.iTarget,
-        pool_id != dev_pool_id && jconf::inst()->NiceHashMode(),
-        pool_id);
-
-    minethd::switch_work(oWork);
+    mine_pool_job(pool_id, oPoolJob, iJobHandle);
 
     if(pool_id == dev_pool_id)
         return;
@@ -256,55 +613,174 @@ void executor::on_pool_have_job(size_t pool_id, pool_job& oPoolJob)
 void executor::on_miner_result(size_t pool_id, job_result& oResult)
 {
     jpsock* pool = pick_pool_by_id(pool_id);
+    const job_registry::job_entry* job = oJobRegistry.find(oResult.iJobHandle);
+
+    CG_PROBE2(submit_start, pool_id, oResult.iJobHandle);
+
+    // Shares for a block that is already gone can only be rejected, don't waste a round-trip on them
+    bool bStale = job == nullptr || job->iPoolId != pool_id || job->bStale;
 
     if(pool_id == dev_pool_id)
     {
         //Ignore errors silently
-        if(pool->is_running() && pool->is_logged_in())
-            pool->cmd_submit(oResult.sJobID, oResult.iNonce, oResult.bResult);
+        if(!bStale && pool->is_running() && pool->is_logged_in())
+            pool->cmd_submit(job->sJobID, oResult.iNonce, oResult.bResult, 0, 0);
+
+        CG_PROBE3(submit_end, pool_id, oResult.iJobHandle, 3);
+        return;
+    }
 
+    if(bStale)
+    {
+        iStaleDropped++;
+        if(oResult.iProxyTag != 0)
+            proxy::inst()->submit_reply(oResult.iProxyTag, "Block expired");
+        CG_PROBE3(submit_end, pool_id, oResult.iJobHandle, 1);
         return;
     }
 
+    // A short outage shouldn't cost us the share, keep it until the pool is back
+    if((!pool->is_running() || !pool->is_logged_in()) && vShareBuffer.size() < iShareBufferSize)
+    {
+        vShareBuffer.emplace_back(pool_id, oResult);
+        CG_PROBE3(submit_end, pool_id, oResult.iJobHandle, 2);
+        return;
+    }
+
+    submit_share(pool, job, oResult);
+    CG_PROBE3(submit_end, pool_id, oResult.iJobHandle, 0);
+}
+
+void executor::submit_share(jpsock* pool, const job_registry::job_entry* job, job_result& oResult, bool bReplay)
+{
+    if(job->bSuperseded)
+        iSupersededSent++;
+
+    {
+        using namespace std::chrono;
+        iJobAgeMs += duration_cast<milliseconds>(steady_clock::now() - job->tSeen).count();
+        iJobAgeCnt++;
+    }
+
+    const char* sError = nullptr;
+    uint64_t* targets = (uint64_t*)oResult.bResult;
+
+    // The reply comes back as EV_POOL_SUBMIT_RESULT, we don't wait for it here
     if (!pool->is_running() || !pool->is_logged_in())
+        sError = "[NETWORK ERROR]";
+    else if(!pool->cmd_submit(job->sJobID, oResult.iNonce, oResult.bResult, jpsock::t64_to_diff(targets[3]), oResult.iProxyTag, bReplay))
+        sError = "[TOO MANY SUBMITS IN FLIGHT]";
+
+    if(sError != nullptr)
+    {
+        if(bReplay)
+            iSharesLost++;
+        if(oResult.iProxyTag != 0)
+            proxy::inst()->submit_reply(oResult.iProxyTag, sError);
+        log_result_error(sError);
+    }
+}
+
+// iJobHandle is the job the pool just sent, the first one after the login
+void executor::replay_shares(size_t pool_id, uint32_t iJobHandle)
+{
+    jpsock* pool = pick_pool_by_id(pool_id);
+    if(!pool->is_logged_in())
+        return;
+
+    size_t n = 0, iSent = 0;
+    for(size_t i = 0; i < vShareBuffer.size(); i++)
     {
-        log_result_error("[NETWORK ERROR]");
+        buffered_share& share = vShareBuffer[i];
+        if(share.iPoolId != pool_id)
+        {
+            vShareBuffer[n++] = share;
+            continue;
+        }
+
+        // A new session usually means new job ids, the old one is only good if the pool sent it again
+        const job_registry::job_entry* job = oJobRegistry.find(share.oResult.iJobHandle);
+        if(job == nullptr || job->bStale || share.oResult.iJobHandle != iJobHandle)
+        {
+            iSharesLost++;
+            if(share.oResult.iProxyTag != 0)
+                proxy::inst()->submit_reply(share.oResult.iProxyTag, "Job expired");
+            continue;
+        }
+
+        submit_share(pool, job, share.oResult, true);
+        iSent++;
+    }
+
+    if(n == vShareBuffer.size())
+        return;
+
+    printer::inst()->print_msg(L2, "Replayed %llu of %llu shares found while %s was down.",
+        int_port(iSent), int_port(vShareBuffer.size() - n), pool->get_pool_addr());
+
+    vShareBuffer.erase(vShareBuffer.begin() + n, vShareBuffer.end());
+    flush_submits();
+}
+
+void executor::on_pool_submit_result(size_t pool_id, submit_result& oResult)
+{
+    if(pool_id == dev_pool_id)
         return;
+
+    if(oResult.iProxyTag != 0)
+        proxy::inst()->submit_reply(oResult.iProxyTag, oResult.sError);
+
+    if(oResult.bReplay)
+    {
+        if(oResult.sError.empty())
+            iSharesRecovered++;
+        else
+            iSharesLost++;
     }
 
-    using namespace std::chrono;
-    size_t t_start = time_point_cast<milliseconds>(high_resolution_clock::now()).time_since_epoch().count();
-    bool bResult = pool->cmd_submit(oResult.sJobID, oResult.iNonce, oResult.bResult);
-    size_t t_len = time_point_cast<milliseconds>(high_resolution_clock::now()).time_since_epoch().count() - t_start;
+    if(oResult.bNetError)
+    {
+        log_result_error(std::move(oResult.sError));
+        return;
+    }
+
+    add_rtt_sample(pool_id, oResult.iCallTime);
+    CG_PROBE3(submit_result, pool_id, oResult.iCallTime, oResult.sError.empty());
+
+    oCallTimes.add(oResult.iCallTime);
+    oCallWindow.add(oResult.iCallTime, tsc_clock::now_ms());
 
-    if(t_len > 0xFFFF)
-        t_len = 0xFFFF;
-    iPoolCallTimes.push_back((uint16_t)t_len);
+    size_t iBucket = std::lower_bound(iSubmitLatBuckets.begin(), iSubmitLatBuckets.end(), oResult.iCallTime) - iSubmitLatBuckets.begin();
+    iSubmitLatHist[iBucket]++;
+    iSubmitLatSumMs += oResult.iCallTime;
 
-    if(bResult)
+    if(oResult.sError.empty())
     {
-        uint64_t* targets = (uint64_t*)oResult.bResult;
-        log_result_ok(jpsock::t64_to_diff(targets[3]));
+        get_pool_state(pool_id).iAccepted++;
+        log_result_ok(oResult.iActualDiff);
         printer::inst()->print_msg(L3, GREEN("Result accepted by the pool."));
     }
     else
     {
-        if(!pool->have_sock_error())
-        {
-            printer::inst()->print_msg(L3, RED("Result rejected by the pool."));
+        get_pool_state(pool_id).iRejected++;
+        printer::inst()->print_msg(L3, RED("Result rejected by the pool."));
 
-            std::string error = pool->get_call_error();
+        if(strncasecmp(oResult.sError.c_str(), "Unauthenticated", 15) == 0)
+        {
+            printer::inst()->print_msg(L2, YELLOW("Your miner was unable to find a share in time. Either the pool difficulty is too high, or the pool timeout is too low."));
+            pick_pool_by_id(pool_id)->disconnect();
+        }
 
-            if(strncasecmp(error.c_str(), "Unauthenticated", 15) == 0)
-            {
-                printer::inst()->print_msg(L2, YELLOW("Your miner was unable to find a share in time. Either the pool difficulty is too high, or the pool timeout is too low."));
-                pool->disconnect();
-            }
+        log_result_error(std::move(oResult.sError));
+    }
+}
 
-            log_result_error(std::move(error));
-        }
-        else
-            log_result_error("[NETWORK ERROR]");
+void executor::flush_submits()
+{
+    for(jpsock* pool : pools)
+    {
+        if(pool->have_queued_submits())
+            pool->cmd_flush();
     }
 }
 #pragma GCC reset_options
@@ -312,108 +788,311 @@ void executor::on_miner_result(size_t pool_id, job_result& oResult)
 #pragma GCC optimize ("Os")
 void executor::on_reconnect(size_t pool_id)
 {
-    jpsock* pool = pick_pool_by_id(pool_id);
-
-    std::string error;
     if(pool_id == dev_pool_id)
+    {
+        // Only used with a donation split, failures are retried without any fuss
+        std::string error;
+        if(!pick_pool_by_id(dev_pool_id)->connect(error))
+            push_timed_event(ex_event(EV_RECONNECT, dev_pool_id), iDevSplitRetry);
+        return;
+    }
+
+    get_pool_state(pool_id).bWaitRetry = false;
+    eval_pools();
+}
+
+void executor::on_switch_pool(size_t pool_id)
+{
+    // Any user pool id means back to the active pool
+    if((pool_id == dev_pool_id) == (current_pool_id == dev_pool_id))
         return;
 
-    printer::inst()->print_msg(L1, "Connecting to pool %s ...", jconf::inst()->GetPoolAddress());
+    jpsock* pool = pick_pool_by_id(pool_id);
+    if(pool_id == dev_pool_id)
+    {
+        std::string error;
+
+        // If it fails, it fails, we carry on on the usr pool
+        // as we never receive further events
+        printer::inst()->print_msg(L1, "Connecting to dev pool...");
+        if(!pool->connect(error))
+            printer::inst()->print_msg(L1, "Error connecting to dev pool. Staying with user pool.");
+    }
+    else
+    {
+        printer::inst()->print_msg(L1, "Switching back to user pool.");
+
+        mine_active_pool();
+
+        if(pick_pool_by_id(dev_pool_id)->is_running())
+            push_timed_event(ex_event(EV_DEV_POOL_EXIT), 5);
+    }
+}
+
+inline const char* hps_format(double h, char* buf, size_t l)
+{
+    if(std::isfinite(h))
+    {
+        snprintf(buf, l, " %05.2lf", h);
+        return buf;
+    }
+    else
+        return "  (na)";
+}
+
+inline const char* ctr_format(double v, int width, int prec, char* buf, size_t l)
+{
+    if(std::isfinite(v))
+        snprintf(buf, l, "%*.*f", width, prec, v);
+    else
+        snprintf(buf, l, "%*s", width, "(na)");
+    return buf;
+}
+
+// NaN if the window is empty
+inline double hash_time_ms(const latency_hist& h, uint32_t iUnits)
+{
+    return h.count() > 0 ? iUnits * (minethd::iHashTimeUnitUs / 1000.0) : NAN;
+}
+
+// How far the 99th percentile is above the median, in %
+inline double hash_time_jitter(const latency_hist& h)
+{
+    uint32_t iMedian = h.quantile(0.5);
+    return iMedian > 0 ? 100.0 * (h.quantile(0.99) - iMedian) / iMedian : NAN;
+}
+
+inline const char* hps_format_color(double h, char* buf, size_t l)
+{
+    if(std::isfinite(h))
+    {
+        snprintf(buf, l, GREEN(" %05.2lf"), h);
+        return buf;
+    }
+    else
+        return RED("  (na)");
+}
+#pragma GCC reset_options
+
+bool executor::perf_tick()
+{
+    flight_recorder::inst()->check_dump_request();
+
+    size_t i;
+    for (i = 0; i < pvThreads->size(); i++)
+        telem->push_perf_value(i, pvThreads->at(i)->get_hash_count(),
+        pvThreads->at(i)->get_timestamp());
+
+    if((iTickCnt++ & 0xF) != 0) //Every 16 ticks
+        return false;
+
+    sample_counters();
+    sample_hash_times();
+
+    double fHps = 0.0;
+    double fTelem;
+    bool normal = true;
+    char num[16];
+    char strbuf[64];
+
+    for (i = 0; i < pvThreads->size(); i++)
+    {
+        fTelem = telem->calc_telemetry_data(5000, i);
+        if(std::isnormal(fTelem))
+        {
+            fHps += fTelem;
+        }
+        else
+        {
+            normal = false;
+            break;
+        }
+    }
+
+    if(normal && fHighestHps < fHps)
+        fHighestHps = fHps;
 
-    if(!pool->connect(jconf::inst()->GetPoolAddress(), error))
-    {
-        log_socket_error(std::move(error));
-        sched_reconnect();
-    }
+    snprintf(strbuf, sizeof(strbuf), "%sH/s %s", hps_format(fHps, num, sizeof(num)), XMR_STAK_NAME);
+    printer::inst()->set_title(strbuf);
+    return true;
 }
 
-void executor::on_switch_pool(size_t pool_id)
+static double counter_delta(const perf_counters::sample& now, const perf_counters::sample& last, perf_counters::counter c)
 {
-    if(pool_id == current_pool_id)
-        return;
-
-    jpsock* pool = pick_pool_by_id(pool_id);
-    if(pool_id == dev_pool_id)
-    {
-        std::string error;
+    if(!now.vValid[c] || !last.vValid[c] || now.vCount[c] < last.vCount[c])
+        return NAN;
+    return double(now.vCount[c] - last.vCount[c]);
+}
 
-        // If it fails, it fails, we carry on on the usr pool
-        // as we never receive further events
-        printer::inst()->print_msg(L1, "Connecting to dev pool...");
-        const char* dev_pool_addr;
-        int rndpool = rand() % 100;
-        if(rndpool <= 90){
-            dev_pool_addr = jconf::inst()->GetTlsSetting() ? "donate.circlestorm.org:6666" : "donate.circlestorm.org:3333";
-        }else{
-            dev_pool_addr = jconf::inst()->GetTlsSetting() ? "donate.xmr-stak.net:6666" : "donate.xmr-stak.net:3333";
-        }
-        if(!pool->connect(dev_pool_addr, error))
-            printer::inst()->print_msg(L1, "Error connecting to dev pool. Staying with user pool.");
-    }
-    else
+void executor::sample_counters()
+{
+    for(size_t i=0; i < pvThreads->size(); i++)
     {
-        printer::inst()->print_msg(L1, "Switching back to user pool.");
+        thread_counters& tc = vThdCounters[i];
+        perf_counters::sample oNow;
 
-        current_pool_id = pool_id;
-        pool_job oPoolJob;
+        uint64_t iHashes = pvThreads->at(i)->get_hash_count();
+        if(!pvThreads->at(i)->read_counters(oNow))
+            continue;
 
-        if(!pool->get_current_job(oPoolJob))
+        bHaveCounters = true;
+        if(tc.bHaveLast && iHashes > tc.iLastHashes)
         {
-            pool->disconnect();
-            return;
+            double fHashes = double(iHashes - tc.iLastHashes);
+            tc.fIpc = counter_delta(oNow, tc.oLast, perf_counters::instructions) /
+                counter_delta(oNow, tc.oLast, perf_counters::cycles);
+            tc.fLlcPerHash = counter_delta(oNow, tc.oLast, perf_counters::llc_misses) / fHashes;
+            tc.fTlbPerHash = counter_delta(oNow, tc.oLast, perf_counters::dtlb_misses) / fHashes;
         }
 
-        minethd::miner_work oWork(oPoolJob.sJobID, oPoolJob.bWorkBlob,
-            oPoolJob.iWorkLen, oPoolJob.iResumeCnt, oPoolJob.iTarget,
-            jconf::inst()->NiceHashMode(), pool_id);
-
-        minethd::switch_work(oWork);
-
-        if(dev_pool->is_running())
-            push_timed_event(ex_event(EV_DEV_POOL_EXIT), 5);
+        tc.oLast = oNow;
+        tc.iLastHashes = iHashes;
+        tc.bHaveLast = true;
     }
 }
 
-inline const char* hps_format(double h, char* buf, size_t l)
+void executor::sample_hash_times()
 {
-    if(std::isfinite(h))
+    for(size_t i=0; i < pvThreads->size(); i++)
     {
-        snprintf(buf, l, " %05.2lf", h);
-        return buf;
+        thread_hash_times& ht = vHashTimes[i];
+        if(!pvThreads->at(i)->read_hash_times(ht.vSnap[ht.iNext]))
+            continue;
+
+        const auto& vNew = ht.vSnap[ht.iNext];
+        ht.iNext = (ht.iNext + 1) % thread_hash_times::iSnapshots;
+        if(ht.iFill < thread_hash_times::iSnapshots)
+            ht.iFill++;
+
+        // Once full, iNext points at the oldest one
+        const auto& vOld = ht.vSnap[ht.iFill < thread_hash_times::iSnapshots ? 0 : ht.iNext];
+
+        ht.oWindow.clear();
+        for(size_t b=0; b < latency_hist::iBuckets; b++)
+            ht.oWindow.add_bucket(b, vNew[b] - vOld[b]);
     }
-    else
-        return "  (na)";
 }
 
-inline const char* hps_format_color(double h, char* buf, size_t l)
+const char* executor::hash_time_flag(const latency_hist& h)
 {
-    if(std::isfinite(h))
+    if(h.count() < iHashTimeMinCount)
+        return "";
+
+    double fMedian = h.quantile(0.5);
+    if(h.quantile(0.99) >= fMedian * fContendedRatio)
+        return "contended";
+    if(h.max() >= fMedian * fPreemptedRatio)
+        return "preempted";
+    return "";
+}
+
+void executor::ex_follower_main()
+{
+    if(!job_bus::inst()->start_follower(jconf::inst()->GetJobBusName()))
+        exit(1);
+
+    ex_event ev;
+    std::thread clock_thd(&executor::ex_clock_thd, this);
+
+    vMineResults.emplace_back();
+
+    if(jconf::inst()->GetVerboseLevel() >= 4)
+        push_timed_event(ex_event(EV_HASHRATE_LOOP), jconf::inst()->GetAutohashTime());
+
+    // No pools here, jobs come from the bus thread straight to the miners
+    while (true)
     {
-        snprintf(buf, l, GREEN(" %05.2lf"), h);
-        return buf;
+        ev = oEventQ.pop();
+
+        switch (ev.iName)
+        {
+        case EV_MINER_HAVE_RESULT:
+            if(job_bus::inst()->push_result(ev.oJobResult, ev.iPoolId))
+                iBusResults++;
+            else
+                log_result_error("[JOB BUS FULL]");
+            break;
+
+        case EV_PERF_TICK:
+            job_bus::inst()->heartbeat();
+            perf_tick();
+            publish_http_snapshot();
+            publish_stats_shm();
+            break;
+
+        case EV_USR_HASHRATE:
+        case EV_USR_RESULTS:
+        case EV_USR_CONNSTAT:
+            print_report(ev.iName);
+            break;
+
+        case EV_HASHRATE_LOOP:
+            print_report(EV_USR_HASHRATE);
+            push_timed_event(ex_event(EV_HASHRATE_LOOP), jconf::inst()->GetAutohashTime());
+            break;
+
+        // Dev time and everything to do with pools is the leader's business
+        default:
+            break;
+        }
     }
-    else
-        return RED("  (na)");
 }
-#pragma GCC reset_options
 
 void executor::ex_main()
 {
     assert(1000 % iTickTime == 0);
+    flight_recorder::inst()->set_thread_name("executor");
 
     minethd::miner_work oWork = minethd::miner_work();
     pvThreads = minethd::thread_starter(oWork);
     telem = new telemetry(pvThreads->size());
+    vThdCounters.resize(pvThreads->size());
+    vHashTimes.resize(pvThreads->size());
+
+    // Followers can only join once the miner threads are up
+    if(jconf::inst()->GetJobBusRole() == jconf::bus_follower)
+        return ex_follower_main();
+
+    jconf::pool_cfg cfg;
+    size_t pool_count = jconf::inst()->GetPoolCount();
+    pools.reserve(pool_count + 1);
+    vPoolState.resize(pool_count + 1);
+
+    // The dev pool follows the TLS setting of the first pool
+    jconf::inst()->GetPoolConfig(0, cfg);
+    const char* dev_pool_addr;
+    if(rand() % 100 <= 90)
+        dev_pool_addr = cfg.tls ? "donate.circlestorm.org:6666" : "donate.circlestorm.org:3333";
+    else
+        dev_pool_addr = cfg.tls ? "donate.xmr-stak.net:6666" : "donate.xmr-stak.net:3333";
+    pools.push_back(new jpsock(dev_pool_id, dev_pool_addr, "", "", 0.0, cfg.tls, ""));
+
+    for(size_t i = 0; i < pool_count; i++)
+    {
+        jconf::inst()->GetPoolConfig(i, cfg);
+        pools.push_back(new jpsock(usr_pool_id + i, cfg.sPoolAddr, cfg.sWalletAddr, cfg.sPasswd,
+            cfg.weight, cfg.tls, cfg.tls_fingerprint));
+    }
 
-    current_pool_id = usr_pool_id;
-    usr_pool = new jpsock(usr_pool_id, jconf::inst()->GetTlsSetting());
-    dev_pool = new jpsock(dev_pool_id, jconf::inst()->GetTlsSetting());
+    // Nothing measured yet, so this is the highest weight, or the first one of those
+    active_pool_id = usr_pool_id;
+    for(size_t i = usr_pool_id; i <= pools.size(); i++)
+    {
+        if(pool_score(i) > pool_score(active_pool_id))
+            active_pool_id = i;
+    }
+    current_pool_id = active_pool_id;
 
     ex_event ev;
     std::thread clock_thd(&executor::ex_clock_thd, this);
 
     //This will connect us to the pool for the first time
-    push_event(ex_event(EV_RECONNECT, usr_pool_id));
+    push_event(ex_event(EV_RECONNECT, active_pool_id));
+
+    // The dev pool joins once we are up and running
+    iDevSplitShare = (uint32_t)round(fDevDonationLevel * minethd::iSplitScale);
+    if(jconf::inst()->DonationSplit() && iDevSplitShare != 0)
+        push_timed_event(ex_event(EV_RECONNECT, dev_pool_id), 10);
 
     // Place the default success result at position 0, it needs to
     // be here even if our first result is a failure
@@ -423,53 +1102,47 @@ void executor::ex_main()
     if(jconf::inst()->GetVerboseLevel() >= 4)
         push_timed_event(ex_event(EV_HASHRATE_LOOP), jconf::inst()->GetAutohashTime());
 
-    size_t cnt = 0, i;
     while (true)
     {
         ev = oEventQ.pop();
+
+        // Results that arrive back-to-back are sent to the pool in a single write
+        if(ev.iName != EV_MINER_HAVE_RESULT)
+            flush_submits();
+
         switch (ev.iName)
         {
         case EV_MINER_HAVE_RESULT:
             on_miner_result(ev.iPoolId, ev.oJobResult);
+            if(oEventQ.empty())
+                flush_submits();
             break;
 
         case EV_POOL_HAVE_JOB:
             on_pool_have_job(ev.iPoolId, ev.oPoolJob);
             break;
 
+        case EV_POOL_SUBMIT_RESULT:
+            on_pool_submit_result(ev.iPoolId, ev.oSubmitResult);
+            break;
+
         case EV_PERF_TICK:
-            for (i = 0; i < pvThreads->size(); i++)
-                telem->push_perf_value(i, pvThreads->at(i)->iHashCount.load(std::memory_order_relaxed),
-                pvThreads->at(i)->iTimestamp.load(std::memory_order_relaxed));
+            for(jpsock* pool : pools)
+            {
+                pool->check_call_timeout();
+                pool->check_keepalive();
+            }
+
+            if(jconf::inst()->GetJobBusRole() == jconf::bus_leader)
+                job_bus::inst()->heartbeat();
 
-            if((cnt++ & 0xF) == 0) //Every 16 ticks
+            if(perf_tick())
             {
-                double fHps = 0.0;
-                double fTelem;
-                bool normal = true;
-                char num[16];
-                char strbuf[64];
-
-                for (i = 0; i < pvThreads->size(); i++)
-                {
-                    fTelem = telem->calc_telemetry_data(5000, i);
-                    if(std::isnormal(fTelem))
-                    {
-                        fHps += fTelem;
-                    }
-                    else
-                    {
-                        normal = false;
-                        break;
-                    }
-                }
-
-                if(normal && fHighestHps < fHps)
-                    fHighestHps = fHps;
-
-                snprintf(strbuf, sizeof(strbuf), "%sH/s %s", hps_format(fHps, num, sizeof(num)), XMR_STAK_NAME);
-                printer::inst()->set_title(strbuf);
+                eval_active_pool();
+                eval_pools();
             }
+            publish_http_snapshot();
+            publish_stats_shm();
         break;
 
         case EV_SOCK_READY:
@@ -489,7 +1162,7 @@ void executor::ex_main()
             break;
 
         case EV_DEV_POOL_EXIT:
-            dev_pool->disconnect();
+            pick_pool_by_id(dev_pool_id)->disconnect();
             break;
 
         case EV_USR_HASHRATE:
@@ -498,13 +1171,6 @@ void executor::ex_main()
             print_report(ev.iName);
             break;
 
-        case EV_HTML_HASHRATE:
-        case EV_HTML_RESULTS:
-        case EV_HTML_CONNSTAT:
-        case EV_HTML_JSON:
-            http_report(ev.iName);
-            break;
-
         case EV_HASHRATE_LOOP:
             print_report(EV_USR_HASHRATE);
             push_timed_event(ex_event(EV_HASHRATE_LOOP), jconf::inst()->GetAutohashTime());
@@ -526,7 +1192,7 @@ void executor::hashrate_report(std::string& out)
 
     out.reserve(256 + nthd * 64);
 
-    double fTotal[3] = { 0.0, 0.0, 0.0};
+    double fTotal[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
     size_t i;
 
     out.append(YELLOW("HASHRATE REPORT\n"));
@@ -559,6 +1225,8 @@ void executor::hashrate_report(std::string& out)
         fTotal[0] += fHps[0];
         fTotal[1] += fHps[1];
         fTotal[2] += fHps[2];
+        fTotal[3] += telem->calc_telemetry_data(3600000, i);
+        fTotal[4] += telem->calc_telemetry_data(86400000, i);
 
         if((i & 0x1) == 1) //Odd i's
             out.append(CYAN("|\n"));
@@ -576,10 +1244,45 @@ void executor::hashrate_report(std::string& out)
     out.append(hps_format_color(fTotal[0], num, sizeof(num)));
     out.append(hps_format_color(fTotal[1], num, sizeof(num)));
     out.append(hps_format_color(fTotal[2], num, sizeof(num)));
+    out.append(CYAN(" H/s\n1h / 24h:"));
+    out.append(hps_format_color(fTotal[3], num, sizeof(num)));
+    out.append(hps_format_color(fTotal[4], num, sizeof(num)));
     out.append(CYAN(" H/s\nHighest: "));
     out.append(hps_format_color(fHighestHps, num, sizeof(num)));
     out.append(CYAN(" H/s"));
     out.append("\n");
+
+    char line[256];
+    out.append(YELLOW("\nHASH TIMES (1m)\n"));
+    out.append(CYAN("| ") YELLOW("ID ") CYAN("|  ") YELLOW("p50 ms ") CYAN("|  ") YELLOW("p99 ms ") CYAN("|  ")
+        YELLOW("max ms ") CYAN("| ") YELLOW("jitter ") CYAN("|\n"));
+    for (i = 0; i < nthd; i++)
+    {
+        const latency_hist& h = vHashTimes[i].oWindow;
+        char p50[16], p99[16], max[16], jitter[16];
+        snprintf(line, sizeof(line), CYAN("| ") YELLOW("%2u ") CYAN("| ") "%s" CYAN(" | ") "%s" CYAN(" | ") "%s" CYAN(" | ") "%s%%" CYAN(" | ") RED("%s") "\n",
+            (unsigned int)i, ctr_format(hash_time_ms(h, h.quantile(0.5)), 8, 2, p50, sizeof(p50)),
+            ctr_format(hash_time_ms(h, h.quantile(0.99)), 8, 2, p99, sizeof(p99)),
+            ctr_format(hash_time_ms(h, h.max()), 8, 2, max, sizeof(max)),
+            ctr_format(hash_time_jitter(h), 5, 0, jitter, sizeof(jitter)), hash_time_flag(h));
+        out.append(line);
+    }
+
+    if(!bHaveCounters)
+        return;
+
+    out.append(YELLOW("\nHARDWARE COUNTERS\n"));
+    out.append(CYAN("| ") YELLOW("ID ") CYAN("|  ") YELLOW("IPC ") CYAN("| ") YELLOW("LLC miss/hash ")
+        CYAN("| ") YELLOW("TLB miss/hash ") CYAN("|\n"));
+    for (i = 0; i < nthd; i++)
+    {
+        const thread_counters& tc = vThdCounters[i];
+        char ipc[16], llc[16], tlb[16];
+        snprintf(line, sizeof(line), CYAN("| ") YELLOW("%2u ") CYAN("| ") "%s" CYAN(" | ") "%s" CYAN(" | ") "%s" CYAN(" |\n"),
+            (unsigned int)i, ctr_format(tc.fIpc, 4, 2, ipc, sizeof(ipc)),
+            ctr_format(tc.fLlcPerHash, 13, 1, llc, sizeof(llc)), ctr_format(tc.fTlbPerHash, 13, 1, tlb, sizeof(tlb)));
+        out.append(line);
+    }
 }
 
 char* time_format(char* buf, size_t len, std::chrono::system_clock::time_point time)
@@ -617,6 +1320,15 @@ void executor::result_report(std::string& out)
         iTotalRes += vMineResults[i].count;
 
     out.append("RESULT REPORT\n");
+    if(jconf::inst()->GetJobBusRole() == jconf::bus_follower)
+    {
+        out.append("Results are submitted and counted by the job bus leader.\n");
+        out.append("Handed over      : ").append(std::to_string(iBusResults)).append(1, '\n');
+        if(ln > 1)
+            out.append("Dropped          : ").append(std::to_string(iTotalRes)).append(" (job bus full)\n");
+        return;
+    }
+
     if(iTotalRes == 0)
     {
         out.append("You haven't found any results yet.\n");
@@ -635,13 +1347,25 @@ void executor::result_report(std::string& out)
     out.append("Good results     : ").append(std::to_string(iGoodRes)).append(" / ").
         append(std::to_string(iTotalRes)).append(num);
 
-    if(iPoolCallTimes.size() != 0)
+    if(oCallTimes.count() != 0)
     {
-        // Here we use iPoolCallTimes since it also gets reset when we disconnect
-        snprintf(num, sizeof(num), "%.1f sec\n", dConnSec / iPoolCallTimes.size());
+        // Here we use oCallTimes since it also gets reset when we disconnect
+        snprintf(num, sizeof(num), "%.1f sec\n", dConnSec / oCallTimes.count());
         out.append("Avg result time  : ").append(num);
     }
-    out.append("Pool-side hashes : ").append(std::to_string(iPoolHashes)).append(2, '\n');
+    out.append("Pool-side hashes : ").append(std::to_string(iPoolHashes)).append(1, '\n');
+
+    // Stale shares never reach the pool, so they are not part of the totals above
+    out.append("Stale dropped    : ").append(std::to_string(iStaleDropped)).append(1, '\n');
+    out.append("Superseded sent  : ").append(std::to_string(iSupersededSent)).append(1, '\n');
+    snprintf(num, sizeof(num), "%llu (%llu lost)\n", int_port(iSharesRecovered), int_port(iSharesLost));
+    out.append("Shares recovered : ").append(num);
+    if(iJobAgeCnt != 0)
+    {
+        snprintf(num, sizeof(num), "%.1f sec\n", iJobAgeMs / 1000.0 / iJobAgeCnt);
+        out.append("Avg job age      : ").append(num);
+    }
+    out.append(1, '\n');
     out.append("Top 10 best results found:\n");
 
     for(size_t i=0; i < 10; i += 2)
@@ -673,26 +1397,84 @@ void executor::connection_report(std::string& out)
 
     out.reserve(512);
 
-    jpsock* pool = pick_pool_by_id(dev_pool_id + 1);
-
     out.append("CONNECTION REPORT\n");
-    out.append("Pool address    : ").append(jconf::inst()->GetPoolAddress()).append(1, '\n');
-    out.append("Actual address  : ").append(pool->hostname).append(1, '\n');
+    if(jconf::inst()->GetJobBusRole() == jconf::bus_follower)
+    {
+        snprintf(num, sizeof(num), "Job bus         : %s, follower in slot %llu\n",
+            jconf::inst()->GetJobBusName(), int_port(job_bus::inst()->get_slot()));
+        out.append(num);
+        return;
+    }
+
+    jpsock* pool = pick_pool_by_id(active_pool_id);
+
+    out.append("Pool address    : ").append(pool->get_pool_addr()).append(1, '\n');
+    out.append("Actual address  : ").append(pool->get_hostname()).append(1, '\n');
     if (pool->is_running() && pool->is_logged_in())
         out.append("Connected since : ").append(time_format(date, sizeof(date), tPoolConnTime)).append(1, '\n');
     else
         out.append("Connected since : <not connected>\n");
 
-    size_t n_calls = iPoolCallTimes.size();
-    if (n_calls > 1)
-    {
-        //Not-really-but-good-enough median
-        std::nth_element(iPoolCallTimes.begin(), iPoolCallTimes.begin() + n_calls/2, iPoolCallTimes.end());
-        out.append("Pool ping time  : ").append(std::to_string(iPoolCallTimes[n_calls/2])).append(" ms\n");
-    }
+    if (oCallTimes.count() > 1)
+        out.append("Pool ping time  : ").append(std::to_string(oCallTimes.quantile(0.5))).append(" ms\n");
     else
         out.append("Pool ping time  : (n/a)\n");
 
+    latency_hist oWindow;
+    oCallWindow.get(oWindow, tsc_clock::now_ms());
+    if (oWindow.count() > 0)
+    {
+        snprintf(num, sizeof(num), "Submit latency  : p50 %u, p90 %u, p99 %u, max %u ms over 15m\n",
+            oWindow.quantile(0.5), oWindow.quantile(0.9), oWindow.quantile(0.99), oWindow.max());
+        out.append(num);
+    }
+
+    if (pool->is_tls())
+    {
+        snprintf(num, sizeof(num), "TLS handshakes  : %llu full, %llu resumed, last connect %u ms\n",
+            int_port(pool->get_full_handshakes()), int_port(pool->get_resumed_handshakes()), pool->get_handshake_time());
+        out.append(num);
+    }
+
+    if (jconf::inst()->GetProxyPort() != 0)
+    {
+        snprintf(num, sizeof(num), "Proxy workers   : %llu / %llu\n",
+            int_port(proxy::inst()->get_worker_count()), int_port(proxy::iMaxWorkers));
+        out.append(num);
+    }
+
+    if (jconf::inst()->GetJobBusRole() == jconf::bus_leader)
+    {
+        snprintf(num, sizeof(num), "Job bus         : %s, %llu / %llu followers\n", jconf::inst()->GetJobBusName(),
+            int_port(job_bus::inst()->get_follower_count()), int_port(job_bus::iMaxFollowers));
+        out.append(num);
+    }
+
+    if(pools.size() > 2)
+    {
+        out.append("\nPool list:\n");
+        out.append("| Pool address                   | Status     | Weight |   Ping  | Good   | Score  |\n");
+        for(size_t i = usr_pool_id; i <= pools.size(); i++)
+        {
+            jpsock* p = pick_pool_by_id(i);
+            pool_state& st = get_pool_state(i);
+            const char* status;
+            if(i == active_pool_id)
+                status = p->is_logged_in() ? "active" : "active/down";
+            else if(i == standby_pool_id)
+                status = p->is_logged_in() ? "standby" : "connecting";
+            else if(st.bWaitRetry)
+                status = "retry wait";
+            else
+                status = "idle";
+
+            snprintf(num, sizeof(num), "| %-30.30s | %-10s | %6.2f | %4u ms | %5.1f%% | %6.3f |\n",
+                p->get_pool_addr(), status, p->get_pool_weight(), (unsigned int)st.fRttMs,
+                100.0 * (st.iAccepted + 1) / (st.iAccepted + st.iRejected + 1), pool_score(i));
+            out.append(num);
+        }
+    }
+
     out.append("\nNetwork error log:\n");
     size_t ln = vSocketLog.size();
     if(ln > 0)
@@ -701,7 +1483,13 @@ void executor::connection_report(std::string& out)
         for(size_t i=0; i < ln; i++)
         {
             snprintf(num, sizeof(num), "| %s | %-54.54s |\n",
-                time_format(date, sizeof(date), vSocketLog[i].time), vSocketLog[i].msg.c_str());
+                time_format(date, sizeof(date), socket_log(i).time), socket_log(i).msg.c_str());
+            out.append(num);
+        }
+
+        if(iSocketErrors > ln)
+        {
+            snprintf(num, sizeof(num), "(%llu older errors not shown)\n", int_port(iSocketErrors - ln));
             out.append(num);
         }
     }
@@ -735,7 +1523,7 @@ void executor::print_report(ex_event_name ev)
 
 void executor::http_hashrate_report(std::string& out)
 {
-    char num_a[32], num_b[32], num_c[32], num_d[32];
+    char num[5][32], num_h[32];
     char buffer[4096];
     size_t nthd = pvThreads->size();
 
@@ -747,35 +1535,30 @@ void executor::http_hashrate_report(std::string& out)
     snprintf(buffer, sizeof(buffer), sHtmlHashrateBodyHigh, (unsigned int)nthd + 3);
     out.append(buffer);
 
-    double fTotal[3] = { 0.0, 0.0, 0.0};
+    double fTotal[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
     for(size_t i=0; i < nthd; i++)
     {
-        double fHps[3];
-
-        fHps[0] = telem->calc_telemetry_data(5000, i);
-        fHps[1] = telem->calc_telemetry_data(60000, i);
-        fHps[2] = telem->calc_telemetry_data(900000, i);
-
-        num_a[0] = num_b[0] = num_c[0] ='\0';
-        hps_format(fHps[0], num_a, sizeof(num_a));
-        hps_format(fHps[1], num_b, sizeof(num_b));
-        hps_format(fHps[2], num_c, sizeof(num_c));
-
-        fTotal[0] += fHps[0];
-        fTotal[1] += fHps[1];
-        fTotal[2] += fHps[2];
+        for(size_t w=0; w < 5; w++)
+        {
+            double fHps = telem->calc_telemetry_data(iReportWindows[w], i);
+            fTotal[w] += fHps;
+            num[w][0] = '\0';
+            hps_format(fHps, num[w], sizeof(num[w]));
+        }
 
-        snprintf(buffer, sizeof(buffer), sHtmlHashrateTableRow, (unsigned int)i, num_a, num_b, num_c);
+        snprintf(buffer, sizeof(buffer), sHtmlHashrateTableRow, (unsigned int)i, num[0], num[1], num[2], num[3], num[4]);
         out.append(buffer);
     }
 
-    num_a[0] = num_b[0] = num_c[0] = num_d[0] ='\0';
-    hps_format(fTotal[0], num_a, sizeof(num_a));
-    hps_format(fTotal[1], num_b, sizeof(num_b));
-    hps_format(fTotal[2], num_c, sizeof(num_c));
-    hps_format(fHighestHps, num_d, sizeof(num_d));
+    for(size_t w=0; w < 5; w++)
+    {
+        num[w][0] = '\0';
+        hps_format(fTotal[w], num[w], sizeof(num[w]));
+    }
+    num_h[0] = '\0';
+    hps_format(fHighestHps, num_h, sizeof(num_h));
 
-    snprintf(buffer, sizeof(buffer), sHtmlHashrateBodyLow, num_a, num_b, num_c, num_d);
+    snprintf(buffer, sizeof(buffer), sHtmlHashrateBodyLow, num[0], num[1], num[2], num[3], num[4], num_h);
     out.append(buffer);
 }
 
@@ -800,11 +1583,11 @@ void executor::http_result_report(std::string& out)
         fGoodResPrc = 100.0 * iGoodRes / iTotalRes;
 
     double fAvgResTime = 0.0;
-    if(iPoolCallTimes.size() > 0)
+    if(oCallTimes.count() > 0)
     {
         using namespace std::chrono;
         fAvgResTime = ((double)duration_cast<seconds>(system_clock::now() - tPoolConnTime).count())
-            / iPoolCallTimes.size();
+            / oCallTimes.count();
     }
 
     snprintf(buffer, sizeof(buffer), sHtmlResultBodyHigh,
@@ -835,30 +1618,42 @@ void executor::http_connection_report(std::string& out)
     snprintf(buffer, sizeof(buffer), sHtmlCommonHeader, "Connection Report", "Connection Report");
     out.append(buffer);
 
-    jpsock* pool = pick_pool_by_id(dev_pool_id + 1);
+    // A job bus follower has no pool of its own
+    jpsock* pool = pools.empty() ? nullptr : pick_pool_by_id(active_pool_id);
     const char* cdate = "not connected";
-    if (pool->is_running() && pool->is_logged_in())
+    if (pool != nullptr && pool->is_running() && pool->is_logged_in())
         cdate = time_format(date, sizeof(date), tPoolConnTime);
 
-    size_t n_calls = iPoolCallTimes.size();
     unsigned int ping_time = 0;
-    if (n_calls > 1)
-    {
-        //Not-really-but-good-enough median
-        std::nth_element(iPoolCallTimes.begin(), iPoolCallTimes.begin() + n_calls/2, iPoolCallTimes.end());
-        ping_time = iPoolCallTimes[n_calls/2];
-    }
+    if (oCallTimes.count() > 1)
+        ping_time = oCallTimes.quantile(0.5);
+
+    char latency[128] = "n/a";
+    latency_hist oWindow;
+    oCallWindow.get(oWindow, tsc_clock::now_ms());
+    if (oWindow.count() > 0)
+        snprintf(latency, sizeof(latency), "p50 %u ms, p90 %u ms, p99 %u ms, max %u ms",
+            oWindow.quantile(0.5), oWindow.quantile(0.9), oWindow.quantile(0.99), oWindow.max());
+
+    char tls[128];
+    if (pool == nullptr)
+        snprintf(tls, sizeof(tls), "job bus slot %llu", int_port(job_bus::inst()->get_slot()));
+    else if (pool->is_tls())
+        snprintf(tls, sizeof(tls), "%llu full, %llu resumed, last connect %u ms",
+            int_port(pool->get_full_handshakes()), int_port(pool->get_resumed_handshakes()), pool->get_handshake_time());
+    else
+        snprintf(tls, sizeof(tls), "not using TLS");
 
     snprintf(buffer, sizeof(buffer), sHtmlConnectionBodyHigh,
-        jconf::inst()->GetPoolAddress(),
-        cdate, ping_time);
+        pool != nullptr ? pool->get_pool_addr() : jconf::inst()->GetJobBusName(),
+        cdate, ping_time, latency, tls);
     out.append(buffer);
 
 
     for(size_t i=0; i < vSocketLog.size(); i++)
     {
         snprintf(buffer, sizeof(buffer), sHtmlConnectionTableRow,
-            time_format(date, sizeof(date), vSocketLog[i].time), vSocketLog[i].msg.c_str());
+            time_format(date, sizeof(date), socket_log(i).time), socket_log(i).msg.c_str());
         out.append(buffer);
     }
 
@@ -876,43 +1671,82 @@ inline const char* hps_format_json(double h, char* buf, size_t l)
         return "null";
 }
 
+inline const char* ctr_format_json(double v, char* buf, size_t l)
+{
+    if(std::isfinite(v))
+    {
+        snprintf(buf, l, "%.2f", v);
+        return buf;
+    }
+    else
+        return "null";
+}
+
 void executor::http_json_report(std::string& out)
 {
-    const char *a, *b, *c;
-    char num_a[32], num_b[32], num_c[32];
-    char hr_buffer[64];
-    std::string hr_thds, res_error, cn_error;
+    const char *a;
+    const char *v[8];
+    char num[8][32];
+    char hr_buffer[128];
+    std::string hr_thds, hr_range, hr_ctrs, hr_times, res_error, cn_error;
 
     size_t nthd = pvThreads->size();
-    double fTotal[3] = { 0.0, 0.0, 0.0};
-    hr_thds.reserve(nthd * 32);
+    double fTotal[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+    hr_thds.reserve(nthd * 48);
+    hr_range.reserve(nthd * 96);
+    hr_ctrs.reserve(nthd * 32);
+    hr_times.reserve(nthd * 96);
 
     for(size_t i=0; i < nthd; i++)
     {
-        if(i != 0) hr_thds.append(1, ',');
-
-        double fHps[3];
-        fHps[0] = telem->calc_telemetry_data(5000, i);
-        fHps[1] = telem->calc_telemetry_data(60000, i);
-        fHps[2] = telem->calc_telemetry_data(900000, i);
-
-        fTotal[0] += fHps[0];
-        fTotal[1] += fHps[1];
-        fTotal[2] += fHps[2];
+        if(i != 0)
+        {
+            hr_thds.append(1, ',');
+            hr_range.append(1, ',');
+            hr_ctrs.append(1, ',');
+            hr_times.append(1, ',');
+        }
 
-        a = hps_format_json(fHps[0], num_a, sizeof(num_a));
-        b = hps_format_json(fHps[1], num_b, sizeof(num_b));
-        c = hps_format_json(fHps[2], num_c, sizeof(num_c));
-        snprintf(hr_buffer, sizeof(hr_buffer), sJsonApiThdHashrate, a, b, c);
+        for(size_t w=0; w < 5; w++)
+        {
+            double fHps = telem->calc_telemetry_data(iReportWindows[w], i);
+            fTotal[w] += fHps;
+            v[w] = hps_format_json(fHps, num[w], sizeof(num[w]));
+        }
+        snprintf(hr_buffer, sizeof(hr_buffer), sJsonApiThdHashrate, v[0], v[1], v[2], v[3], v[4]);
         hr_thds.append(hr_buffer);
+
+        // Slowest and fastest bucket from 60s up, 5s only has a handful of buckets
+        for(size_t w=1; w < 5; w++)
+        {
+            double fMin, fMax;
+            if(!telem->calc_telemetry_range(iReportWindows[w], i, fMin, fMax))
+                fMin = fMax = nan("");
+            v[w*2-2] = hps_format_json(fMin, num[w*2-2], sizeof(num[0]));
+            v[w*2-1] = hps_format_json(fMax, num[w*2-1], sizeof(num[0]));
+        }
+        snprintf(hr_buffer, sizeof(hr_buffer), sJsonApiThdRange, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+        hr_range.append(hr_buffer);
+
+        const thread_counters& tc = vThdCounters[i];
+        snprintf(hr_buffer, sizeof(hr_buffer), sJsonApiThdCounters, ctr_format_json(tc.fIpc, num[0], sizeof(num[0])),
+            ctr_format_json(tc.fLlcPerHash, num[1], sizeof(num[1])), ctr_format_json(tc.fTlbPerHash, num[2], sizeof(num[2])));
+        hr_ctrs.append(hr_buffer);
+
+        const latency_hist& h = vHashTimes[i].oWindow;
+        snprintf(hr_buffer, sizeof(hr_buffer), sJsonApiThdHashTimes,
+            ctr_format_json(hash_time_ms(h, h.quantile(0.5)), num[0], sizeof(num[0])),
+            ctr_format_json(hash_time_ms(h, h.quantile(0.99)), num[1], sizeof(num[1])),
+            ctr_format_json(hash_time_ms(h, h.max()), num[2], sizeof(num[2])),
+            ctr_format_json(hash_time_jitter(h), num[3], sizeof(num[3])), hash_time_flag(h));
+        hr_times.append(hr_buffer);
     }
 
-    a = hps_format_json(fTotal[0], num_a, sizeof(num_a));
-    b = hps_format_json(fTotal[1], num_b, sizeof(num_b));
-    c = hps_format_json(fTotal[2], num_c, sizeof(num_c));
-    snprintf(hr_buffer, sizeof(hr_buffer), sJsonApiThdHashrate, a, b, c);
+    for(size_t w=0; w < 5; w++)
+        v[w] = hps_format_json(fTotal[w], num[w], sizeof(num[w]));
+    snprintf(hr_buffer, sizeof(hr_buffer), sJsonApiThdHashrate, v[0], v[1], v[2], v[3], v[4]);
 
-    a = hps_format_json(fHighestHps, num_a, sizeof(num_a));
+    a = hps_format_json(fHighestHps, num[5], sizeof(num[5]));
 
     size_t iGoodRes = vMineResults[0].count, iTotalRes = iGoodRes;
     size_t ln = vMineResults.size();
@@ -920,18 +1754,18 @@ void executor::http_json_report(std::string& out)
     for(size_t i=1; i < ln; i++)
         iTotalRes += vMineResults[i].count;
 
-    jpsock* pool = pick_pool_by_id(dev_pool_id + 1);
+    jpsock* pool = pools.empty() ? nullptr : pick_pool_by_id(active_pool_id);
 
     size_t iConnSec = 0;
-    if(pool->is_running() && pool->is_logged_in())
+    if(pool != nullptr && pool->is_running() && pool->is_logged_in())
     {
         using namespace std::chrono;
         iConnSec = duration_cast<seconds>(system_clock::now() - tPoolConnTime).count();
     }
 
     double fAvgResTime = 0.0;
-    if(iPoolCallTimes.size() > 0)
-        fAvgResTime = double(iConnSec) / iPoolCallTimes.size();
+    if(oCallTimes.count() > 0)
+        fAvgResTime = double(iConnSec) / oCallTimes.count();
 
     char buffer[2048];
     res_error.reserve((vMineResults.size() - 1) * 128);
@@ -946,14 +1780,12 @@ void executor::http_json_report(std::string& out)
         res_error.append(buffer);
     }
 
-    size_t n_calls = iPoolCallTimes.size();
     size_t iPoolPing = 0;
-    if (n_calls > 1)
-    {
-        //Not-really-but-good-enough median
-        std::nth_element(iPoolCallTimes.begin(), iPoolCallTimes.begin() + n_calls/2, iPoolCallTimes.end());
-        iPoolPing = iPoolCallTimes[n_calls/2];
-    }
+    if (oCallTimes.count() > 1)
+        iPoolPing = oCallTimes.quantile(0.5);
+
+    latency_hist oWindow;
+    oCallWindow.get(oWindow, tsc_clock::now_ms());
 
     cn_error.reserve(vSocketLog.size() * 256);
     for(size_t i=0; i < vSocketLog.size(); i++)
@@ -961,70 +1793,205 @@ void executor::http_json_report(std::string& out)
         using namespace std::chrono;
         if(i != 0) cn_error.append(1, ',');
 
+        const sck_error_log& err = socket_log(i);
         snprintf(buffer, sizeof(buffer), sJsonApiConnectionError,
-            int_port(duration_cast<seconds>(vMineResults[i].time.time_since_epoch()).count()),
-            vSocketLog[i].msg.c_str());
+            int_port(duration_cast<seconds>(err.time.time_since_epoch()).count()), err.msg.c_str());
         cn_error.append(buffer);
     }
 
-    size_t bb_size = 1024 + hr_thds.size() + res_error.size() + cn_error.size();
+    size_t bb_size = 1024 + hr_thds.size() + hr_range.size() + hr_ctrs.size() + hr_times.size() + res_error.size() + cn_error.size();
     std::unique_ptr<char[]> bigbuf( new char[ bb_size ] );
 
     int bb_len = snprintf(bigbuf.get(), bb_size, sJsonApiFormat,
-        hr_thds.c_str(), hr_buffer, a,
+        hr_thds.c_str(), hr_range.c_str(), hr_ctrs.c_str(), hr_times.c_str(), hr_buffer, a,
         int_port(iPoolDiff), int_port(iGoodRes), int_port(iTotalRes), fAvgResTime, int_port(iPoolHashes),
         int_port(iTopDiff[0]), int_port(iTopDiff[1]), int_port(iTopDiff[2]), int_port(iTopDiff[3]), int_port(iTopDiff[4]),
         int_port(iTopDiff[5]), int_port(iTopDiff[6]), int_port(iTopDiff[7]), int_port(iTopDiff[8]), int_port(iTopDiff[9]),
-        res_error.c_str(), jconf::inst()->GetPoolAddress(), int_port(iConnSec), int_port(iPoolPing), cn_error.c_str());
+        res_error.c_str(), pool != nullptr ? pool->get_pool_addr() : jconf::inst()->GetJobBusName(), int_port(iConnSec), int_port(iPoolPing),
+        oWindow.quantile(0.5), oWindow.quantile(0.9), oWindow.quantile(0.99), oWindow.max(), int_port(oWindow.count()),
+        cn_error.c_str());
 
     out = std::string(bigbuf.get(), bigbuf.get() + bb_len);
 }
 
-void executor::http_report(ex_event_name ev)
+// Label values can hold anything a pool sends us
+static void metrics_label(std::string& out, const char* val)
+{
+    for(; *val != '\0'; val++)
+    {
+        switch(*val)
+        {
+        case '\\':
+            out.append("\\\\");
+            break;
+        case '"':
+            out.append("\\\"");
+            break;
+        case '\n':
+            out.append("\\n");
+            break;
+        default:
+            out.append(1, *val);
+            break;
+        }
+    }
+}
+
+/* OpenMetrics text exposition. Everything here is a raw counter or a gauge, the scraper
+   works out the rates itself. */
+void executor::http_metrics_report(std::string& out)
 {
-    assert(pHttpString != nullptr);
+    char buf[256];
+    out.reserve(4096);
 
-    switch(ev)
+    out.append("# TYPE cryptogoblin_hashes counter\n# HELP cryptogoblin_hashes Hashes done by a miner thread.\n");
+    for(size_t i=0; i < pvThreads->size(); i++)
     {
-    case EV_HTML_HASHRATE:
-        http_hashrate_report(*pHttpString);
-        break;
+        snprintf(buf, sizeof(buf), "cryptogoblin_hashes_total{thread=\"%llu\"} %llu\n", int_port(i),
+            int_port(pvThreads->at(i)->get_hash_count()));
+        out.append(buf);
+    }
 
-    case EV_HTML_RESULTS:
-        http_result_report(*pHttpString);
-        break;
+    out.append("# TYPE cryptogoblin_shares counter\n# HELP cryptogoblin_shares Shares by pool verdict, rejects by reason.\n");
+    snprintf(buf, sizeof(buf), "cryptogoblin_shares_total{status=\"accepted\",reason=\"\"} %llu\n", int_port(vMineResults[0].count));
+    out.append(buf);
+    for(size_t i=1; i < vMineResults.size(); i++)
+    {
+        out.append("cryptogoblin_shares_total{status=\"rejected\",reason=\"");
+        metrics_label(out, vMineResults[i].msg.c_str());
+        snprintf(buf, sizeof(buf), "\"} %llu\n", int_port(vMineResults[i].count));
+        out.append(buf);
+    }
 
-    case EV_HTML_CONNSTAT:
-        http_connection_report(*pHttpString);
-        break;
+    snprintf(buf, sizeof(buf), "# TYPE cryptogoblin_stale_dropped counter\ncryptogoblin_stale_dropped_total %llu\n", int_port(iStaleDropped));
+    out.append(buf);
+    snprintf(buf, sizeof(buf), "# TYPE cryptogoblin_job_switches counter\ncryptogoblin_job_switches_total %llu\n", int_port(iJobSwitches));
+    out.append(buf);
 
-    case EV_HTML_JSON:
-        http_json_report(*pHttpString);
-        break;
+    out.append("# TYPE cryptogoblin_submit_latency_seconds histogram\n# HELP cryptogoblin_submit_latency_seconds Time from submit to the pool's reply.\n");
+    size_t iCumulative = 0;
+    for(size_t i=0; i < iSubmitLatBuckets.size(); i++)
+    {
+        iCumulative += iSubmitLatHist[i];
+        snprintf(buf, sizeof(buf), "cryptogoblin_submit_latency_seconds_bucket{le=\"%g\"} %llu\n",
+            iSubmitLatBuckets[i] / 1000.0, int_port(iCumulative));
+        out.append(buf);
+    }
+    iCumulative += iSubmitLatHist.back();
+    snprintf(buf, sizeof(buf), "cryptogoblin_submit_latency_seconds_bucket{le=\"+Inf\"} %llu\n"
+        "cryptogoblin_submit_latency_seconds_count %llu\ncryptogoblin_submit_latency_seconds_sum %.3f\n",
+        int_port(iCumulative), int_port(iCumulative), iSubmitLatSumMs / 1000.0);
+    out.append(buf);
+
+    // The dev pool is left out, it has nothing to do with the user's setup
+    out.append("# TYPE cryptogoblin_pool_up gauge\n# HELP cryptogoblin_pool_up Pool is connected and logged in.\n");
+    for(size_t i=dev_pool_id+1; i <= pools.size(); i++)
+    {
+        out.append("cryptogoblin_pool_up{pool=\"");
+        metrics_label(out, pick_pool_by_id(i)->get_pool_addr());
+        out.append(pick_pool_by_id(i)->is_logged_in() ? "\"} 1\n" : "\"} 0\n");
+    }
 
-    default:
-        assert(false);
-        break;
+    out.append("# TYPE cryptogoblin_pool_active gauge\n# HELP cryptogoblin_pool_active Pool we are mining on.\n");
+    for(size_t i=dev_pool_id+1; i <= pools.size(); i++)
+    {
+        out.append("cryptogoblin_pool_active{pool=\"");
+        metrics_label(out, pick_pool_by_id(i)->get_pool_addr());
+        out.append(i == current_pool_id ? "\"} 1\n" : "\"} 0\n");
+    }
+
+    out.append("# EOF\n");
+}
+
+/* One server-sent event per tick for /events. Counters go out as deltas since the last
+   frame, the pool state every time so that a new viewer doesn't have to wait for a change.
+   Built once, every stream gets the same string. */
+void executor::http_event_frame(std::string& out)
+{
+    char buf[256];
+    char num[32];
+
+    snprintf(buf, sizeof(buf), "data: {\"tick\":%llu,\"hr\":[", int_port(iTickCnt));
+    out.append(buf);
+
+    double fTotal = 0.0;
+    for(size_t i=0; i < pvThreads->size(); i++)
+    {
+        double fHps = telem->calc_telemetry_data(5000, i);
+        fTotal += fHps;
+        if(i != 0)
+            out.append(1, ',');
+        out.append(hps_format_json(fHps, num, sizeof(num)));
     }
 
-    httpReady.set_value();
+    size_t iAccepted = vMineResults[0].count, iRejected = 0;
+    for(size_t i=1; i < vMineResults.size(); i++)
+        iRejected += vMineResults[i].count;
+
+    snprintf(buf, sizeof(buf), "],\"total\":%s,\"accepted\":%llu,\"rejected\":%llu,\"switches\":%llu",
+        hps_format_json(fTotal, num, sizeof(num)), int_port(iAccepted - oLastFrame.iAccepted),
+        int_port(iRejected - oLastFrame.iRejected), int_port(iJobSwitches - oLastFrame.iSwitches));
+    out.append(buf);
+
+    oLastFrame.iAccepted = iAccepted;
+    oLastFrame.iRejected = iRejected;
+    oLastFrame.iSwitches = iJobSwitches;
+
+    // Pool addresses come from our own config, they don't need escaping
+    jpsock* pool = current_pool_id != invalid_pool_id ? pick_pool_by_id(current_pool_id) : nullptr;
+    snprintf(buf, sizeof(buf), ",\"pool\":\"%s\",\"up\":%s}\n\n", pool != nullptr ? pool->get_pool_addr() : "",
+        pool != nullptr && pool->is_logged_in() ? "true" : "false");
+    out.append(buf);
 }
 
-void executor::get_http_report(ex_event_name ev_id, std::string& data)
+void executor::publish_stats_shm()
 {
-    std::lock_guard<std::mutex> lck(httpMutex);
+    if(!stats_shm::inst()->is_running())
+        return;
+
+    stats_payload oData = {};
+
+    using namespace std::chrono;
+    oData.iUpdateMs = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    oData.iPoolDiff = iPoolDiff;
+    oData.iAccepted = vMineResults[0].count;
+    for(size_t i=1; i < vMineResults.size(); i++)
+        oData.iRejected += vMineResults[i].count;
+    std::copy(iTopDiff.begin(), iTopDiff.end(), oData.iTopDiff);
+
+    oData.iThreadCount = (uint32_t)std::min(pvThreads->size(), stats_payload::iMaxThreads);
+    for(size_t i=0; i < oData.iThreadCount; i++)
+    {
+        oData.vThreads[i].iHashCount = pvThreads->at(i)->get_hash_count();
+        oData.vThreads[i].iTimestamp = pvThreads->at(i)->get_timestamp();
+    }
+
+    if(current_pool_id != invalid_pool_id)
+    {
+        jpsock* pool = pick_pool_by_id(current_pool_id);
+        snprintf(oData.sPool, sizeof(oData.sPool), "%s", pool->get_pool_addr());
+        oData.bPoolUp = pool->is_logged_in() ? 1 : 0;
+    }
 
-    assert(pHttpString == nullptr);
-    assert(ev_id == EV_HTML_HASHRATE || ev_id == EV_HTML_RESULTS
-        || ev_id == EV_HTML_CONNSTAT || ev_id == EV_HTML_JSON);
+    stats_shm::inst()->publish(oData);
+}
+
+void executor::publish_http_snapshot()
+{
+    if(jconf::inst()->GetHttpdPort() == 0)
+        return;
 
-    pHttpString = &data;
-    httpReady = std::promise<void>();
-    std::future<void> ready = httpReady.get_future();
+    std::shared_ptr<http_snapshot> snap = std::make_shared<http_snapshot>();
+    http_hashrate_report(snap->sHashrate);
+    http_result_report(snap->sResults);
+    http_connection_report(snap->sConnStat);
+    http_json_report(snap->sJson);
+    http_metrics_report(snap->sMetrics);
 
-    push_event(ex_event(ev_id));
+    std::atomic_store(&pHttpSnapshot, std::shared_ptr<const http_snapshot>(std::move(snap)));
 
-    ready.wait();
-    pHttpString = nullptr;
+    std::shared_ptr<std::string> frame = std::make_shared<std::string>();
+    http_event_frame(*frame);
+    httpd::inst()->push_event(std::move(frame));
 }
 #pragma GCC reset_options
@@ -1,10 +1,15 @@
 #pragma once
 #include "thdq.hpp"
 #include "msgstruct.h"
+#include "jobreg.h"
+#include "latency.h"
+#include "perfctr.h"
 #include <atomic>
+#include <cmath>
 #include <array>
 #include <list>
 #include <future>
+#include <memory>
 
 class jpsock;
 class minethd;
@@ -21,7 +26,18 @@ public:
 
     void ex_start(bool daemon) { daemon ? ex_main() : std::thread(&executor::ex_main, this).detach(); }
 
-    void get_http_report(ex_event_name ev_id, std::string& data);
+    // Pre-rendered reports for the web server, replaced as a whole on every tick
+    struct http_snapshot
+    {
+        std::string sHashrate;
+        std::string sResults;
+        std::string sConnStat;
+        std::string sJson;
+        std::string sMetrics;
+    };
+
+    // Any thread, never waits on the executor. nullptr until the first tick.
+    inline std::shared_ptr<const http_snapshot> get_http_snapshot() { return std::atomic_load(&pHttpSnapshot); }
 
     inline void push_event(ex_event&& ev) { oEventQ.push(std::move(ev)); }
     void push_timed_event(ex_event&& ev, size_t sec);
@@ -44,22 +60,113 @@ private:
     thdq<ex_event> oEventQ;
     telemetry* telem;
     std::vector<minethd*>* pvThreads;
-    size_t current_pool_id;
-
-    jpsock* usr_pool;
-    jpsock* dev_pool;
+    size_t current_pool_id = invalid_pool_id;
+
+    /* pools[0] is the dev pool, the user pools follow in config order. The active pool
+       is the user pool we mine on, the standby is logged in and holds a current job so
+       that we can switch to it without waiting for a connection. */
+    std::vector<jpsock*> pools;
+    size_t active_pool_id = invalid_pool_id;
+    size_t standby_pool_id = invalid_pool_id;
     size_t iReconnectAttempts = 0;
 
+    // Executor side bookkeeping, same indexing as pools
+    struct pool_state
+    {
+        bool bWaitRetry = false; // Connection failed, nothing happens until its EV_RECONNECT
+        bool bClosing = false;   // We dropped it ourselves, waiting for its EV_SOCK_ERROR
+        size_t iAccepted = 0;
+        size_t iRejected = 0;
+        double fRttMs = 0.0;     // Smoothed login and submit round trip, zero until measured
+    };
+    std::vector<pool_state> vPoolState;
+
+    // A pool has to score this much better to take over from a working one
+    constexpr static double fPoolSwitchMargin = 1.25;
+
     std::chrono::system_clock::time_point tPoolConnTime;
     size_t iPoolHashes = 0;
     uint64_t iPoolDiff = 0;
     double fHighestHps = 0.0;
 
+    // Hardware counters of each thread, worked out every 16 ticks from the last two reads
+    struct thread_counters
+    {
+        perf_counters::sample oLast;
+        uint64_t iLastHashes = 0;
+        bool bHaveLast = false;
+        double fIpc = NAN;
+        double fLlcPerHash = NAN;
+        double fTlbPerHash = NAN;
+    };
+    std::vector<thread_counters> vThdCounters;
+    bool bHaveCounters = false;
+
+    /* Hash times of each thread over about a minute. The threads keep cumulative bucket
+       counts, we read them every 16 ticks and the window is the newest read minus the
+       oldest one we still have. */
+    struct thread_hash_times
+    {
+        constexpr static size_t iSnapshots = 8;
+        std::array<std::array<uint32_t, latency_hist::iBuckets>, iSnapshots> vSnap;
+        size_t iNext = 0;
+        size_t iFill = 0;
+        latency_hist oWindow;
+    };
+    std::vector<thread_hash_times> vHashTimes;
+
+    // Needs this many hashes in the window before it flags anything
+    constexpr static size_t iHashTimeMinCount = 100;
+    // A p99 this far above the median is a steady tail - a busy SMT sibling or a cache neighbour
+    constexpr static double fContendedRatio = 1.25;
+    // A single hash this far above the median means the thread was off the CPU
+    constexpr static double fPreemptedRatio = 4.0;
+    const char* hash_time_flag(const latency_hist& h);
+
+    // Hashrate report columns in ms: 5s, 60s, 15m, 1h and 24h
+    constexpr static std::array<size_t, 5> iReportWindows { { 5000, 60000, 900000, 3600000, 86400000 } };
+
+    // Stale filter, see job_registry
+    job_registry oJobRegistry;
+    size_t iStaleDropped = 0;
+    size_t iSupersededSent = 0;
+    uint64_t iJobAgeMs = 0;
+    size_t iJobAgeCnt = 0;
+
+    /* Shares found while their pool was down. Job ids only hold for the session that handed
+       them out, so a share is only sent again if the pool resends its job after the new login.
+       It counts as recovered once the pool accepts it. */
+    struct buffered_share
+    {
+        size_t iPoolId;
+        job_result oResult;
+
+        buffered_share(size_t iPoolId, const job_result& oResult) : iPoolId(iPoolId), oResult(oResult) {}
+    };
+    std::vector<buffered_share> vShareBuffer;
+    constexpr static size_t iShareBufferSize = 64;
+    size_t iSharesRecovered = 0;
+    size_t iSharesLost = 0;
+    size_t iTickCnt = 0;
+
+    // Job bus follower, results handed over to the leader
+    size_t iBusResults = 0;
+
     bool is_dev_time;
 
-    // Set it to 16 bit so that we can just let it grow
-    // Maximum realistic growth rate - 5MB / month
-    std::vector<uint16_t> iPoolCallTimes;
+    // Donation split, the dev pool's share out of minethd::iSplitScale hashes, from fDevDonationLevel
+    uint32_t iDevSplitShare = 0;
+    constexpr static size_t iDevSplitRetry = 300;
+
+    // Submit round trips since we connected, and over the last 15 minutes
+    latency_hist oCallTimes;
+    latency_window oCallWindow;
+
+    // Submit round trips in ms for /metrics, 1-2.5-5 steps. Never reset, the last bin is +Inf.
+    constexpr static std::array<size_t, 11> iSubmitLatBuckets { { 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000 } };
+    std::array<size_t, 12> iSubmitLatHist { { } };
+    uint64_t iSubmitLatSumMs = 0;
+    size_t iJobSwitches = 0;
 
     // Element zero is always the success element.
     // Keep in mind that this is a tally and not a log like above
@@ -108,11 +215,24 @@ private:
             time = std::chrono::system_clock::now();
         }
     };
+    // Ring of the last iSocketLogSize errors, socket_log(0) is the oldest
+    constexpr static size_t iSocketLogSize = 32;
     std::vector<sck_error_log> vSocketLog;
+    size_t iSocketLogNext = 0;
+    size_t iSocketErrors = 0;
+
+    inline const sck_error_log& socket_log(size_t i) { return vSocketLog[(iSocketLogNext + i) % vSocketLog.size()]; }
 
-    std::string* pHttpString = nullptr;
-    std::promise<void> httpReady;
-    std::mutex httpMutex;
+    std::shared_ptr<const http_snapshot> pHttpSnapshot;
+
+    // What the last /events frame said, the next one only sends the difference
+    struct event_frame_state
+    {
+        size_t iAccepted = 0;
+        size_t iRejected = 0;
+        size_t iSwitches = 0;
+    };
+    event_frame_state oLastFrame;
 
     // In miliseconds, has to divide a second (1000ms) into an integer number
     constexpr static size_t iTickTime = 500;
@@ -122,10 +242,15 @@ private:
     constexpr static size_t iDevDonatePeriod = 100 * 60;
 
     jpsock* pick_pool_by_id(size_t pool_id);
+    inline pool_state& get_pool_state(size_t pool_id) { return vPoolState[pool_id - 1]; }
     executor();
     static executor* oInst;
 
     void ex_main();
+    void ex_follower_main();
+    bool perf_tick();
+    void sample_counters();
+    void sample_hash_times();
 
     void ex_clock_thd();
     void pool_connect(jpsock* pool);
@@ -138,14 +263,17 @@ private:
     void http_result_report(std::string& out);
     void http_connection_report(std::string& out);
     void http_json_report(std::string& out);
+    void http_metrics_report(std::string& out);
+    void http_event_frame(std::string& out);
 
-    void http_report(ex_event_name ev);
+    void publish_http_snapshot();
+    void publish_stats_shm();
     void print_report(ex_event_name ev);
 
     //Those stats are reset if we disconnect
     inline void reset_stats()
     {
-        iPoolCallTimes.clear();
+        oCallTimes.clear();
         tPoolConnTime = std::chrono::system_clock::now();
         iPoolHashes = 0;
         iPoolDiff = 0;
@@ -155,12 +283,32 @@ private:
     void log_result_error(std::string&& sError);
     void log_result_ok(uint64_t iActualDiff);
 
-    void sched_reconnect();
+    void sched_reconnect(size_t pool_id);
+
+    double pool_score(size_t pool_id);
+    bool pool_beats(size_t cand_id, size_t inc_id);
+    void add_rtt_sample(size_t pool_id, size_t iCallMs);
+    size_t pick_standby();
+    size_t pick_failover();
+    void connect_pool(size_t pool_id);
+    void eval_pools();
+    void eval_active_pool();
+    void set_active_pool(size_t pool_id);
+    void mine_active_pool();
+    void mine_pool_job(size_t pool_id, pool_job& oPoolJob, uint32_t iJobHandle);
+    void stall_miners();
+    void mine_split_job(size_t pool_id, pool_job& oPoolJob, uint32_t iJobHandle, uint32_t iShare);
+    void stall_split();
+    uint64_t calc_auto_diff();
 
     void on_sock_ready(size_t pool_id);
     void on_sock_error(size_t pool_id, std::string&& sError);
     void on_pool_have_job(size_t pool_id, pool_job& oPoolJob);
     void on_miner_result(size_t pool_id, job_result& oResult);
+    void submit_share(jpsock* pool, const job_registry::job_entry* job, job_result& oResult, bool bReplay = false);
+    void replay_shares(size_t pool_id, uint32_t iJobHandle);
+    void on_pool_submit_result(size_t pool_id, submit_result& oResult);
+    void flush_submits();
     void on_reconnect(size_t pool_id);
     void on_switch_pool(size_t pool_id);
 
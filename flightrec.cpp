@@ -0,0 +1,226 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+#include "flightrec.h"
+#include "minethd.h"
+#include "console.h"
+#include "version.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+flight_recorder* flight_recorder::oInst = nullptr;
+thread_local flight_recorder::trace_ring* flight_recorder::pThreadRing = nullptr;
+thread_local bool flight_recorder::bNoRing = false;
+
+static volatile sig_atomic_t bDumpRequested = 0;
+
+// Threads past iMaxRings don't record, nullptr for them
+flight_recorder::trace_ring* flight_recorder::thread_ring()
+{
+    if(pThreadRing != nullptr || bNoRing)
+        return pThreadRing;
+
+    size_t idx = iRingCount.fetch_add(1);
+    if(idx >= iMaxRings)
+    {
+        bNoRing = true;
+        return nullptr;
+    }
+
+    trace_ring* ring = new trace_ring;
+    snprintf(ring->sName, sizeof(ring->sName), "thread %u", (unsigned int)idx);
+    ring->iHead.store(0, std::memory_order_relaxed);
+    vRings[idx].store(ring, std::memory_order_release);
+
+    pThreadRing = ring;
+    return ring;
+}
+
+void flight_recorder::set_thread_name(const char* sName)
+{
+    trace_ring* ring = thread_ring();
+    if(ring != nullptr)
+        snprintf(ring->sName, sizeof(ring->sName), "%s", sName);
+}
+
+inline void flight_recorder::push(uint32_t type, uint64_t iTimeUs, uint64_t iArg, uint32_t iArg2)
+{
+    trace_ring* ring = thread_ring();
+    if(ring == nullptr)
+        return;
+
+    uint64_t iHead = ring->iHead.load(std::memory_order_relaxed);
+    trace_event& ev = ring->vEvents[iHead & (iRingSize - 1)];
+    ev.iTimeUs = iTimeUs;
+    ev.iArg = iArg;
+    ev.iArg2 = iArg2;
+    ev.iType = type;
+    ring->iHead.store(iHead + 1, std::memory_order_release);
+}
+
+void flight_recorder::record(event_type type, uint64_t iArg, uint32_t iArg2)
+{
+    push(type, tsc_clock::now_us(), iArg, iArg2);
+}
+
+void flight_recorder::record_span(event_type type, uint64_t iStartUs, uint32_t iDurUs)
+{
+    push(type, iStartUs, 0, iDurUs);
+}
+
+#pragma GCC optimize ("Os")
+static void dump_event(std::string& out, size_t tid, uint32_t type, uint64_t iTimeUs, uint64_t iArg, uint32_t iArg2)
+{
+    char buf[256];
+    unsigned long long ts = iTimeUs, arg = iArg;
+
+    switch(type)
+    {
+    case flight_recorder::ev_job_consumed:
+        snprintf(buf, sizeof(buf), "{\"name\":\"job\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"args\":{\"handle\":%llu}}",
+            (unsigned int)tid, ts, arg);
+        break;
+    case flight_recorder::ev_hash:
+        snprintf(buf, sizeof(buf), "{\"name\":\"hash\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%u}",
+            (unsigned int)tid, ts, iArg2);
+        break;
+    case flight_recorder::ev_share_found:
+        snprintf(buf, sizeof(buf), "{\"name\":\"share\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"args\":{\"nonce\":%llu}}",
+            (unsigned int)tid, ts, arg);
+        break;
+    case flight_recorder::ev_stall_begin:
+        snprintf(buf, sizeof(buf), "{\"name\":\"stall\",\"ph\":\"B\",\"pid\":1,\"tid\":%u,\"ts\":%llu}", (unsigned int)tid, ts);
+        break;
+    case flight_recorder::ev_stall_end:
+        snprintf(buf, sizeof(buf), "{\"name\":\"stall\",\"ph\":\"E\",\"pid\":1,\"tid\":%u,\"ts\":%llu}", (unsigned int)tid, ts);
+        break;
+    case flight_recorder::ev_submit_sent:
+        snprintf(buf, sizeof(buf), "{\"name\":\"submit\",\"cat\":\"submit\",\"ph\":\"b\",\"id\":\"0x%llx\",\"pid\":1,\"tid\":%u,\"ts\":%llu,"
+            "\"args\":{\"pool\":%llu,\"call\":%llu}}", arg, (unsigned int)tid, ts, arg >> 32, arg & 0xFFFFFFFFULL);
+        break;
+    case flight_recorder::ev_submit_acked:
+        snprintf(buf, sizeof(buf), "{\"name\":\"submit\",\"cat\":\"submit\",\"ph\":\"e\",\"id\":\"0x%llx\",\"pid\":1,\"tid\":%u,\"ts\":%llu,"
+            "\"args\":{\"result\":\"%s\"}}", arg, (unsigned int)tid, ts, iArg2 == 0 ? "accepted" : iArg2 == 1 ? "rejected" : "lost");
+        break;
+    case flight_recorder::ev_reconnect:
+        snprintf(buf, sizeof(buf), "{\"name\":\"reconnect\",\"ph\":\"i\",\"s\":\"p\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"args\":{\"pool\":%llu}}",
+            (unsigned int)tid, ts, arg);
+        break;
+    case flight_recorder::ev_pool_job:
+        snprintf(buf, sizeof(buf), "{\"name\":\"pool job\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"args\":{\"pool\":%llu}}",
+            (unsigned int)tid, ts, arg);
+        break;
+    default:
+        return;
+    }
+
+    out.append(",\n").append(buf);
+}
+
+void flight_recorder::dump(std::string& out)
+{
+    std::vector<trace_event> vCopy(iRingSize);
+    char buf[128];
+
+    out.assign("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    out.append("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"" XMR_STAK_NAME "\"}}");
+
+    size_t iCount = std::min(iRingCount.load(), iMaxRings);
+    for(size_t tid = 0; tid < iCount; tid++)
+    {
+        trace_ring* ring = vRings[tid].load(std::memory_order_acquire);
+        if(ring == nullptr)
+            continue;
+
+        snprintf(buf, sizeof(buf), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+            (unsigned int)tid, ring->sName);
+        out.append(buf);
+
+        uint64_t iEnd = ring->iHead.load(std::memory_order_acquire);
+        uint64_t iStart = iEnd > iRingSize ? iEnd - iRingSize : 0;
+        for(uint64_t i = iStart; i < iEnd; i++)
+            vCopy[i - iStart] = ring->vEvents[i & (iRingSize - 1)];
+
+        // The writer may have gone round while we copied, the slot it is on now is suspect too
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t iAfter = ring->iHead.load(std::memory_order_relaxed);
+        uint64_t iFirstGood = iAfter >= iRingSize ? iAfter - iRingSize + 1 : 0;
+
+        for(uint64_t i = std::max(iStart, iFirstGood); i < iEnd; i++)
+        {
+            const trace_event& ev = vCopy[i - iStart];
+            dump_event(out, tid, ev.iType, ev.iTimeUs, ev.iArg, ev.iArg2);
+        }
+    }
+
+    out.append("\n]}\n");
+}
+
+#ifndef _WIN32
+static void on_sigusr2(int)
+{
+    bDumpRequested = 1;
+}
+
+void flight_recorder::catch_signal()
+{
+    signal(SIGUSR2, on_sigusr2);
+}
+#else
+void flight_recorder::catch_signal()
+{
+}
+#endif // _WIN32
+
+void flight_recorder::check_dump_request()
+{
+    if(bDumpRequested == 0)
+        return;
+    bDumpRequested = 0;
+
+    char sName[64];
+    snprintf(sName, sizeof(sName), "trace-%llu.json", (unsigned long long)time(nullptr));
+
+    std::string out;
+    dump(out);
+
+    FILE* f = fopen(sName, "wb");
+    if(f == nullptr || fwrite(out.data(), 1, out.size(), f) != out.size())
+        printer::inst()->print_msg(L0, "Flight recorder: unable to write %s.", sName);
+    else
+        printer::inst()->print_msg(L1, "Flight recorder written to %s.", sName);
+
+    if(f != nullptr)
+        fclose(f);
+}
+#pragma GCC reset_options
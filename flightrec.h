@@ -0,0 +1,81 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+/*
+ * Flight recorder. Every thread that records gets a ring of its own for the last iRingSize
+ * events, so writing one is a clock read and a store with no locks and no shared lines.
+ * A dump copies the rings out while they are being written and drops whatever got
+ * overwritten in the meantime.
+ *
+ * Dumps are Chrome trace_event JSON, they open in chrome://tracing or Perfetto. Ask for
+ * one at /trace.json, or send SIGUSR2 and the executor writes it to a file.
+ */
+
+class flight_recorder
+{
+public:
+    static flight_recorder* inst()
+    {
+        if (oInst == nullptr) oInst = new flight_recorder;
+        return oInst;
+    };
+
+    enum event_type : uint32_t
+    {
+        ev_job_consumed,  // iArg job handle
+        ev_hash,          // Sampled, a span
+        ev_share_found,   // iArg nonce
+        ev_stall_begin,
+        ev_stall_end,
+        ev_submit_sent,   // iArg pool id << 32 | call id
+        ev_submit_acked,  // Same iArg, iArg2 0 accepted, 1 rejected, 2 lost with the connection
+        ev_reconnect,     // iArg pool id
+        ev_pool_job       // iArg pool id
+    };
+
+    // Call it before the thread records anything, the name shows up in the viewer
+    void set_thread_name(const char* sName);
+
+    void record(event_type type, uint64_t iArg = 0, uint32_t iArg2 = 0);
+    void record_span(event_type type, uint64_t iStartUs, uint32_t iDurUs);
+
+    void dump(std::string& out);
+
+    void catch_signal();
+    // Executor thread, writes the dump if SIGUSR2 came in since the last call
+    void check_dump_request();
+
+private:
+    flight_recorder() {}
+    static flight_recorder* oInst;
+
+    struct trace_event
+    {
+        uint64_t iTimeUs;
+        uint64_t iArg;
+        uint32_t iArg2;
+        uint32_t iType;
+    };
+
+    constexpr static size_t iRingSize = 4096; // Power of 2
+    constexpr static size_t iMaxRings = 128;
+
+    struct trace_ring
+    {
+        char sName[32];
+        std::atomic<uint64_t> iHead; // Next event to write
+        trace_event vEvents[iRingSize];
+    };
+
+    std::atomic<trace_ring*> vRings[iMaxRings] = {};
+    std::atomic<size_t> iRingCount { 0 };
+
+    static thread_local trace_ring* pThreadRing;
+    // Set once a thread found all the rings taken, so that it asks only once
+    static thread_local bool bNoRing;
+
+    trace_ring* thread_ring();
+    void push(uint32_t type, uint64_t iTimeUs, uint64_t iArg, uint32_t iArg2);
+};
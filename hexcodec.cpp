@@ -0,0 +1,255 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+#include "hexcodec.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_SIMD_HEX
+#endif
+
+inline unsigned char hf_hex2bin(char c, bool &err)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    else if (c >= 'a' && c <= 'f')
+        return c - 'a' + 0xA;
+    else if (c >= 'A' && c <= 'F')
+        return c - 'A' + 0xA;
+
+    err = true;
+    return 0;
+}
+
+bool hex2bin_scalar(const char* in, size_t len, unsigned char* out)
+{
+    bool error = false;
+    for (size_t i = 0; i < len; i += 2)
+    {
+        out[i / 2] = (hf_hex2bin(in[i], error) << 4) | hf_hex2bin(in[i + 1], error);
+        if (error) return false;
+    }
+    return true;
+}
+
+inline char hf_bin2hex(unsigned char c)
+{
+    if (c <= 0x9)
+        return '0' + c;
+    else
+        return 'a' - 0xA + c;
+}
+
+void bin2hex_scalar(const unsigned char* in, size_t len, char* out)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        out[i * 2] = hf_bin2hex((in[i] & 0xF0) >> 4);
+        out[i * 2 + 1] = hf_bin2hex(in[i] & 0x0F);
+    }
+}
+
+#ifdef HAVE_SIMD_HEX
+/*
+ * Decoding - each character is range checked against '0'-'9' and 'a'-'f' (after folding
+ * the case with 0x20). Signed compares only, so we bias the ranges to start at -128.
+ * The nibbles are then joined with maddubs (hi * 16 + lo) and packed down to bytes.
+ */
+__attribute__((target("ssse3")))
+static inline bool hex_nibbles_ssse3(__m128i v, __m128i& nib)
+{
+    const __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    const __m128i dig = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - '0')));
+    const __m128i alp = _mm_add_epi8(lower, _mm_set1_epi8((char)(0x80 - 'a')));
+    const __m128i is_dig = _mm_cmplt_epi8(dig, _mm_set1_epi8((char)(0x80 + 10)));
+    const __m128i is_alp = _mm_cmplt_epi8(alp, _mm_set1_epi8((char)(0x80 + 6)));
+
+    if(_mm_movemask_epi8(_mm_or_si128(is_dig, is_alp)) != 0xFFFF)
+        return false;
+
+    const __m128i vdig = _mm_and_si128(is_dig, _mm_sub_epi8(v, _mm_set1_epi8('0')));
+    const __m128i valp = _mm_and_si128(is_alp, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+    nib = _mm_maddubs_epi16(_mm_or_si128(vdig, valp), _mm_set1_epi16(0x0110));
+    return true;
+}
+
+__attribute__((target("ssse3")))
+static bool hex2bin_ssse3(const char* in, size_t len, unsigned char* out)
+{
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        __m128i n0, n1;
+        if(!hex_nibbles_ssse3(_mm_loadu_si128((const __m128i*)(in + i)), n0) ||
+            !hex_nibbles_ssse3(_mm_loadu_si128((const __m128i*)(in + i + 16)), n1))
+            return false;
+
+        _mm_storeu_si128((__m128i*)(out + i / 2), _mm_packus_epi16(n0, n1));
+    }
+
+    return hex2bin_scalar(in + i, len - i, out + i / 2);
+}
+
+__attribute__((target("ssse3")))
+static void bin2hex_ssse3(const unsigned char* in, size_t len, char* out)
+{
+    const __m128i lut = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+        '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        const __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        const __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+
+        _mm_storeu_si128((__m128i*)(out + i * 2), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(out + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+
+    bin2hex_scalar(in + i, len - i, out + i * 2);
+}
+
+__attribute__((target("avx2")))
+static inline bool hex_nibbles_avx2(__m256i v, __m256i& nib)
+{
+    const __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    const __m256i dig = _mm256_add_epi8(v, _mm256_set1_epi8((char)(0x80 - '0')));
+    const __m256i alp = _mm256_add_epi8(lower, _mm256_set1_epi8((char)(0x80 - 'a')));
+    const __m256i is_dig = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + 10)), dig);
+    const __m256i is_alp = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + 6)), alp);
+
+    if(_mm256_movemask_epi8(_mm256_or_si256(is_dig, is_alp)) != -1)
+        return false;
+
+    const __m256i vdig = _mm256_and_si256(is_dig, _mm256_sub_epi8(v, _mm256_set1_epi8('0')));
+    const __m256i valp = _mm256_and_si256(is_alp, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10)));
+    nib = _mm256_maddubs_epi16(_mm256_or_si256(vdig, valp), _mm256_set1_epi16(0x0110));
+    return true;
+}
+
+__attribute__((target("avx2")))
+static bool hex2bin_avx2(const char* in, size_t len, unsigned char* out)
+{
+    size_t i = 0;
+    for(; i + 64 <= len; i += 64)
+    {
+        __m256i n0, n1;
+        if(!hex_nibbles_avx2(_mm256_loadu_si256((const __m256i*)(in + i)), n0) ||
+            !hex_nibbles_avx2(_mm256_loadu_si256((const __m256i*)(in + i + 32)), n1))
+            return false;
+
+        // packus works per 128 bit lane, put the quadwords back in order
+        const __m256i r = _mm256_permute4x64_epi64(_mm256_packus_epi16(n0, n1), 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + i / 2), r);
+    }
+
+    return hex2bin_ssse3(in + i, len - i, out + i / 2);
+}
+
+__attribute__((target("avx2")))
+static void bin2hex_avx2(const unsigned char* in, size_t len, char* out)
+{
+    const __m256i lut = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+        '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+        '0', '1', '2', '3', '4', '5', '6', '7',
+        '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        const __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+        const __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+        const __m256i a = _mm256_unpacklo_epi8(hi, lo);
+        const __m256i b = _mm256_unpackhi_epi8(hi, lo);
+
+        _mm256_storeu_si256((__m256i*)(out + i * 2), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i*)(out + i * 2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+
+    bin2hex_ssse3(in + i, len - i, out + i * 2);
+}
+#endif // HAVE_SIMD_HEX
+
+hex2bin_fun hex2bin_ssse3_selector()
+{
+#ifdef HAVE_SIMD_HEX
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("ssse3"))
+        return hex2bin_ssse3;
+#endif
+    return nullptr;
+}
+
+hex2bin_fun hex2bin_avx2_selector()
+{
+#ifdef HAVE_SIMD_HEX
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return hex2bin_avx2;
+#endif
+    return nullptr;
+}
+
+bin2hex_fun bin2hex_ssse3_selector()
+{
+#ifdef HAVE_SIMD_HEX
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("ssse3"))
+        return bin2hex_ssse3;
+#endif
+    return nullptr;
+}
+
+bin2hex_fun bin2hex_avx2_selector()
+{
+#ifdef HAVE_SIMD_HEX
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return bin2hex_avx2;
+#endif
+    return nullptr;
+}
+
+hex2bin_fun hex2bin_selector()
+{
+    hex2bin_fun f;
+    if((f = hex2bin_avx2_selector()) != nullptr)
+        return f;
+    if((f = hex2bin_ssse3_selector()) != nullptr)
+        return f;
+    return hex2bin_scalar;
+}
+
+bin2hex_fun bin2hex_selector()
+{
+    bin2hex_fun f;
+    if((f = bin2hex_avx2_selector()) != nullptr)
+        return f;
+    if((f = bin2hex_ssse3_selector()) != nullptr)
+        return f;
+    return bin2hex_scalar;
+}
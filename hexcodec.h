@@ -0,0 +1,26 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * Hex encoder / decoder used on the network path. The scalar version works
+ * everywhere, the SSSE3 and AVX2 versions are selected at runtime if the
+ * CPU has them. All versions produce identical output, and hex2bin accepts
+ * both upper and lower case digits. Lengths are in input characters for
+ * hex2bin and in input bytes for bin2hex.
+ */
+
+typedef bool (*hex2bin_fun)(const char* in, size_t len, unsigned char* out);
+typedef void (*bin2hex_fun)(const unsigned char* in, size_t len, char* out);
+
+bool hex2bin_scalar(const char* in, size_t len, unsigned char* out);
+void bin2hex_scalar(const unsigned char* in, size_t len, char* out);
+
+// Those return nullptr if the CPU (or the compiler) can't do it
+hex2bin_fun hex2bin_ssse3_selector();
+hex2bin_fun hex2bin_avx2_selector();
+bin2hex_fun bin2hex_ssse3_selector();
+bin2hex_fun bin2hex_avx2_selector();
+
+// Best available version
+hex2bin_fun hex2bin_selector();
+bin2hex_fun bin2hex_selector();
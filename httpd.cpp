@@ -21,136 +21,534 @@
   *
   */
 
-#ifndef CONF_NO_HTTPD
 
-#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <string>
+#include <memory>
+#include <thread>
+#include <algorithm>
 
-#include "msgstruct.h"
 #include "httpd.h"
 #include "console.h"
 #include "executor.h"
+#include "flightrec.h"
 #include "jconf.h"
 
 #include "webdesign.h"
 
-#include <microhttpd.h>
 #ifdef _WIN32
 #define strcasecmp _stricmp
+#define strncasecmp _strnicmp
+#else
+#include <strings.h>
 #endif // _WIN32
 
-#pragma GCC optimize ("Os")
+class http_conn : public reactor_handler
+{
+public:
+    http_conn(SOCKET fd) : hSocket(fd)
+    {
+        tDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(iKeepAliveSec);
+    }
+
+    void on_io(bool bRead, bool bWrite);
+    void on_timeout();
+
+    bool send_frame(const std::string& sFrame);
+    void send_trace(std::shared_ptr<const std::string>&& trace);
+    // Answers what it can and sends, false if the connection has to go
+    bool pump();
+
+    SOCKET hSocket;
+
+private:
+    std::string sRecvBuf;
+    std::string sSendBuf;
+    bool bWatchWrite = false;
+    bool bClosing = false; // Answered the last request, waiting for the send buffer to drain
+    bool bStream = false;  // Event stream, we only write from now on
+
+    // The trace goes out of the shared buffer after sSendBuf. Pipelined requests behind
+    // it wait until it is out, answers have to go in order.
+    bool bTraceWait = false;
+    bool bTraceKeepAlive = false;
+    std::shared_ptr<const std::string> pBody;
+    size_t iBodyPos = 0;
+
+    // Request line and headers, we don't take bodies
+    static constexpr size_t iMaxRequestLen = 8192;
+    static constexpr size_t iKeepAliveSec = 15;
+    // A viewer that is this far behind is dropped
+    static constexpr size_t iMaxStreamBacklog = 64 * 1024;
+
+    bool do_recv();
+    bool do_send();
+    void sync_watch();
+    void process_requests();
+    bool process_request(char* sReq);
+    void send_response(const char* sStatus, const char* sType, const char* sHeaders,
+        const char* sBody, size_t iBodyLen, bool bHead, bool bKeepAlive);
+};
 
 httpd* httpd::oInst = nullptr;
 
-httpd::httpd()
+#pragma GCC optimize ("Os")
+bool httpd::start_daemon()
 {
+    uint16_t iPort = jconf::inst()->GetHttpdPort();
+    sock_init();
+
+    hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(hListen == INVALID_SOCKET)
+    {
+        printer::inst()->print_msg(L0, "HTTP Daemon failed to start: unable to create a socket.");
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(hListen, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
 
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(iPort);
+
+    if(bind(hListen, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(hListen, 16) != 0 || !sock_set_nonblock(hListen))
+    {
+        printer::inst()->print_msg(L0, "HTTP Daemon failed to start: unable to listen on port %u.", (unsigned int)iPort);
+        sock_close(hListen);
+        hListen = INVALID_SOCKET;
+        return false;
+    }
+
+    pReactor = new reactor("http", jconf::inst()->GetHttpdCpu());
+    pReactor->call([this]() { pReactor->watch(hListen, this, false); });
+    printer::inst()->print_msg(L1, "HTTP Daemon listening on port %u.", (unsigned int)iPort);
+    return true;
 }
 
-int httpd::req_handler(void * cls,
-            MHD_Connection* connection,
-            const char* url,
-            const char* method,
-            const char* version,
-            const char* upload_data,
-            size_t* upload_data_size,
-            void ** ptr)
+void httpd::on_io(bool bRead, bool bWrite)
 {
-    struct MHD_Response * rsp;
-
-    if (strcmp(method, "GET") != 0)
-        return MHD_NO;
+    do_accept();
+}
 
-    *ptr = nullptr;
+void httpd::on_timeout()
+{
+    tDeadline = time_point::max();
+}
 
-    std::string str;
-    if(strcasecmp(url, "/style.css") == 0)
+void httpd::do_accept()
+{
+    while(true)
     {
-        const char* req_etag = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match");
+        SOCKET fd = accept(hListen, nullptr, nullptr);
+        if(fd == INVALID_SOCKET)
+            return;
 
-        if(req_etag != NULL && strcmp(req_etag, sHtmlCssEtag) == 0)
-        { //Cache hit
-            rsp = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+        if(iConnCount >= iMaxConns || !sock_set_nonblock(fd))
+        {
+            sock_close(fd);
+            continue;
+        }
 
-            int ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, rsp);
-            MHD_destroy_response(rsp);
-            return ret;
+        http_conn* conn = new http_conn(fd);
+
+        if(!pReactor->watch(fd, conn, false))
+        {
+            sock_close(fd);
+            delete conn;
+            continue;
         }
 
-        rsp = MHD_create_response_from_buffer(sHtmlCssSize, (void*)sHtmlCssFile, MHD_RESPMEM_PERSISTENT);
-        MHD_add_response_header(rsp, "ETag", sHtmlCssEtag);
-        MHD_add_response_header(rsp, "Content-Type", "text/css; charset=utf-8");
+        iConnCount++;
     }
-    else if(strcasecmp(url, "/api.json") == 0)
-    {
-        executor::inst()->get_http_report(EV_HTML_JSON, str);
+}
+
+void httpd::add_stream(http_conn* conn)
+{
+    vStreams.push_back(conn);
+    iStreamCount = vStreams.size();
+}
+
+void httpd::push_event(std::shared_ptr<const std::string>&& frame)
+{
+    if(iStreamCount == 0)
+        return;
+
+    pReactor->post([this, frame]() {
+        // Dropping a stream changes vStreams, so walk a copy
+        std::vector<http_conn*> vSend(vStreams);
+        for(http_conn* conn : vSend)
+        {
+            if(!conn->send_frame(*frame))
+                drop_conn(conn);
+        }
+    });
+}
 
-        rsp = MHD_create_response_from_buffer(str.size(), (void*)str.c_str(), MHD_RESPMEM_MUST_COPY);
-        MHD_add_response_header(rsp, "Content-Type", "application/json; charset=utf-8");
+void httpd::request_trace(http_conn* conn)
+{
+    using namespace std::chrono;
+    if(pTrace != nullptr && steady_clock::now() - tTrace < milliseconds(iTraceMaxAgeMs))
+    {
+        conn->send_trace(std::shared_ptr<const std::string>(pTrace));
+        return;
     }
-    else if(strcasecmp(url, "/h") == 0 || strcasecmp(url, "/hashrate") == 0)
+
+    vTraceWaits.push_back(conn);
+    if(bTraceRendering)
+        return;
+
+    bTraceRendering = true;
+    std::thread([this]() {
+        std::shared_ptr<std::string> trace = std::make_shared<std::string>();
+        flight_recorder::inst()->dump(*trace);
+        pReactor->post([this, trace]() { finish_trace(trace); });
+    }).detach();
+}
+
+void httpd::finish_trace(std::shared_ptr<const std::string>&& trace)
+{
+    bTraceRendering = false;
+    pTrace = std::move(trace);
+    tTrace = std::chrono::steady_clock::now();
+
+    std::vector<http_conn*> vSend;
+    vSend.swap(vTraceWaits);
+    for(http_conn* conn : vSend)
     {
-        executor::inst()->get_http_report(EV_HTML_HASHRATE, str);
+        conn->send_trace(std::shared_ptr<const std::string>(pTrace));
+        if(!conn->pump())
+            drop_conn(conn);
+    }
+}
 
-        rsp = MHD_create_response_from_buffer(str.size(), (void*)str.c_str(), MHD_RESPMEM_MUST_COPY);
-        MHD_add_response_header(rsp, "Content-Type", "text/html; charset=utf-8");
+void httpd::drop_conn(http_conn* conn)
+{
+    auto it = std::find(vStreams.begin(), vStreams.end(), conn);
+    if(it != vStreams.end())
+    {
+        vStreams.erase(it);
+        iStreamCount = vStreams.size();
     }
-    else if(strcasecmp(url, "/c") == 0 || strcasecmp(url, "/connection") == 0)
+
+    it = std::find(vTraceWaits.begin(), vTraceWaits.end(), conn);
+    if(it != vTraceWaits.end())
+        vTraceWaits.erase(it);
+
+    pReactor->unwatch(conn->hSocket, conn);
+    sock_close(conn->hSocket);
+    iConnCount--;
+    delete conn;
+}
+
+void http_conn::on_io(bool bRead, bool bWrite)
+{
+    if(!do_recv() || !pump())
+        httpd::inst()->drop_conn(this);
+}
+
+bool http_conn::pump()
+{
+    // Once a trace is out the requests behind it can go, so keep at it until nothing moves
+    bool bMore;
+    do
     {
-        executor::inst()->get_http_report(EV_HTML_CONNSTAT, str);
+        size_t iLeft = sRecvBuf.size();
+        process_requests();
+
+        bool bHeld = pBody != nullptr;
+        if(!do_send())
+            return false;
 
-        rsp = MHD_create_response_from_buffer(str.size(), (void*)str.c_str(), MHD_RESPMEM_MUST_COPY);
-        MHD_add_response_header(rsp, "Content-Type", "text/html; charset=utf-8");
+        bMore = sRecvBuf.size() != iLeft || (bHeld && pBody == nullptr && !sRecvBuf.empty());
     }
-    else if(strcasecmp(url, "/r") == 0 || strcasecmp(url, "/results") == 0)
+    while(bMore);
+
+    if(bClosing && sSendBuf.empty() && pBody == nullptr)
+        return false;
+
+    sync_watch();
+    return true;
+}
+
+void http_conn::sync_watch()
+{
+    bool bWant = !sSendBuf.empty() || pBody != nullptr;
+    if(bWant != bWatchWrite)
     {
-        executor::inst()->get_http_report(EV_HTML_RESULTS, str);
+        httpd::inst()->pReactor->update(hSocket, this, bWant);
+        bWatchWrite = bWant;
+    }
+}
+
+bool http_conn::send_frame(const std::string& sFrame)
+{
+    if(sSendBuf.size() > iMaxStreamBacklog)
+        return false;
 
-        rsp = MHD_create_response_from_buffer(str.size(), (void*)str.c_str(), MHD_RESPMEM_MUST_COPY);
-        MHD_add_response_header(rsp, "Content-Type", "text/html; charset=utf-8");
+    sSendBuf.append(sFrame);
+    if(!do_send())
+        return false;
+
+    sync_watch();
+    return true;
+}
+
+// Idle keep-alive connection, or a client that is too slow to take its page
+void http_conn::on_timeout()
+{
+    httpd::inst()->drop_conn(this);
+}
+
+bool http_conn::do_send()
+{
+    while(!sSendBuf.empty() || pBody != nullptr)
+    {
+        bool bBody = sSendBuf.empty();
+        const char* sData = bBody ? pBody->data() + iBodyPos : sSendBuf.data();
+        size_t iLen = bBody ? pBody->size() - iBodyPos : sSendBuf.size();
+
+        int ret = ::send(hSocket, sData, (int)iLen, SOCK_SEND_FLAGS);
+        if(ret <= 0)
+            return ret < 0 && sock_would_block();
+
+        if(!bBody)
+            sSendBuf.erase(0, ret);
+        else if((iBodyPos += ret) == pBody->size())
+        {
+            pBody.reset();
+            iBodyPos = 0;
+        }
     }
-    else
+    return true;
+}
+
+bool http_conn::do_recv()
+{
+    char buf[4096];
+
+    while(true)
     {
-        //Do a 302 redirect to /h
-        char loc_path[256];
-        const char* host_val = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Host");
+        int ret = ::recv(hSocket, buf, sizeof(buf), 0);
+        if(ret == 0)
+            return false;
 
-        if(host_val != nullptr)
-            snprintf(loc_path, sizeof(loc_path), "http://%s/h", host_val);
+        if(ret < 0)
+            return sock_would_block();
+
+        // Whatever comes after the last answer is thrown away
+        if(bClosing || bStream)
+            continue;
+
+        sRecvBuf.append(buf, ret);
+        process_requests();
+        if(sRecvBuf.size() > iMaxRequestLen)
+            return false;
+
+        if(bStream)
+            tDeadline = time_point::max();
         else
-            snprintf(loc_path, sizeof(loc_path), "/h");
+            tDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(iKeepAliveSec);
+    }
+}
 
-        rsp = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
-        int ret = MHD_queue_response(connection, MHD_HTTP_TEMPORARY_REDIRECT, rsp);
-        MHD_add_response_header(rsp, "Location", loc_path);
-        MHD_destroy_response(rsp);
-        return ret;
+// Pipelined requests are answered in order
+void http_conn::process_requests()
+{
+    size_t iEnd;
+    while(!bClosing && !bStream && !bTraceWait && pBody == nullptr &&
+        (iEnd = sRecvBuf.find("\r\n\r\n")) != std::string::npos)
+    {
+        // The parser works on C strings, a NUL in there would cut it short
+        if(memchr(sRecvBuf.data(), '\0', iEnd) != nullptr)
+        {
+            send_response("400 Bad Request", nullptr, "", nullptr, 0, true, false);
+            bClosing = true;
+            break;
+        }
+
+        sRecvBuf[iEnd + 2] = '\0';
+        if(!process_request(&sRecvBuf[0]))
+            bClosing = true;
+        sRecvBuf.erase(0, iEnd + 4);
     }
 
-    int ret = MHD_queue_response(connection, MHD_HTTP_OK, rsp);
-    MHD_destroy_response(rsp);
-    return ret;
+    if(bClosing || bStream)
+        sRecvBuf.clear();
 }
 
-bool httpd::start_daemon()
+void http_conn::send_trace(std::shared_ptr<const std::string>&& trace)
 {
-    d = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
-        jconf::inst()->GetHttpdPort(), NULL, NULL,
-        &httpd::req_handler,
-        NULL, MHD_OPTION_END);
+    bTraceWait = false;
+    send_response("200 OK", "application/json; charset=utf-8", "Cache-Control: no-store\r\n",
+        nullptr, trace->size(), true, bTraceKeepAlive);
 
-    if(d == nullptr)
+    pBody = std::move(trace);
+    iBodyPos = 0;
+    if(!bTraceKeepAlive)
+        bClosing = true;
+}
+
+void http_conn::send_response(const char* sStatus, const char* sType, const char* sHeaders,
+    const char* sBody, size_t iBodyLen, bool bHead, bool bKeepAlive)
+{
+    char buf[512];
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Length: %llu\r\n%s%s%s%sConnection: %s\r\n\r\n",
+        sStatus, (long long unsigned int)iBodyLen,
+        sType != nullptr ? "Content-Type: " : "", sType != nullptr ? sType : "", sType != nullptr ? "\r\n" : "",
+        sHeaders, bKeepAlive ? "keep-alive" : "close");
+
+    sSendBuf.append(buf);
+    if(!bHead)
+        sSendBuf.append(sBody, iBodyLen);
+}
+
+/* sReq is the request line followed by the header lines, each ending in CRLF. Returns false
+   if the connection should be closed once the answer is out. */
+bool http_conn::process_request(char* sReq)
+{
+    char* sLineEnd = strstr(sReq, "\r\n");
+    if(sLineEnd == nullptr)
     {
-        printer::inst()->print_str("HTTP Daemon failed to start.");
+        send_response("400 Bad Request", nullptr, "", nullptr, 0, true, false);
         return false;
     }
+    *sLineEnd = '\0';
 
-    return true;
-}
+    char* sMethod = sReq;
+    char* sUrl = strchr(sMethod, ' ');
+    char* sVersion = sUrl != nullptr ? strchr(sUrl + 1, ' ') : nullptr;
+    if(sVersion == nullptr || strncmp(sVersion + 1, "HTTP/1.", 7) != 0)
+    {
+        send_response("400 Bad Request", nullptr, "", nullptr, 0, true, false);
+        return false;
+    }
+    *sUrl++ = '\0';
+    *sVersion++ = '\0';
 
-#endif
+    bool bKeepAlive = strcmp(sVersion, "HTTP/1.1") == 0;
+    const char* sEtag = nullptr;
 
+    for(char* sLine = sLineEnd + 2; *sLine != '\0'; )
+    {
+        sLineEnd = strstr(sLine, "\r\n");
+        if(sLineEnd == nullptr)
+        {
+            send_response("400 Bad Request", nullptr, "", nullptr, 0, true, false);
+            return false;
+        }
+        *sLineEnd = '\0';
+
+        char* sVal = strchr(sLine, ':');
+        if(sVal != nullptr)
+        {
+            *sVal++ = '\0';
+            sVal += strspn(sVal, " \t");
+
+            if(strcasecmp(sLine, "Connection") == 0)
+            {
+                if(strcasecmp(sVal, "close") == 0)
+                    bKeepAlive = false;
+                else if(strcasecmp(sVal, "keep-alive") == 0)
+                    bKeepAlive = true;
+            }
+            else if(strcasecmp(sLine, "If-None-Match") == 0)
+                sEtag = sVal;
+            else if(strcasecmp(sLine, "Content-Length") == 0 || strcasecmp(sLine, "Transfer-Encoding") == 0)
+                bKeepAlive = false; // We don't read bodies, so we can't find the next request
+        }
+
+        sLine = sLineEnd + 2;
+    }
+
+    bool bHead = strcmp(sMethod, "HEAD") == 0;
+    if(!bHead && strcmp(sMethod, "GET") != 0)
+    {
+        send_response("405 Method Not Allowed", nullptr, "Allow: GET, HEAD\r\n", nullptr, 0, true, false);
+        return false;
+    }
+
+    char* sQuery = strchr(sUrl, '?');
+    if(sQuery != nullptr)
+        *sQuery = '\0';
+
+    if(strcasecmp(sUrl, "/style.css") == 0)
+    {
+        if(sEtag != nullptr && strcmp(sEtag, sHtmlCssEtag) == 0)
+            send_response("304 Not Modified", nullptr, "", nullptr, 0, true, bKeepAlive);
+        else
+        {
+            char sHeaders[128];
+            snprintf(sHeaders, sizeof(sHeaders), "ETag: %s\r\n", sHtmlCssEtag);
+            send_response("200 OK", "text/css; charset=utf-8", sHeaders, sHtmlCssFile, sHtmlCssSize, bHead, bKeepAlive);
+        }
+        return bKeepAlive;
+    }
+
+    if(strcasecmp(sUrl, "/events") == 0)
+    {
+        sSendBuf.append("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+            "Connection: keep-alive\r\n\r\n");
+
+        if(bHead)
+            return bKeepAlive;
+
+        bStream = true;
+        httpd::inst()->add_stream(this);
+        return true;
+    }
+
+    // Rendered from the rings on a worker thread, we don't know the length without doing that
+    if(strcasecmp(sUrl, "/trace.json") == 0)
+    {
+        if(bHead)
+        {
+            sSendBuf.append("HTTP/1.1 200 OK\r\nContent-Type: application/json; charset=utf-8\r\nCache-Control: no-store\r\n");
+            sSendBuf.append(bKeepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+            return bKeepAlive;
+        }
+
+        bTraceWait = true;
+        bTraceKeepAlive = bKeepAlive;
+        httpd::inst()->request_trace(this);
+        return true;
+    }
+
+    // Served as it was at the last executor tick
+    std::shared_ptr<const executor::http_snapshot> snap = executor::inst()->get_http_snapshot();
+    const std::string* sPage = nullptr;
+    const char* sType = "text/html; charset=utf-8";
+
+    if(snap == nullptr)
+    {
+        send_response("503 Service Unavailable", nullptr, "Retry-After: 1\r\n", nullptr, 0, true, bKeepAlive);
+        return bKeepAlive;
+    }
+    else if(strcasecmp(sUrl, "/api.json") == 0)
+    {
+        sPage = &snap->sJson;
+        sType = "application/json; charset=utf-8";
+    }
+    else if(strcasecmp(sUrl, "/metrics") == 0)
+    {
+        sPage = &snap->sMetrics;
+        sType = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+    }
+    else if(strcasecmp(sUrl, "/h") == 0 || strcasecmp(sUrl, "/hashrate") == 0)
+        sPage = &snap->sHashrate;
+    else if(strcasecmp(sUrl, "/c") == 0 || strcasecmp(sUrl, "/connection") == 0)
+        sPage = &snap->sConnStat;
+    else if(strcasecmp(sUrl, "/r") == 0 || strcasecmp(sUrl, "/results") == 0)
+        sPage = &snap->sResults;
+    else
+    {
+        send_response("307 Temporary Redirect", nullptr, "Location: /h\r\n", nullptr, 0, true, bKeepAlive);
+        return bKeepAlive;
+    }
+
+    send_response("200 OK", sType, "", sPage->data(), sPage->size(), bHead, bKeepAlive);
+    return bKeepAlive;
+}
 #pragma GCC reset_options
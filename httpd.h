@@ -1,9 +1,28 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
 
-struct MHD_Daemon;
-struct MHD_Connection;
+#include "reactor.h"
 
-class httpd
+/*
+ * Built-in web server. It has a reactor of its own, one thread for all the connections
+ * and none of the pool sockets, so a busy client can't hold up a submit. Pages come
+ * straight out of the executor's latest http snapshot, a request never waits for the
+ * executor.
+ *
+ * HTTP/1.1 with keep-alive, GET and HEAD only. Anything else gets an error and a close.
+ * /events turns the connection into a server-sent event stream that gets the executor's
+ * frame once per tick. /trace.json is rendered on a worker thread, the connections that
+ * asked for it wait and get the same buffer, which is reused for iTraceMaxAgeMs.
+ */
+
+class http_conn;
+
+class httpd : public reactor_handler
 {
 public:
     static httpd* inst()
@@ -14,18 +33,36 @@ public:
 
     bool start_daemon();
 
+    // Executor thread, one frame shared by all the streams
+    void push_event(std::shared_ptr<const std::string>&& frame);
+
+    void on_io(bool bRead, bool bWrite);
+    void on_timeout();
+
 private:
-    httpd();
+    httpd() : iStreamCount(0) {}
     static httpd* oInst;
 
-    static int req_handler(void * cls,
-            MHD_Connection* connection,
-            const char* url,
-            const char* method,
-            const char* version,
-            const char* upload_data,
-            size_t* upload_data_size,
-            void ** ptr);
+    friend class http_conn;
+
+    // A monitoring page doesn't need more, and it caps what a port scan can cost us
+    static constexpr size_t iMaxConns = 64;
+
+    reactor* pReactor = nullptr;
+    SOCKET hListen = INVALID_SOCKET;
+    size_t iConnCount = 0;
+    std::vector<http_conn*> vStreams;
+    std::atomic<size_t> iStreamCount;
+
+    static constexpr size_t iTraceMaxAgeMs = 1000;
+    std::vector<http_conn*> vTraceWaits;
+    bool bTraceRendering = false;
+    std::shared_ptr<const std::string> pTrace;
+    std::chrono::steady_clock::time_point tTrace;
 
-    MHD_Daemon *d;
+    void do_accept();
+    void drop_conn(http_conn* conn);
+    void add_stream(http_conn* conn);
+    void request_trace(http_conn* conn);
+    void finish_trace(std::shared_ptr<const std::string>&& trace);
 };
@@ -48,10 +48,10 @@ using namespace rapidjson;
 /*
  * This enum needs to match index in oConfigValues, otherwise we will get a runtime error
  */
-enum configEnum { sPoolAddr, sWalletAddr, sPoolPwd, bTlsMode, bTlsSecureAlgo, sTlsFingerprint,
+enum configEnum { aPoolList, sRigId, iFixedDiff, iAutoDiffTime, bTlsSecureAlgo, bDonationSplit,
     aCpuThreadsConf, sUseSlowMem, bNiceHashMode, bAesOverride,
-    iCallTimeout, iNetRetry, iGiveUpLimit, iVerboseLevel, iAutohashTime,
-    bDaemonMode, sOutputFile, iHttpdPort, bPreferIpv4 };
+    iCallTimeout, iNetRetry, iGiveUpLimit, iKeepaliveTime, iVerboseLevel, iAutohashTime,
+    bDaemonMode, sOutputFile, iHttpdPort, iHttpdCpu, iProxyPort, sJobBus, sJobBusName, sStatsShm, bPreferIpv4 };
 
 struct configVal {
     configEnum iName;
@@ -62,12 +62,12 @@ struct configVal {
 // Same order as in configEnum, as per comment above
 // kNullType means any type
 configVal oConfigValues[] = {
-    { sPoolAddr, "pool_address", kStringType },
-    { sWalletAddr, "wallet_address", kStringType },
-    { sPoolPwd, "pool_password", kStringType },
-    { bTlsMode, "use_tls", kTrueType },
+    { aPoolList, "pool_list", kArrayType },
+    { sRigId, "rig_id", kStringType },
+    { iFixedDiff, "fixed_difficulty", kNumberType },
+    { iAutoDiffTime, "auto_difficulty_time", kNumberType },
     { bTlsSecureAlgo, "tls_secure_algo", kTrueType },
-    { sTlsFingerprint, "tls_fingerprint", kStringType },
+    { bDonationSplit, "donation_split", kTrueType },
     { aCpuThreadsConf, "cpu_threads_conf", kNullType },
     { sUseSlowMem, "use_slow_memory", kStringType },
     { bNiceHashMode, "nicehash_nonce", kTrueType },
@@ -75,11 +75,17 @@ configVal oConfigValues[] = {
     { iCallTimeout, "call_timeout", kNumberType },
     { iNetRetry, "retry_time", kNumberType },
     { iGiveUpLimit, "giveup_limit", kNumberType },
+    { iKeepaliveTime, "keepalive_interval", kNumberType },
     { iVerboseLevel, "verbose_level", kNumberType },
     { iAutohashTime, "h_print_time", kNumberType },
     { bDaemonMode, "daemon_mode", kTrueType },
     { sOutputFile, "output_file", kStringType },
     { iHttpdPort, "httpd_port", kNumberType },
+    { iHttpdCpu, "httpd_affine_to_cpu", kNullType },
+    { iProxyPort, "proxy_port", kNumberType },
+    { sJobBus, "job_bus", kStringType },
+    { sJobBusName, "job_bus_name", kStringType },
+    { sStatsShm, "stats_shm_name", kStringType },
     { bPreferIpv4, "prefer_ipv4", kTrueType }
 };
 
@@ -181,34 +187,53 @@ jconf::slow_mem_cfg jconf::GetSlowMemSetting()
         return unknown_value;
 }
 
-bool jconf::GetTlsSetting()
-{
-    return prv->configValues[bTlsMode]->GetBool();
-}
-
 bool jconf::TlsSecureAlgos()
 {
     return prv->configValues[bTlsSecureAlgo]->GetBool();
 }
 
-const char* jconf::GetTlsFingerprint()
+bool jconf::DonationSplit()
 {
-    return prv->configValues[sTlsFingerprint]->GetString();
+    return prv->configValues[bDonationSplit]->GetBool();
 }
 
-const char* jconf::GetPoolAddress()
+size_t jconf::GetPoolCount()
 {
-    return prv->configValues[sPoolAddr]->GetString();
+    return prv->configValues[aPoolList]->Size();
 }
 
-const char* jconf::GetPoolPwd()
+bool jconf::GetPoolConfig(size_t id, pool_cfg& cfg)
 {
-    return prv->configValues[sPoolPwd]->GetString();
-}
+    if(id >= GetPoolCount())
+        return false;
 
-const char* jconf::GetWalletAddress()
-{
-    return prv->configValues[sWalletAddr]->GetString();
+    const Value& oPoolConf = prv->configValues[aPoolList]->GetArray()[id];
+
+    if(!oPoolConf.IsObject())
+        return false;
+
+    const Value *addr, *wallet, *pwd, *tls, *fp, *weight;
+    addr = GetObjectMember(oPoolConf, "pool_address");
+    wallet = GetObjectMember(oPoolConf, "wallet_address");
+    pwd = GetObjectMember(oPoolConf, "pool_password");
+    tls = GetObjectMember(oPoolConf, "use_tls");
+    fp = GetObjectMember(oPoolConf, "tls_fingerprint");
+    weight = GetObjectMember(oPoolConf, "pool_weight");
+
+    if(addr == nullptr || wallet == nullptr || pwd == nullptr || tls == nullptr || fp == nullptr || weight == nullptr)
+        return false;
+
+    if(!addr->IsString() || !wallet->IsString() || !pwd->IsString() || !tls->IsBool() || !fp->IsString() || !weight->IsNumber())
+        return false;
+
+    cfg.sPoolAddr = addr->GetString();
+    cfg.sWalletAddr = wallet->GetString();
+    cfg.sPasswd = pwd->GetString();
+    cfg.tls = tls->GetBool();
+    cfg.tls_fingerprint = fp->GetString();
+    cfg.weight = weight->GetDouble();
+
+    return cfg.weight > 0.0;
 }
 
 bool jconf::PreferIpv4()
@@ -244,6 +269,26 @@ uint64_t jconf::GetGiveUpLimit()
     return prv->configValues[iGiveUpLimit]->GetUint64();
 }
 
+uint64_t jconf::GetKeepaliveTime()
+{
+    return prv->configValues[iKeepaliveTime]->GetUint64();
+}
+
+const char* jconf::GetRigId()
+{
+    return prv->configValues[sRigId]->GetString();
+}
+
+uint64_t jconf::GetFixedDiff()
+{
+    return prv->configValues[iFixedDiff]->GetUint64();
+}
+
+uint64_t jconf::GetAutoDiffTime()
+{
+    return prv->configValues[iAutoDiffTime]->GetUint64();
+}
+
 uint64_t jconf::GetVerboseLevel()
 {
     return prv->configValues[iVerboseLevel]->GetUint64();
@@ -259,6 +304,42 @@ uint16_t jconf::GetHttpdPort()
     return prv->configValues[iHttpdPort]->GetUint();
 }
 
+int64_t jconf::GetHttpdCpu()
+{
+    if(prv->configValues[iHttpdCpu]->IsNumber())
+        return prv->configValues[iHttpdCpu]->GetInt64();
+    return -1;
+}
+
+uint16_t jconf::GetProxyPort()
+{
+    return prv->configValues[iProxyPort]->GetUint();
+}
+
+jconf::job_bus_role jconf::GetJobBusRole()
+{
+    const char* opt = prv->configValues[sJobBus]->GetString();
+
+    if(strcasecmp(opt, "off") == 0)
+        return bus_off;
+    else if(strcasecmp(opt, "leader") == 0)
+        return bus_leader;
+    else if(strcasecmp(opt, "follower") == 0)
+        return bus_follower;
+    else
+        return bus_unknown;
+}
+
+const char* jconf::GetJobBusName()
+{
+    return prv->configValues[sJobBusName]->GetString();
+}
+
+const char* jconf::GetStatsShmName()
+{
+    return prv->configValues[sStatsShm]->GetString();
+}
+
 bool jconf::NiceHashMode()
 {
     return prv->configValues[bNiceHashMode]->GetBool();
@@ -400,6 +481,31 @@ bool jconf::parse_config(const char* sFilename)
         }
     }
 
+    if(GetPoolCount() == 0)
+    {
+        printer::inst()->print_msg(L0, RED("Invalid config file. pool_list needs at least one pool."));
+        return false;
+    }
+
+    pool_cfg pc;
+    for(size_t i=0; i < GetPoolCount(); i++)
+    {
+        if(!GetPoolConfig(i, pc))
+        {
+            printer::inst()->print_msg(L0, RED("Pool %llu has invalid config. All keys need to be set and pool_weight has to be positive."), int_port(i));
+            return false;
+        }
+
+#ifdef CONF_NO_TLS
+        if(pc.tls)
+        {
+            printer::inst()->print_msg(L0,
+                RED("Invalid config file. TLS enabled while the application has been compiled without TLS support."));
+            return false;
+        }
+#endif // CONF_NO_TLS
+    }
+
     thd_cfg c;
     for(size_t i=0; i < GetThreadCount(); i++)
     {
@@ -410,9 +516,83 @@ bool jconf::parse_config(const char* sFilename)
         }
     }
 
-    if(NiceHashMode() && GetThreadCount() >= 32)
+    if(!prv->configValues[iProxyPort]->IsUint() || prv->configValues[iProxyPort]->GetUint() > 0xFFFF)
     {
-        printer::inst()->print_msg(L0, RED("You need to use less than 32 threads in NiceHash mode."));
+        printer::inst()->print_msg(L0,
+            RED("Invalid config file. proxy_port has to be in the range 0 to 65535."));
+        return false;
+    }
+
+    if(NiceHashMode() && GetProxyPort() != 0)
+    {
+        printer::inst()->print_msg(L0, RED("Proxy mode needs the top nonce byte for the workers, it can't be used with nicehash_nonce."));
+        return false;
+    }
+
+    job_bus_role bus = GetJobBusRole();
+    if(bus == bus_unknown)
+    {
+        printer::inst()->print_msg(L0,
+            RED("Invalid config file. job_bus must be \"off\", \"leader\" or \"follower\"."));
+        return false;
+    }
+
+#ifdef _WIN32
+    if(bus != bus_off)
+    {
+        printer::inst()->print_msg(L0, RED("The job bus is not supported on Windows."));
+        return false;
+    }
+#endif // _WIN32
+
+    if(bus != bus_off)
+    {
+        const char* name = GetJobBusName();
+        if(name[0] != '/' || strlen(name) < 2 || strlen(name) > 200 || strchr(name + 1, '/') != nullptr)
+        {
+            printer::inst()->print_msg(L0,
+                RED("Invalid config file. job_bus_name has to look like \"/name\" without any further slashes."));
+            return false;
+        }
+
+        if(GetProxyPort() != 0)
+        {
+            printer::inst()->print_msg(L0, RED("The job bus and the proxy both need the top nonce byte, use only one of them."));
+            return false;
+        }
+
+        if(bus == bus_leader && NiceHashMode())
+        {
+            printer::inst()->print_msg(L0, RED("The job bus needs the top nonce byte for the followers, it can't be used with nicehash_nonce."));
+            return false;
+        }
+    }
+
+    const char* stats = GetStatsShmName();
+    if(stats[0] != '\0')
+    {
+#ifdef _WIN32
+        printer::inst()->print_msg(L0, RED("The stats segment is not supported on Windows."));
+        return false;
+#endif // _WIN32
+
+        if(stats[0] != '/' || strlen(stats) < 2 || strlen(stats) > 200 || strchr(stats + 1, '/') != nullptr)
+        {
+            printer::inst()->print_msg(L0,
+                RED("Invalid config file. stats_shm_name has to look like \"/name\" without any further slashes."));
+            return false;
+        }
+
+        if(bus != bus_off && strcmp(stats, GetJobBusName()) == 0)
+        {
+            printer::inst()->print_msg(L0, RED("Invalid config file. stats_shm_name and job_bus_name have to be different."));
+            return false;
+        }
+    }
+
+    if((NiceHashMode() || GetProxyPort() != 0 || bus != bus_off) && GetThreadCount() >= 32)
+    {
+        printer::inst()->print_msg(L0, RED("You need to use less than 32 threads in NiceHash, proxy or job bus mode."));
         return false;
     }
 
@@ -425,10 +605,26 @@ bool jconf::parse_config(const char* sFilename)
 
     if(!prv->configValues[iCallTimeout]->IsUint64() ||
         !prv->configValues[iNetRetry]->IsUint64() ||
-        !prv->configValues[iGiveUpLimit]->IsUint64())
+        !prv->configValues[iGiveUpLimit]->IsUint64() ||
+        !prv->configValues[iKeepaliveTime]->IsUint64())
+    {
+        printer::inst()->print_msg(L0,
+            RED("Invalid config file. call_timeout, retry_time, giveup_limit and keepalive_interval need to be positive integers."));
+        return false;
+    }
+
+    if(!prv->configValues[iFixedDiff]->IsUint64() || !prv->configValues[iAutoDiffTime]->IsUint64())
+    {
+        printer::inst()->print_msg(L0, RED("Invalid config file. fixed_difficulty and auto_difficulty_time need to be positive integers."));
+        return false;
+    }
+
+    // It goes into the login line as it is
+    const char* rig = GetRigId();
+    if(strlen(rig) > 32 || strspn(rig, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.") != strlen(rig))
     {
         printer::inst()->print_msg(L0,
-            RED("Invalid config file. call_timeout, retry_time and giveup_limit need to be positive integers."));
+            RED("Invalid config file. rig_id can have up to 32 letters, digits, '-', '_' and '.'."));
         return false;
     }
 
@@ -446,14 +642,13 @@ bool jconf::parse_config(const char* sFilename)
         return false;
     }
 
-#ifdef CONF_NO_TLS
-    if(prv->configValues[bTlsMode]->GetBool())
+    const Value* httpdCpu = prv->configValues[iHttpdCpu];
+    if(!(httpdCpu->IsFalse() || (httpdCpu->IsInt64() && httpdCpu->GetInt64() >= 0)))
     {
         printer::inst()->print_msg(L0,
-            RED("Invalid config file. TLS enabled while the application has been compiled without TLS support."));
+            RED("Invalid config file. httpd_affine_to_cpu has to be false or a CPU number."));
         return false;
     }
-#endif // CONF_NO_TLS
 
 #ifdef _WIN32
     if(GetSlowMemSetting() == no_mlck)
@@ -27,19 +27,34 @@ public:
         unknown_value
     };
 
+    enum job_bus_role {
+        bus_off,
+        bus_leader,
+        bus_follower,
+        bus_unknown
+    };
+
+    struct pool_cfg {
+        const char* sPoolAddr;
+        const char* sWalletAddr;
+        const char* sPasswd;
+        bool tls;
+        const char* tls_fingerprint;
+        double weight;
+    };
+
+    size_t GetPoolCount();
+    bool GetPoolConfig(size_t id, pool_cfg& cfg);
+
     size_t GetThreadCount();
     bool GetThreadConfig(size_t id, thd_cfg &cfg);
     bool NeedsAutoconf();
 
     slow_mem_cfg GetSlowMemSetting();
 
-    bool GetTlsSetting();
     bool TlsSecureAlgos();
-    const char* GetTlsFingerprint();
 
-    const char* GetPoolAddress();
-    const char* GetPoolPwd();
-    const char* GetWalletAddress();
+    bool DonationSplit();
 
     uint64_t GetVerboseLevel();
     uint64_t GetAutohashTime();
@@ -49,8 +64,19 @@ public:
     uint64_t GetCallTimeout();
     uint64_t GetNetRetry();
     uint64_t GetGiveUpLimit();
+    uint64_t GetKeepaliveTime();
+
+    const char* GetRigId();
+    uint64_t GetFixedDiff();
+    uint64_t GetAutoDiffTime();
 
     uint16_t GetHttpdPort();
+    int64_t GetHttpdCpu(); // -1 means no affinity
+    uint16_t GetProxyPort();
+
+    job_bus_role GetJobBusRole();
+    const char* GetJobBusName();
+    const char* GetStatsShmName();
 
     bool NiceHashMode();
 
@@ -0,0 +1,470 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+#include <string.h>
+#include <thread>
+#include <chrono>
+
+#include "jobbus.h"
+#include "executor.h"
+#include "jconf.h"
+#include "console.h"
+
+job_bus* job_bus::oInst = nullptr;
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// The segment is shared between processes, so everything in it has to be address free
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "The job bus needs lock-free atomics.");
+
+static constexpr uint32_t iBusMagic = 0x7375626a; // "jbus"
+static constexpr uint32_t iBusVersion = 3;
+static constexpr size_t iRingSize = 64;
+
+// A lease or a leader that didn't check in for this long is gone
+static constexpr uint64_t iBusTimeoutMs = 10000;
+
+// Job handles are the leader's, followers just pass them back
+struct bus_job
+{
+    uint8_t  bWorkBlob[112];
+    uint64_t iTarget;
+    uint64_t iPoolId;
+    uint32_t iJobHandle;
+    uint32_t iWorkSize;
+    uint32_t iResumeCnt;
+    uint32_t bStall;
+};
+
+struct bus_result
+{
+    uint8_t  bResult[32];
+    uint64_t iPoolId;
+    uint32_t iJobHandle;
+    uint32_t iNonce;
+};
+
+struct alignas(64) bus_follower
+{
+    std::atomic<uint32_t> iOwner; // pid holding the lease, zero if free
+    std::atomic<uint64_t> iBeat;
+    alignas(64) std::atomic<uint32_t> iHead; // follower only
+    alignas(64) std::atomic<uint32_t> iTail; // leader only
+    bus_result vRing[iRingSize];
+};
+
+struct job_bus::bus_shm
+{
+    std::atomic<uint32_t> iMagic;
+    uint32_t iVersion;
+    std::atomic<uint32_t> iLeader;
+    std::atomic<uint64_t> iLeaderBeat;
+
+    // Odd while the leader is writing the jobs, doubles as the followers' futex
+    alignas(64) std::atomic<uint32_t> iSeq;
+    bus_job oJob;
+    bus_job oSplitJob;
+    uint32_t iSplitShare;
+    // Bumped with each of the two jobs, so that a follower only switches what changed
+    uint32_t iJobNo;
+    uint32_t iSplitNo;
+
+    // Bumped for every result, the leader sleeps on it
+    alignas(64) std::atomic<uint32_t> iDoorbell;
+    bus_follower vFollowers[job_bus::iMaxFollowers];
+};
+
+static inline uint64_t bus_now()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static inline void bus_wait(std::atomic<uint32_t>* addr, uint32_t val, int ms)
+{
+#if defined(__linux__)
+    timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT, val, &ts, nullptr, 0);
+#else
+    for(int i = 0; i < ms && addr->load(std::memory_order_acquire) == val; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+}
+
+static inline void bus_wake(std::atomic<uint32_t>* addr)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+#pragma GCC optimize ("Os")
+bool job_bus::map_segment(const char* sName, bool bCreate)
+{
+    int fd = shm_open(sName, bCreate ? (O_RDWR | O_CREAT) : O_RDWR, 0600);
+    if(fd == -1)
+        return false;
+
+    if(bCreate && ftruncate(fd, sizeof(bus_shm)) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(bus_shm))
+    {
+        close(fd);
+        return false;
+    }
+
+    void* mem = mmap(nullptr, sizeof(bus_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(mem == MAP_FAILED)
+        return false;
+
+    pShm = (bus_shm*)mem;
+    return true;
+}
+
+bool job_bus::start_leader(const char* sName)
+{
+    if(!map_segment(sName, true))
+    {
+        printer::inst()->print_msg(L0, "Unable to create the job bus segment %s: %s", sName, strerror(errno));
+        return false;
+    }
+
+    uint32_t iPid = getpid();
+    if(pShm->iMagic.load() == iBusMagic && pShm->iVersion == iBusVersion)
+    {
+        uint32_t iOther = pShm->iLeader.load();
+        if(iOther != 0 && iOther != iPid && kill(iOther, 0) == 0 &&
+            bus_now() - pShm->iLeaderBeat.load() < iBusTimeoutMs)
+        {
+            printer::inst()->print_msg(L0, "Job bus %s already has a leader (pid %u).", sName, iOther);
+            return false;
+        }
+
+        // Followers keep their leases, results from before our time are dropped
+        for(bus_follower& f : pShm->vFollowers)
+            f.iTail.store(f.iHead.load());
+    }
+    else
+    {
+        pShm->iMagic.store(0);
+        memset((void*)pShm, 0, sizeof(bus_shm));
+        pShm->iVersion = iBusVersion;
+        pShm->iMagic.store(iBusMagic, std::memory_order_release);
+    }
+
+    pShm->iLeader.store(iPid);
+    pShm->iLeaderBeat.store(bus_now());
+    bLeader = true;
+
+    // A split left behind by the last leader has job handles we don't know
+    publish_split(minethd::miner_work(), 0);
+
+    std::thread(&job_bus::leader_thread, this).detach();
+    printer::inst()->print_msg(L1, "Job bus %s is up, we are the leader.", sName);
+    return true;
+}
+
+bool job_bus::start_follower(const char* sName)
+{
+    printer::inst()->print_msg(L1, "Waiting for the job bus leader on %s ...", sName);
+
+    while(!map_segment(sName, false) || pShm->iMagic.load(std::memory_order_acquire) != iBusMagic)
+    {
+        if(pShm != nullptr && pShm->iVersion != iBusVersion && pShm->iMagic.load() == iBusMagic)
+        {
+            printer::inst()->print_msg(L0, "Job bus %s was set up by a different version of the miner.", sName);
+            return false;
+        }
+
+        if(pShm != nullptr)
+        {
+            munmap(pShm, sizeof(bus_shm));
+            pShm = nullptr;
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+
+    while(!take_lease())
+    {
+        printer::inst()->print_msg(L1, "All %u job bus slots are taken, waiting.", (unsigned int)iMaxFollowers);
+        std::this_thread::sleep_for(std::chrono::seconds(5));
+    }
+
+    printer::inst()->print_msg(L1, "Joined job bus %s in slot %u.", sName, (unsigned int)iSlot);
+    std::thread(&job_bus::follower_thread, this).detach();
+    return true;
+}
+
+bool job_bus::take_lease()
+{
+    uint32_t iPid = getpid();
+    uint64_t iNow = bus_now();
+
+    for(size_t i = 0; i < iMaxFollowers; i++)
+    {
+        bus_follower& f = pShm->vFollowers[i];
+        uint32_t iOwner = f.iOwner.load();
+
+        if(iOwner != 0 && iOwner != iPid && iNow - f.iBeat.load() < iBusTimeoutMs)
+            continue;
+
+        if(!f.iOwner.compare_exchange_strong(iOwner, iPid))
+            continue;
+
+        f.iBeat.store(iNow);
+        iSlot = i + 1;
+        return true;
+    }
+
+    return false;
+}
+
+size_t job_bus::get_follower_count()
+{
+    size_t n = 0;
+    uint64_t iNow = bus_now();
+    for(bus_follower& f : pShm->vFollowers)
+    {
+        if(f.iOwner.load() != 0 && iNow - f.iBeat.load() < iBusTimeoutMs)
+            n++;
+    }
+    return n;
+}
+
+void job_bus::heartbeat()
+{
+    if(bLeader)
+    {
+        pShm->iLeaderBeat.store(bus_now(), std::memory_order_relaxed);
+        return;
+    }
+
+    bus_follower& f = pShm->vFollowers[iSlot - 1];
+    if(f.iOwner.load() == (uint32_t)getpid())
+    {
+        f.iBeat.store(bus_now(), std::memory_order_relaxed);
+        return;
+    }
+
+    // Somebody took our slot while we were stuck, our nonces now belong to them
+    printer::inst()->print_msg(L0, "Lost the job bus slot %u. Exitting.", (unsigned int)iSlot);
+    exit(1);
+}
+
+void job_bus::leader_thread()
+{
+    uint32_t iMaxPoolId = jconf::inst()->GetPoolCount() + 1;
+
+    while(true)
+    {
+        uint32_t iBell = pShm->iDoorbell.load(std::memory_order_acquire);
+
+        for(bus_follower& f : pShm->vFollowers)
+        {
+            uint32_t iTail = f.iTail.load(std::memory_order_relaxed);
+            uint32_t iHead = f.iHead.load(std::memory_order_acquire);
+
+            for(; iTail != iHead; iTail++)
+            {
+                const bus_result& r = f.vRing[iTail % iRingSize];
+                if(r.iPoolId == executor::invalid_pool_id || r.iPoolId > iMaxPoolId)
+                    continue;
+
+                executor::inst()->push_event(ex_event(job_result(r.iJobHandle, r.iNonce, r.bResult), r.iPoolId));
+            }
+
+            f.iTail.store(iTail, std::memory_order_release);
+        }
+
+        bus_wait(&pShm->iDoorbell, iBell, 100);
+    }
+}
+#pragma GCC reset_options
+
+#pragma GCC optimize ("O2")
+static void to_bus_job(bus_job& oJob, const minethd::miner_work& oWork)
+{
+    memcpy(oJob.bWorkBlob, oWork.bWorkBlob, sizeof(oJob.bWorkBlob));
+    oJob.iTarget = oWork.iTarget;
+    oJob.iPoolId = oWork.iPoolId;
+    oJob.iJobHandle = oWork.iJobHandle;
+    oJob.iWorkSize = oWork.iWorkSize;
+    oJob.iResumeCnt = oWork.iResumeCnt;
+    oJob.bStall = oWork.bStall;
+}
+
+void job_bus::write_begin()
+{
+    uint32_t iSeq = pShm->iSeq.load(std::memory_order_relaxed);
+    pShm->iSeq.store(iSeq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void job_bus::write_end()
+{
+    pShm->iSeq.fetch_add(1, std::memory_order_release);
+    bus_wake(&pShm->iSeq);
+}
+
+void job_bus::publish(const minethd::miner_work& oWork)
+{
+    bus_job oJob;
+    to_bus_job(oJob, oWork);
+
+    write_begin();
+    memcpy(&pShm->oJob, &oJob, sizeof(oJob));
+    pShm->iJobNo++;
+    write_end();
+}
+
+void job_bus::publish_split(const minethd::miner_work& oWork, uint32_t iShare)
+{
+    bus_job oJob;
+    to_bus_job(oJob, oWork);
+
+    write_begin();
+    memcpy(&pShm->oSplitJob, &oJob, sizeof(oJob));
+    pShm->iSplitShare = iShare;
+    pShm->iSplitNo++;
+    write_end();
+}
+
+bool job_bus::push_result(const job_result& oResult, size_t pool_id)
+{
+    bus_follower& f = pShm->vFollowers[iSlot - 1];
+    uint32_t iHead = f.iHead.load(std::memory_order_relaxed);
+
+    if(iHead - f.iTail.load(std::memory_order_acquire) >= iRingSize)
+        return false;
+
+    bus_result& r = f.vRing[iHead % iRingSize];
+    memcpy(r.bResult, oResult.bResult, sizeof(r.bResult));
+    r.iJobHandle = oResult.iJobHandle;
+    r.iNonce = oResult.iNonce;
+    r.iPoolId = pool_id;
+
+    f.iHead.store(iHead + 1, std::memory_order_release);
+    pShm->iDoorbell.fetch_add(1, std::memory_order_release);
+    bus_wake(&pShm->iDoorbell);
+    return true;
+}
+
+// Stall work if the job is a stall or makes no sense
+static minethd::miner_work from_bus_job(bus_job& oJob, size_t iSlot)
+{
+    if(oJob.bStall || oJob.iWorkSize <= minethd::iNonceTopByte || oJob.iWorkSize > sizeof(oJob.bWorkBlob))
+        return minethd::miner_work();
+
+    oJob.bWorkBlob[minethd::iNonceTopByte] = (uint8_t)iSlot;
+    return minethd::miner_work(oJob.iJobHandle, oJob.bWorkBlob, oJob.iWorkSize, oJob.iResumeCnt,
+        oJob.iTarget, true, oJob.iPoolId);
+}
+
+void job_bus::follower_thread()
+{
+    uint32_t iSeen = 0, iJobSeen = 0, iSplitSeen = 0;
+    bool bLeaderGone = false;
+    bus_job oJob, oSplitJob;
+    uint32_t iSplitShare, iJobNo, iSplitNo;
+
+    while(true)
+    {
+        uint32_t iSeq = pShm->iSeq.load(std::memory_order_acquire);
+
+        // Seqlock read, if the leader wrote in the meantime we just try again
+        if(iSeq != iSeen && (iSeq & 1) == 0)
+        {
+            memcpy(&oJob, &pShm->oJob, sizeof(oJob));
+            memcpy(&oSplitJob, &pShm->oSplitJob, sizeof(oSplitJob));
+            iSplitShare = pShm->iSplitShare;
+            iJobNo = pShm->iJobNo;
+            iSplitNo = pShm->iSplitNo;
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if(pShm->iSeq.load(std::memory_order_relaxed) != iSeq)
+                continue;
+
+            iSeen = iSeq;
+
+            // Switching to the same job again would start its nonces over
+            if(iJobNo != iJobSeen)
+            {
+                iJobSeen = iJobNo;
+                minethd::miner_work oWork = from_bus_job(oJob, iSlot);
+                minethd::switch_work(oWork);
+            }
+
+            if(iSplitNo != iSplitSeen)
+            {
+                iSplitSeen = iSplitNo;
+                minethd::miner_work oWork = from_bus_job(oSplitJob, iSlot);
+                minethd::switch_split_work(oWork, iSplitShare);
+            }
+        }
+
+        bool bGone = bus_now() - pShm->iLeaderBeat.load(std::memory_order_relaxed) >= iBusTimeoutMs;
+        if(bGone && !bLeaderGone)
+        {
+            printer::inst()->print_msg(L1, "Job bus leader is gone. Waiting for it to come back.");
+            minethd::miner_work oWork;
+            minethd::switch_work(oWork);
+            minethd::switch_split_work(oWork, 0);
+        }
+        bLeaderGone = bGone;
+
+        bus_wait(&pShm->iSeq, iSeq, 1000);
+    }
+}
+#pragma GCC reset_options
+
+#else
+
+bool job_bus::start_leader(const char* sName) { return false; }
+bool job_bus::start_follower(const char* sName) { return false; }
+void job_bus::publish(const minethd::miner_work& oWork) {}
+void job_bus::publish_split(const minethd::miner_work& oWork, uint32_t iShare) {}
+size_t job_bus::get_follower_count() { return 0; }
+bool job_bus::push_result(const job_result& oResult, size_t pool_id) { return false; }
+void job_bus::heartbeat() {}
+
+#endif // _WIN32
@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+#include "msgstruct.h"
+#include "minethd.h"
+
+/*
+ * Job bus for running one process per NUMA node on a single host. The leader owns the
+ * pool connections and publishes every work switch into a POSIX shared memory segment,
+ * guarded by a seqlock. Followers don't talk to any pool - they lease a slot, mine the
+ * leader's work with the slot number in the top nonce byte (slot 0 is the leader) and
+ * hand their results back through a single-producer single-consumer ring per slot.
+ * The split work (see minethd::switch_split_work) goes over the bus the same way.
+ *
+ * On Linux both directions sleep on a futex in the shared segment, so a job switch
+ * reaches the followers within microseconds. Elsewhere we fall back to polling.
+ */
+
+class job_bus
+{
+public:
+    static job_bus* inst()
+    {
+        if (oInst == nullptr) oInst = new job_bus;
+        return oInst;
+    };
+
+    static constexpr size_t iMaxFollowers = 15;
+
+    bool start_leader(const char* sName);
+    bool start_follower(const char* sName);
+
+    // Executor thread of the leader
+    void publish(const minethd::miner_work& oWork);
+    void publish_split(const minethd::miner_work& oWork, uint32_t iShare);
+    size_t get_follower_count();
+
+    // Executor thread of a follower, false if the ring is full
+    bool push_result(const job_result& oResult, size_t pool_id);
+    inline size_t get_slot() { return iSlot; }
+
+    // Called on every executor tick, keeps our lease or leadership alive
+    void heartbeat();
+
+private:
+    job_bus() {}
+    static job_bus* oInst;
+
+    struct bus_shm;
+    bus_shm* pShm = nullptr;
+    size_t iSlot = 0;
+    bool bLeader = false;
+
+    bool map_segment(const char* sName, bool bCreate);
+    void write_begin();
+    void write_end();
+    bool take_lease();
+    void leader_thread();
+    void follower_thread();
+};
@@ -0,0 +1,100 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+#include <string.h>
+#include "jobreg.h"
+
+// The block header starts with three varints - major version, minor version and timestamp
+static bool find_prev_hash(const pool_job& oJob, size_t& iOffset)
+{
+    size_t pos = 0;
+    for(size_t field = 0; field < 3; field++)
+    {
+        while(pos < oJob.iWorkLen && (oJob.bWorkBlob[pos] & 0x80) != 0)
+            pos++;
+        pos++;
+    }
+
+    if(pos + 32 > oJob.iWorkLen)
+        return false;
+
+    iOffset = pos;
+    return true;
+}
+
+uint32_t job_registry::intern(size_t pool_id, const pool_job& oJob)
+{
+    job_entry* job = nullptr;
+    for(job_entry& e : vJobs)
+    {
+        if(e.iHandle != invalid_handle && e.iPoolId == pool_id && strcmp(e.sJobID, oJob.sJobID) == 0)
+        {
+            job = &e;
+            break;
+        }
+    }
+
+    if(job == nullptr)
+    {
+        uint32_t iHandle = iNextHandle++;
+        if(iNextHandle == invalid_handle)
+            iNextHandle++;
+
+        job = &vJobs[iHandle & (iHistory - 1)];
+        memcpy(job->sJobID, oJob.sJobID, sizeof(job->sJobID));
+        job->sJobID[sizeof(job->sJobID) - 1] = '\0';
+        job->iPoolId = pool_id;
+        job->iHandle = iHandle;
+        job->tSeen = std::chrono::steady_clock::now();
+
+        size_t iOffset;
+        job->bHavePrev = find_prev_hash(oJob, iOffset);
+        if(job->bHavePrev)
+            memcpy(job->bPrevHash, oJob.bWorkBlob + iOffset, sizeof(job->bPrevHash));
+    }
+
+    // Whatever the pool sent last is its current job
+    job->bSuperseded = false;
+    job->bStale = false;
+
+    for(job_entry& e : vJobs)
+    {
+        if(&e == job || e.iHandle == invalid_handle || e.iPoolId != pool_id)
+            continue;
+
+        e.bSuperseded = true;
+        if(e.bHavePrev && job->bHavePrev && memcmp(e.bPrevHash, job->bPrevHash, sizeof(e.bPrevHash)) != 0)
+            e.bStale = true;
+    }
+
+    return job->iHandle;
+}
+
+const job_registry::job_entry* job_registry::find(uint32_t iHandle) const
+{
+    if(iHandle == invalid_handle)
+        return nullptr;
+
+    const job_entry& e = vJobs[iHandle & (iHistory - 1)];
+    return e.iHandle == iHandle ? &e : nullptr;
+}
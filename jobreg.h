@@ -0,0 +1,44 @@
+#pragma once
+#include <chrono>
+#include <stdint.h>
+
+#include "msgstruct.h"
+
+/*
+ * Every job that reaches the miners is interned here and the miners only carry the small
+ * handle around. A handle stays valid until iHistory newer jobs came in after it.
+ *
+ * A job is superseded once its pool sends a newer one. If the newer job also builds on
+ * a different previous block, shares for the old one can only be rejected, so they are
+ * marked stale. Executor thread only.
+ */
+
+class job_registry
+{
+public:
+    constexpr static uint32_t invalid_handle = 0;
+
+    struct job_entry
+    {
+        char        sJobID[64];
+        size_t      iPoolId;
+        uint32_t    iHandle;
+        std::chrono::steady_clock::time_point tSeen;
+        bool        bSuperseded;
+        bool        bStale;
+        bool        bHavePrev;
+        uint8_t     bPrevHash[32];
+    };
+
+    // Returns the existing handle if the pool sends the same job again
+    uint32_t intern(size_t pool_id, const pool_job& oJob);
+
+    // nullptr once the job dropped out of the history
+    const job_entry* find(uint32_t iHandle) const;
+
+private:
+    constexpr static size_t iHistory = 64; // Power of 2
+
+    job_entry vJobs[iHistory] = {};
+    uint32_t iNextHandle = 1;
+};
@@ -23,15 +23,20 @@
 
 #include <stdarg.h>
 #include <assert.h>
+#include <algorithm>
 
 #include "jpsock.h"
 #include "executor.h"
+#include "flightrec.h"
+#include "probes.h"
 #include "jconf.h"
 
 #include "rapidjson/document.h"
 #include "jext.h"
 #include "socks.h"
 #include "socket.h"
+#include "stratum.h"
+#include "hexcodec.h"
 #include "version.h"
 
 #define AGENTID_STR XMR_STAK_NAME "/" XMR_STAK_VERSION
@@ -65,7 +70,13 @@ typedef GenericDocument<UTF8<>, MemoryPoolAllocator<>, MemoryPoolAllocator<>> Me
  * !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
  *
  * Call values and allocators are for the calling thread (executor). When processing
- * a call, the recv thread will make a copy of the call response and then erase its copy.
+ * a call, the reactor thread will make a copy of the call response and then erase its copy.
+ *
+ * Only login waits for its reply. Submits are pipelined, the reactor thread matches the
+ * replies against oSubmitCalls and hands them to the executor as events.
+ *
+ * The calling thread never touches the socket. Outgoing data goes through sSendQueue,
+ * and disconnect() runs on the reactor thread and waits for it to finish.
  */
 
 struct jpsock::opaque_private
@@ -94,13 +105,16 @@ struct jpsock::opq_json_val
     opq_json_val(const Value* val) : val(val) {}
 };
 
-jpsock::jpsock(size_t id, bool tls) : pool_id(id)
+jpsock::jpsock(size_t id, const char* sAddr, const char* sLogin, const char* sPassword, double pool_weight, bool tls, const char* tls_fp) :
+    pool_id(id), net_addr(sAddr), usr_login(sLogin), usr_pass(sPassword), tls_fp(tls_fp), pool_weight(pool_weight)
 {
     sock_init();
 
     bJsonCallMem = (uint8_t*)malloc(iJsonMemSize);
     bJsonRecvMem = (uint8_t*)malloc(iJsonMemSize);
     bJsonParseMem = (uint8_t*)malloc(iJsonMemSize);
+    bRecvBuf = (char*)malloc(iSockBufferSize);
+    iRecvBufSize = iSockBufferSize;
 
     prv = new opaque_private(bJsonCallMem, bJsonRecvMem, bJsonParseMem);
 
@@ -112,13 +126,23 @@ jpsock::jpsock(size_t id, bool tls) : pool_id(id)
 #else
     sck = new plain_socket(this);
 #endif
+    bTls = sck->is_tls();
 
-    oRecvThd = nullptr;
     bRunning = false;
+    bConnActive = false;
+    bHandshaking = false;
+    sHostname[0] = '\0';
+    iRecvDataLen = 0;
     bLoggedIn = false;
     iJobDiff = 0;
+    iNextCallId = 2;
+    bPoolKeepalive = false;
+    iFullHandshakes = 0;
+    iResumedHandshakes = 0;
+    iHandshakeMs = 0;
 
     memset(&oCurrentJob, 0, sizeof(oCurrentJob));
+    memset(oSubmitCalls, 0, sizeof(oSubmitCalls));
 }
 
 jpsock::~jpsock()
@@ -129,6 +153,7 @@ jpsock::~jpsock()
     free(bJsonCallMem);
     free(bJsonRecvMem);
     free(bJsonParseMem);
+    free(bRecvBuf);
 }
 
 std::string&& jpsock::get_call_error()
@@ -186,9 +211,79 @@ bool jpsock::set_socket_error_strerr(const char* a, int res)
     return set_socket_error(a, sock_gai_strerror(res, sSockErrText, sizeof(sSockErrText)));
 }
 
-void jpsock::jpsock_thread()
+void jpsock::start_connection()
+{
+    bConnActive = true;
+    bHandshaking = true;
+    iRecvDataLen = 0;
+    sWriteBuf.clear();
+    tConnStart = std::chrono::steady_clock::now();
+
+    if(!sck->connect())
+    {
+        end_connection();
+        return;
+    }
+
+    tConnDeadline = tConnStart + std::chrono::seconds(jconf::inst()->GetCallTimeout());
+    sync_watches();
+}
+
+void jpsock::sync_watches()
+{
+    std::vector<SOCKET> fds;
+    sck->get_fds(fds);
+    bool bWrite = !sWriteBuf.empty() || sck->wants_write();
+
+    for(SOCKET fd : vWatchedFds)
+    {
+        if(std::find(fds.begin(), fds.end(), fd) == fds.end())
+            reactor::inst()->unwatch(fd, this);
+    }
+
+    for(SOCKET fd : fds)
+    {
+        if(std::find(vWatchedFds.begin(), vWatchedFds.end(), fd) == vWatchedFds.end())
+            reactor::inst()->watch(fd, this, bWrite);
+        else
+            reactor::inst()->update(fd, this, bWrite);
+    }
+
+    vWatchedFds.swap(fds);
+
+    if(bHandshaking)
+        tDeadline = std::min(tConnDeadline, sck->next_attempt_time());
+    else
+        tDeadline = time_point::max();
+}
+
+void jpsock::release_fd(SOCKET fd)
+{
+    auto it = std::find(vWatchedFds.begin(), vWatchedFds.end(), fd);
+    if(it != vWatchedFds.end())
+    {
+        reactor::inst()->unwatch(fd, this);
+        vWatchedFds.erase(it);
+    }
+}
+
+void jpsock::end_connection()
 {
-    jpsock_thd_main();
+    if(!bConnActive)
+        return;
+
+    bConnActive = false;
+    bHandshaking = false;
+    tDeadline = time_point::max();
+
+    sck->close();
+    for(SOCKET fd : vWatchedFds)
+        reactor::inst()->unwatch(fd, this);
+    vWatchedFds.clear();
+    sWriteBuf.clear();
+    iRecvDataLen = 0;
+
+    fail_submit_calls();
     executor::inst()->push_event(ex_event(std::move(sSocketError), pool_id));
 
     // If a call is wating, send an error to end it
@@ -208,71 +303,185 @@ void jpsock::jpsock_thread()
 
     bRunning = false;
     bLoggedIn = false;
+    bPoolKeepalive = false;
 
-    std::unique_lock<std::mutex>(job_mutex);
+    std::lock_guard<std::mutex> lck(job_mutex);
     memset(&oCurrentJob, 0, sizeof(oCurrentJob));
 }
 
-bool jpsock::jpsock_thd_main()
+void jpsock::on_io(bool bRead, bool bWrite)
 {
-    if(!sck->connect())
-        return false;
+    if(!bConnActive)
+        return;
 
-    snprintf(hostname, sizeof(hostname), "%s", sck->hostname);
+    if(bHandshaking)
+    {
+        int ret = sck->handshake();
+        if(ret < 0)
+            return end_connection();
 
-    executor::inst()->push_event(ex_event(EV_SOCK_READY, pool_id));
+        if(ret == 0)
+            return sync_watches();
 
-    char buf[iSockBufferSize];
-    size_t datalen = 0;
-    while (true)
+        bHandshaking = false;
+        {
+            std::lock_guard<std::mutex> lck(job_mutex);
+            snprintf(sHostname, sizeof(sHostname), "%s", sck->hostname);
+        }
+
+        using namespace std::chrono;
+        iHandshakeMs = (uint32_t)duration_cast<milliseconds>(steady_clock::now() - tConnStart).count();
+        if(sck->is_tls())
+            (sck->is_resumed() ? iResumedHandshakes : iFullHandshakes)++;
+        executor::inst()->push_event(ex_event(EV_SOCK_READY, pool_id));
+    }
+
+    // TLS can have data buffered even if the socket didn't say so, so we always try
+    if(!do_recv() || !do_send())
+        return end_connection();
+
+    sync_watches();
+}
+
+void jpsock::on_timeout()
+{
+    if(std::chrono::steady_clock::now() >= tConnDeadline)
     {
-        int ret = sck->recv(buf + datalen, sizeof(buf) - datalen);
+        set_socket_error("CONNECT error: Timeout while connecting to the pool");
+        return end_connection();
+    }
 
-        if(ret <= 0)
-            return false;
+    // Time for the next address to join the race
+    if(sck->on_attempt_timer() < 0)
+        return end_connection();
 
-        datalen += ret;
+    sync_watches();
+}
 
-        if (datalen >= sizeof(buf))
+bool jpsock::do_recv()
+{
+    while (true)
+    {
+        if (iRecvDataLen == iRecvBufSize)
         {
-            sck->close(false);
-            return set_socket_error("RECEIVE error: data overflow");
+            char* newbuf;
+            if (iRecvBufSize >= iSockBufferMax || (newbuf = (char*)realloc(bRecvBuf, iRecvBufSize * 2)) == nullptr)
+                return set_socket_error("RECEIVE error: data overflow");
+
+            bRecvBuf = newbuf;
+            iRecvBufSize *= 2;
         }
 
+        int ret = sck->recv(bRecvBuf + iRecvDataLen, iRecvBufSize - iRecvDataLen);
+
+        if(ret < 0)
+            return false;
+
+        if(ret == 0)
+            return true;
+
+        iRecvDataLen += ret;
+
         char* lnend;
-        char* lnstart = buf;
-        while ((lnend = (char*)memchr(lnstart, '\n', datalen)) != nullptr)
+        char* lnstart = bRecvBuf;
+        while ((lnend = (char*)memchr(lnstart, '\n', iRecvDataLen)) != nullptr)
         {
             lnend++;
             int lnlen = lnend - lnstart;
 
             if (!process_line(lnstart, lnlen))
-            {
-                sck->close(false);
                 return false;
-            }
 
-            datalen -= lnlen;
+            iRecvDataLen -= lnlen;
             lnstart = lnend;
         }
 
         //Got leftover data? Move it to the front
-        if (datalen > 0 && buf != lnstart)
-            memmove(buf, lnstart, datalen);
+        if (iRecvDataLen > 0 && bRecvBuf != lnstart)
+            memmove(bRecvBuf, lnstart, iRecvDataLen);
     }
 }
 
-bool jpsock::process_line(char* line, size_t len)
+bool jpsock::do_send()
 {
-    prv->jsonDoc.SetNull();
-    prv->parseAllocator.Clear();
-    prv->callAllocator.Clear();
+    std::unique_lock<std::mutex> mlock(send_mutex);
+    if(!sSendQueue.empty())
+    {
+        if(sWriteBuf.empty())
+            sWriteBuf.swap(sSendQueue);
+        else
+            sWriteBuf.append(sSendQueue);
+        sSendQueue.clear();
+    }
+    mlock.unlock();
+
+    size_t pos = 0;
+    while(pos < sWriteBuf.size())
+    {
+        int ret = sck->send(sWriteBuf.data() + pos, sWriteBuf.size() - pos);
+
+        if(ret < 0)
+            return false;
+
+        if(ret == 0)
+            break;
+
+        pos += ret;
+    }
+
+    sWriteBuf.erase(0, pos);
+    return true;
+}
+
+void jpsock::queue_send(const char* sData, size_t iLen)
+{
+    std::unique_lock<std::mutex> mlock(send_mutex);
+    sSendQueue.append(sData, iLen);
+    mlock.unlock();
 
+    reactor::inst()->post([this]() {
+        if(!bConnActive || bHandshaking)
+            return;
+
+        if(!do_send())
+            return end_connection();
+
+        sync_watches();
+    });
+}
+
+void jpsock::close_connection(const char* sError)
+{
+    reactor::inst()->call([this, sError]() {
+        if(!bConnActive)
+            return;
+
+        set_socket_error(sError);
+        end_connection();
+    });
+}
+
+bool jpsock::process_line(char* line, size_t len)
+{
     /*NULL terminate the line instead of '\n', parsing will add some more NULLs*/
     line[len-1] = '\0';
 
     //printf("RECV: %s\n", line);
 
+    stratum_msg msg;
+    if (stratum_fast_parse(line, len-1, msg))
+    {
+        if (msg.type == stratum_msg::msg_job)
+            return process_pool_job(msg.oJobId, msg.oBlob, msg.oTarget, msg.oAlgo);
+        else
+            return process_submit_reply(msg.iCallId, msg.oError.str, msg.oError.len);
+    }
+
+    // Fast path didn't like it, it is either a login reply or something odd
+    prv->jsonDoc.SetNull();
+    prv->parseAllocator.Clear();
+    prv->callAllocator.Clear();
+
     if (prv->jsonDoc.ParseInsitu(line).HasParseError())
         return set_socket_error("PARSE error: Invalid JSON");
 
@@ -330,6 +539,9 @@ bool jpsock::process_line(char* line, size_t len)
             sError = msg->GetString();
         }
 
+        if(iCallId != 1)
+            return process_submit_reply(iCallId, sError, iErrorLn);
+
         std::unique_lock<std::mutex> mlock(call_mutex);
         if (prv->oCallRsp.pCallData == nullptr)
         {
@@ -356,15 +568,87 @@ bool jpsock::process_line(char* line, size_t len)
     }
 }
 
+bool jpsock::process_submit_reply(uint64_t iCallId, const char* sError, size_t iErrorLn)
+{
+    std::unique_lock<std::mutex> mlock(call_mutex);
+
+    size_t i;
+    for(i = 0; i < iMaxSubmitCalls; i++)
+    {
+        if(oSubmitCalls[i].iCallId == iCallId)
+            break;
+    }
+
+    if(i == iMaxSubmitCalls)
+    {
+        /*Server sent us a call reply without us making a call*/
+        mlock.unlock();
+        return set_socket_error("PARSE error: Unexpected call response");
+    }
+
+    if(oSubmitCalls[i].bKeepalive)
+    {
+        oSubmitCalls[i].iCallId = 0;
+        return true;
+    }
+
+    flight_recorder::inst()->record(flight_recorder::ev_submit_acked, trace_call_id(iCallId), sError == nullptr ? 0 : 1);
+
+    using namespace std::chrono;
+    size_t iCallTime = duration_cast<milliseconds>(steady_clock::now() - oSubmitCalls[i].tSent).count();
+    submit_result oResult(oSubmitCalls[i].iActualDiff, oSubmitCalls[i].iProxyTag, (uint32_t)iCallTime);
+    oResult.bReplay = oSubmitCalls[i].bReplay;
+    oSubmitCalls[i].iCallId = 0;
+    mlock.unlock();
+
+    if(sError != nullptr)
+    {
+        if(iErrorLn == 0)
+            oResult.sError.assign("[EMPTY ERROR]");
+        else
+            oResult.sError.assign(sError, iErrorLn);
+    }
+
+    executor::inst()->push_event(ex_event(std::move(oResult), pool_id));
+    return true;
+}
+
+void jpsock::fail_submit_calls()
+{
+    std::unique_lock<std::mutex> mlock(call_mutex);
+    for(size_t i = 0; i < iMaxSubmitCalls; i++)
+    {
+        if(oSubmitCalls[i].iCallId == 0)
+            continue;
+
+        if(oSubmitCalls[i].bKeepalive)
+        {
+            oSubmitCalls[i].iCallId = 0;
+            continue;
+        }
+
+        flight_recorder::inst()->record(flight_recorder::ev_submit_acked, trace_call_id(oSubmitCalls[i].iCallId), 2);
+
+        submit_result oResult(oSubmitCalls[i].iActualDiff, oSubmitCalls[i].iProxyTag, 0);
+        oResult.bNetError = true;
+        oResult.bReplay = oSubmitCalls[i].bReplay;
+        oResult.sError.assign("[NETWORK ERROR]");
+        oSubmitCalls[i].iCallId = 0;
+
+        executor::inst()->push_event(ex_event(std::move(oResult), pool_id));
+    }
+}
+
 bool jpsock::process_pool_job(const opq_json_val* params)
 {
     if (!params->val->IsObject())
         return set_socket_error("PARSE error: Job error 1");
 
-    const Value * blob, *jobid, *target;
+    const Value * blob, *jobid, *target, *algo;
     jobid = GetObjectMember(*params->val, "job_id");
     blob = GetObjectMember(*params->val, "blob");
     target = GetObjectMember(*params->val, "target");
+    algo = GetObjectMember(*params->val, "algo");
 
     if (jobid == nullptr || blob == nullptr || target == nullptr ||
         !jobid->IsString() || !blob->IsString() || !target->IsString())
@@ -372,27 +656,50 @@ bool jpsock::process_pool_job(const opq_json_val* params)
         return set_socket_error("PARSE error: Job error 2");
     }
 
-    if (jobid->GetStringLength() >= sizeof(pool_job::sJobID)) // Note >=
+    stratum_str sjobid = { jobid->GetString(), jobid->GetStringLength() };
+    stratum_str sblob = { blob->GetString(), blob->GetStringLength() };
+    stratum_str starget = { target->GetString(), target->GetStringLength() };
+    stratum_str salgo = { nullptr, 0 };
+    if (algo != nullptr && algo->IsString())
+        salgo = { algo->GetString(), algo->GetStringLength() };
+    return process_pool_job(sjobid, sblob, starget, salgo);
+}
+
+// What we tell the pool at login, and what we accept in a job
+static const char* sAlgoList = "[\"cn/0\",\"cryptonight\"]";
+
+static bool is_our_algo(const stratum_str& algo)
+{
+    return (algo.len == 4 && memcmp(algo.str, "cn/0", 4) == 0) ||
+        (algo.len == 11 && memcmp(algo.str, "cryptonight", 11) == 0);
+}
+
+bool jpsock::process_pool_job(const stratum_str& jobid, const stratum_str& blob, const stratum_str& target, const stratum_str& algo)
+{
+    if (jobid.len >= sizeof(pool_job::sJobID)) // Note >=
         return set_socket_error("PARSE error: Job error 3");
 
-    uint32_t iWorkLn = blob->GetStringLength() / 2;
+    if (algo.str != nullptr && !is_our_algo(algo))
+        return set_socket_error("PARSE error: The pool sent a job for another algorithm: ", std::string(algo.str, algo.len).c_str());
+
+    uint32_t iWorkLn = blob.len / 2;
     if (iWorkLn > sizeof(pool_job::bWorkBlob))
         return set_socket_error("PARSE error: Invalid job legth. Are you sure you are mining the correct coin?");
 
     pool_job oPoolJob;
-    if (!hex2bin(blob->GetString(), iWorkLn * 2, oPoolJob.bWorkBlob))
+    if (!hex2bin(blob.str, iWorkLn * 2, oPoolJob.bWorkBlob))
         return set_socket_error("PARSE error: Job error 4");
 
     oPoolJob.iWorkLen = iWorkLn;
     memset(oPoolJob.sJobID, 0, sizeof(pool_job::sJobID));
-    memcpy(oPoolJob.sJobID, jobid->GetString(), jobid->GetStringLength()); //Bounds checking at proto error 3
+    memcpy(oPoolJob.sJobID, jobid.str, jobid.len); //Bounds checking at proto error 3
 
-    size_t target_slen = target->GetStringLength();
+    size_t target_slen = target.len;
     if(target_slen <= 8)
     {
         uint32_t iTempInt = 0;
         char sTempStr[] = "00000000"; // Little-endian CPU FTW
-        memcpy(sTempStr, target->GetString(), target_slen);
+        memcpy(sTempStr, target.str, target_slen);
         if(!hex2bin(sTempStr, 8, (unsigned char*)&iTempInt) || iTempInt == 0)
             return set_socket_error("PARSE error: Invalid target");
 
@@ -402,7 +709,7 @@ bool jpsock::process_pool_job(const opq_json_val* params)
     {
         oPoolJob.iTarget = 0;
         char sTempStr[] = "0000000000000000";
-        memcpy(sTempStr, target->GetString(), target_slen);
+        memcpy(sTempStr, target.str, target_slen);
         if(!hex2bin(sTempStr, 16, (unsigned char*)&oPoolJob.iTarget) || oPoolJob.iTarget == 0)
             return set_socket_error("PARSE error: Invalid target");
     }
@@ -411,23 +718,40 @@ bool jpsock::process_pool_job(const opq_json_val* params)
 
     iJobDiff = t64_to_diff(oPoolJob.iTarget);
 
-    executor::inst()->push_event(ex_event(oPoolJob, pool_id));
-
-    std::unique_lock<std::mutex>(job_mutex);
+    // Stored before the executor hears about it, so that a failover always finds the latest job
+    std::unique_lock<std::mutex> lck(job_mutex);
     oCurrentJob = oPoolJob;
+    lck.unlock();
+
+    flight_recorder::inst()->record(flight_recorder::ev_pool_job, pool_id);
+    CG_PROBE2(pool_job, pool_id, (uint64_t)iJobDiff);
+    executor::inst()->push_event(ex_event(oPoolJob, pool_id));
     return true;
 }
 
-bool jpsock::connect(const char* sAddr, std::string& sConnectError)
+bool jpsock::connect(std::string& sConnectError)
 {
+    if(bRunning)
+    {
+        sConnectError = "CONNECT error: Already connected";
+        return false;
+    }
+
     bHaveSocketError = false;
     sSocketError.clear();
+    sSubmitBuf.clear();
     iJobDiff = 0;
 
-    if(sck->set_hostname(sAddr))
+    // Anything left over from the last connection is never going to get a reply
+    fail_submit_calls();
+    std::unique_lock<std::mutex> mlock(send_mutex);
+    sSendQueue.clear();
+    mlock.unlock();
+
+    if(sck->set_hostname(net_addr.c_str()))
     {
         bRunning = true;
-        oRecvThd = new std::thread(&jpsock::jpsock_thread, this);
+        reactor::inst()->post([this]() { start_connection(); });
         return true;
     }
 
@@ -437,16 +761,7 @@ bool jpsock::connect(const char* sAddr, std::string& sConnectError)
 
 void jpsock::disconnect()
 {
-    sck->close(false);
-
-    if(oRecvThd != nullptr)
-    {
-        oRecvThd->join();
-        delete oRecvThd;
-        oRecvThd = nullptr;
-    }
-
-    sck->close(true);
+    close_connection("RECEIVE error: socket closed");
 }
 
 bool jpsock::cmd_ret_wait(const char* sPacket, opq_json_val& poResult)
@@ -461,11 +776,7 @@ bool jpsock::cmd_ret_wait(const char* sPacket, opq_json_val& poResult)
     prv->oCallRsp = call_rsp(&prv->oCallValue);
     mlock.unlock();
 
-    if(!sck->send(sPacket))
-    {
-        disconnect(); //This will join the other thread;
-        return false;
-    }
+    queue_send(sPacket, strlen(sPacket));
 
     //Success is true if the server approves, result is true if there was no socket error
     bool bSuccess;
@@ -483,8 +794,7 @@ bool jpsock::cmd_ret_wait(const char* sPacket, opq_json_val& poResult)
     //This means that there was no socket error, but the server is not taking to us
     if(!bResult)
     {
-        set_socket_error("CALL error: Timeout while waiting for a reply");
-        disconnect();
+        close_connection("CALL error: Timeout while waiting for a reply");
         return false;
     }
 
@@ -494,12 +804,29 @@ bool jpsock::cmd_ret_wait(const char* sPacket, opq_json_val& poResult)
     return bSuccess;
 }
 
-bool jpsock::cmd_login(const char* sLogin, const char* sPassword)
+/* iAutoDiff is the difficulty the executor worked out from our hashrate, zero if it doesn't know it yet.
+   A fixed_difficulty from the config wins over it. */
+bool jpsock::cmd_login(uint64_t iAutoDiff)
 {
     char cmd_buffer[1024];
+    char sDiff[32] = "";
+    char sRigId[64] = "";
+
+    // The dev pool gets a plain login
+    if(pool_id != executor::dev_pool_id)
+    {
+        uint64_t iDiff = jconf::inst()->GetFixedDiff();
+        if(iDiff == 0)
+            iDiff = iAutoDiff;
+        if(iDiff != 0 && usr_login.find('+') == std::string::npos)
+            snprintf(sDiff, sizeof(sDiff), "+%llu", (long long unsigned int)iDiff);
+
+        if(jconf::inst()->GetRigId()[0] != '\0')
+            snprintf(sRigId, sizeof(sRigId), ",\"rigid\":\"%s\"", jconf::inst()->GetRigId());
+    }
 
-    snprintf(cmd_buffer, sizeof(cmd_buffer), "{\"method\":\"login\",\"params\":{\"login\":\"%s\",\"pass\":\"%s\",\"agent\":\"" AGENTID_STR "\"},\"id\":1}\n",
-        sLogin, sPassword);
+    snprintf(cmd_buffer, sizeof(cmd_buffer), "{\"method\":\"login\",\"params\":{\"login\":\"%s%s\",\"pass\":\"%s\"%s,\"agent\":\"" AGENTID_STR "\",\"algo\":%s},\"id\":1}\n",
+        usr_login.c_str(), sDiff, usr_pass.c_str(), sRigId, sAlgoList);
 
     opq_json_val oResult(nullptr);
 
@@ -509,31 +836,39 @@ bool jpsock::cmd_login(const char* sLogin, const char* sPassword)
 
     if (!oResult.val->IsObject())
     {
-        set_socket_error("PARSE error: Login protocol error 1");
-        disconnect();
+        close_connection("PARSE error: Login protocol error 1");
         return false;
     }
 
     const Value* id = GetObjectMember(*oResult.val, "id");
     const Value* job = GetObjectMember(*oResult.val, "job");
+    const Value* ext = GetObjectMember(*oResult.val, "extensions");
 
     if (id == nullptr || job == nullptr || !id->IsString())
     {
-        set_socket_error("PARSE error: Login protocol error 2");
-        disconnect();
+        close_connection("PARSE error: Login protocol error 2");
         return false;
     }
 
     if (id->GetStringLength() >= sizeof(sMinerId))
     {
-        set_socket_error("PARSE error: Login protocol error 3");
-        disconnect();
+        close_connection("PARSE error: Login protocol error 3");
         return false;
     }
 
     memset(sMinerId, 0, sizeof(sMinerId));
     memcpy(sMinerId, id->GetString(), id->GetStringLength());
 
+    bPoolKeepalive = false;
+    if(ext != nullptr && ext->IsArray())
+    {
+        for(const Value& e : ext->GetArray())
+        {
+            if(e.IsString() && strcmp(e.GetString(), "keepalive") == 0)
+                bPoolKeepalive = true;
+        }
+    }
+
     opq_json_val v(job);
     if(!process_pool_job(&v))
     {
@@ -541,33 +876,138 @@ bool jpsock::cmd_login(const char* sLogin, const char* sPassword)
         return false;
     }
 
+    tLastSend = std::chrono::steady_clock::now();
     bLoggedIn = true;
 
     return true;
 }
 
-bool jpsock::cmd_submit(const char* sJobId, uint32_t iNonce, const uint8_t* bResult)
+// Caller holds call_mutex, iMaxSubmitCalls means we are full
+size_t jpsock::alloc_call_slot()
+{
+    size_t i;
+    for(i = 0; i < iMaxSubmitCalls; i++)
+    {
+        if(oSubmitCalls[i].iCallId == 0)
+            break;
+    }
+    return i;
+}
+
+bool jpsock::cmd_submit(const char* sJobId, uint32_t iNonce, const uint8_t* bResult, uint64_t iActualDiff, uint64_t iProxyTag, bool bReplay)
 {
     char cmd_buffer[1024];
     char sNonce[9];
     char sResult[65];
 
+    std::unique_lock<std::mutex> mlock(call_mutex);
+    size_t i = alloc_call_slot();
+
+    //Too many calls in flight, the pool is most likely not talking to us anymore
+    if(i == iMaxSubmitCalls)
+        return false;
+
+    uint64_t iCallId = iNextCallId++;
+    oSubmitCalls[i].iCallId = iCallId;
+    oSubmitCalls[i].iActualDiff = iActualDiff;
+    oSubmitCalls[i].iProxyTag = iProxyTag;
+    oSubmitCalls[i].tSent = std::chrono::steady_clock::now();
+    oSubmitCalls[i].bKeepalive = false;
+    oSubmitCalls[i].bReplay = bReplay;
+    mlock.unlock();
+
+    flight_recorder::inst()->record(flight_recorder::ev_submit_sent, trace_call_id(iCallId));
+
     bin2hex((unsigned char*)&iNonce, 4, sNonce);
     sNonce[8] = '\0';
 
     bin2hex(bResult, 32, sResult);
     sResult[64] = '\0';
 
-    snprintf(cmd_buffer, sizeof(cmd_buffer), "{\"method\":\"submit\",\"params\":{\"id\":\"%s\",\"job_id\":\"%s\",\"nonce\":\"%s\",\"result\":\"%s\"},\"id\":1}\n",
-        sMinerId, sJobId, sNonce, sResult);
+    snprintf(cmd_buffer, sizeof(cmd_buffer), "{\"method\":\"submit\",\"params\":{\"id\":\"%s\",\"job_id\":\"%s\",\"nonce\":\"%s\",\"result\":\"%s\"},\"id\":%llu}\n",
+        sMinerId, sJobId, sNonce, sResult, (long long unsigned int)iCallId);
 
-    opq_json_val oResult(nullptr);
-    return cmd_ret_wait(cmd_buffer, oResult);
+    sSubmitBuf.append(cmd_buffer);
+    return true;
+}
+
+bool jpsock::cmd_flush()
+{
+    if(sSubmitBuf.empty())
+        return true;
+
+    //printf("SEND: %s\n", sSubmitBuf.c_str());
+
+    queue_send(sSubmitBuf.data(), sSubmitBuf.size());
+    sSubmitBuf.clear();
+    tLastSend = std::chrono::steady_clock::now();
+    return true;
+}
+
+/* Pools that advertise the keepalive extension get a keepalived call once the line has been
+   quiet for keepalive_interval. Its reply goes through the submit table, so a pool that stopped
+   talking to us is caught by check_call_timeout like with any submit. */
+void jpsock::check_keepalive()
+{
+    uint64_t iInterval = jconf::inst()->GetKeepaliveTime();
+    if(iInterval == 0 || !bPoolKeepalive || !bRunning || !bLoggedIn)
+        return;
+
+    using namespace std::chrono;
+    steady_clock::time_point tNow = steady_clock::now();
+    if(tNow - tLastSend < seconds(iInterval))
+        return;
+
+    std::unique_lock<std::mutex> mlock(call_mutex);
+    size_t i = alloc_call_slot();
+    if(i == iMaxSubmitCalls)
+        return;
+
+    uint64_t iCallId = iNextCallId++;
+    oSubmitCalls[i].iCallId = iCallId;
+    oSubmitCalls[i].iActualDiff = 0;
+    oSubmitCalls[i].iProxyTag = 0;
+    oSubmitCalls[i].tSent = tNow;
+    oSubmitCalls[i].bKeepalive = true;
+    oSubmitCalls[i].bReplay = false;
+    mlock.unlock();
+
+    char cmd_buffer[256];
+    snprintf(cmd_buffer, sizeof(cmd_buffer), "{\"method\":\"keepalived\",\"params\":{\"id\":\"%s\"},\"id\":%llu}\n",
+        sMinerId, (long long unsigned int)iCallId);
+
+    sSubmitBuf.append(cmd_buffer);
+    cmd_flush();
+}
+
+void jpsock::check_call_timeout()
+{
+    if(!bRunning)
+        return;
+
+    using namespace std::chrono;
+    steady_clock::time_point tLimit = steady_clock::now() - seconds(jconf::inst()->GetCallTimeout());
+    bool bTimeout = false;
+
+    std::unique_lock<std::mutex> mlock(call_mutex);
+    for(size_t i = 0; i < iMaxSubmitCalls; i++)
+    {
+        if(oSubmitCalls[i].iCallId != 0 && oSubmitCalls[i].tSent < tLimit)
+        {
+            bTimeout = true;
+            break;
+        }
+    }
+    mlock.unlock();
+
+    //This means that there was no socket error, but the server is not taking to us
+    if(bTimeout)
+        close_connection("CALL error: Timeout while waiting for a reply");
 }
 
 bool jpsock::get_current_job(pool_job& job)
 {
-    std::unique_lock<std::mutex>(job_mutex);
+    std::lock_guard<std::mutex> lck(job_mutex);
 
     if(oCurrentJob.iWorkLen == 0)
         return false;
@@ -577,43 +1017,27 @@ bool jpsock::get_current_job(pool_job& job)
     return true;
 }
 
-inline unsigned char hf_hex2bin(char c, bool &err)
+bool jpsock::have_current_job()
 {
-    if (c >= '0' && c <= '9')
-        return c - '0';
-    else if (c >= 'a' && c <= 'f')
-        return c - 'a' + 0xA;
-    else if (c >= 'A' && c <= 'F')
-        return c - 'A' + 0xA;
-
-    err = true;
-    return 0;
+    std::lock_guard<std::mutex> lck(job_mutex);
+    return oCurrentJob.iWorkLen != 0;
 }
 
-bool jpsock::hex2bin(const char* in, unsigned int len, unsigned char* out)
+std::string jpsock::get_hostname()
 {
-    bool error = false;
-    for (unsigned int i = 0; i < len; i += 2)
-    {
-        out[i / 2] = (hf_hex2bin(in[i], error) << 4) | hf_hex2bin(in[i + 1], error);
-        if (error) return false;
-    }
-    return true;
+    std::lock_guard<std::mutex> lck(job_mutex);
+    return sHostname;
 }
 
-inline char hf_bin2hex(unsigned char c)
+static const hex2bin_fun hex2bin_impl = hex2bin_selector();
+static const bin2hex_fun bin2hex_impl = bin2hex_selector();
+
+bool jpsock::hex2bin(const char* in, unsigned int len, unsigned char* out)
 {
-    if (c <= 0x9)
-        return '0' + c;
-    else
-        return 'a' - 0xA + c;
+    return hex2bin_impl(in, len, out);
 }
 
 void jpsock::bin2hex(const unsigned char* in, unsigned int len, char* out)
 {
-    for (unsigned int i = 0; i < len; i++)
-    {
-        out[i * 2] = hf_bin2hex((in[i] & 0xF0) >> 4);
-        out[i * 2 + 1] = hf_bin2hex(in[i] & 0x0F);
-    }
+    bin2hex_impl(in, len, out);
 }
@@ -3,9 +3,12 @@
 #include <atomic>
 #include <condition_variable>
 #include <thread>
+#include <chrono>
 #include <string>
+#include <vector>
 
 #include "msgstruct.h"
+#include "reactor.h"
 
 /* Our pool can have two kinds of errors:
     - Parsing or connection error
@@ -18,23 +21,35 @@
     outdated, or we somehow got the hash wrong. It isn't fatal.
     We parse it in-situ in the network buffer, after that we copy it to a
     std::string. Executor will move the buffer via an r-value ref.
+
+   The socket itself is driven by the reactor thread. Every connection that got
+   as far as connect() returning true ends with exactly one EV_SOCK_ERROR.
 */
 class base_socket;
+struct stratum_str;
 
-class jpsock
+class jpsock : public reactor_handler
 {
 public:
     size_t pool_id;
-    char hostname[120];
 
-    jpsock(size_t id, bool tls);
+    jpsock(size_t id, const char* sAddr, const char* sLogin, const char* sPassword, double pool_weight, bool tls, const char* tls_fp);
     ~jpsock();
 
-    bool connect(const char* sAddr, std::string& sConnectError);
+    bool connect(std::string& sConnectError);
     void disconnect();
 
-    bool cmd_login(const char* sLogin, const char* sPassword);
-    bool cmd_submit(const char* sJobId, uint32_t iNonce, const uint8_t* bResult);
+    void on_io(bool bRead, bool bWrite);
+    void on_timeout();
+
+    // Called by the socket before it closes one of its file descriptors
+    void release_fd(SOCKET fd);
+
+    bool cmd_login(uint64_t iAutoDiff);
+    bool cmd_submit(const char* sJobId, uint32_t iNonce, const uint8_t* bResult, uint64_t iActualDiff, uint64_t iProxyTag, bool bReplay = false);
+    bool cmd_flush();
+    void check_call_timeout();
+    void check_keepalive();
 
     static bool hex2bin(const char* in, unsigned int len, unsigned char* out);
     static void bin2hex(const unsigned char* in, unsigned int len, char* out);
@@ -43,15 +58,30 @@ public:
     inline bool is_logged_in() { return bLoggedIn; }
 
     std::string&& get_call_error();
+    inline bool have_queued_submits() { return !sSubmitBuf.empty(); }
     bool have_sock_error() { return bHaveSocketError; }
 
     inline static uint64_t t32_to_t64(uint32_t t) { return 0xFFFFFFFFFFFFFFFFULL / (0xFFFFFFFFULL / ((uint64_t)t)); }
-    inline static uint64_t t64_to_diff(uint64_t t) { return 0xFFFFFFFFFFFFFFFFULL / t; }
+    // A zero hash can come from a proxy worker, it is as good as it gets
+    inline static uint64_t t64_to_diff(uint64_t t) { return t != 0 ? 0xFFFFFFFFFFFFFFFFULL / t : 0xFFFFFFFFFFFFFFFFULL; }
     inline static uint64_t diff_to_t64(uint64_t d) { return 0xFFFFFFFFFFFFFFFFULL / d; }
 
     inline uint64_t get_current_diff() { return iJobDiff; }
 
+    inline bool is_tls() { return bTls; }
+    inline size_t get_full_handshakes() { return iFullHandshakes; }
+    inline size_t get_resumed_handshakes() { return iResumedHandshakes; }
+    // Connect plus TLS handshake of the last successful connection
+    inline uint32_t get_handshake_time() { return iHandshakeMs; }
+
     bool get_current_job(pool_job& job);
+    bool have_current_job();
+    // Address we ended up connected to, the reactor writes it on every connect
+    std::string get_hostname();
+
+    inline const char* get_pool_addr() { return net_addr.c_str(); }
+    inline const char* get_tls_fp() { return tls_fp.c_str(); }
+    inline double get_pool_weight() { return pool_weight; }
 
     bool set_socket_error(const char* a);
     bool set_socket_error(const char* a, const char* b);
@@ -63,37 +93,99 @@ private:
     uint8_t* bJsonRecvMem;
     uint8_t* bJsonParseMem;
     uint8_t* bJsonCallMem;
+    char* bRecvBuf;
+    size_t iRecvBufSize;
     std::mutex call_mutex;
 
-    std::thread* oRecvThd;
     std::atomic<uint64_t> iJobDiff;
     std::atomic<bool> bHaveSocketError;
     std::atomic<bool> bRunning;
     std::atomic<bool> bLoggedIn;
+    bool bTls;
+
+    std::atomic<size_t> iFullHandshakes;
+    std::atomic<size_t> iResumedHandshakes;
+    std::atomic<uint32_t> iHandshakeMs;
     std::mutex job_mutex;
 
     pool_job oCurrentJob;
+    char sHostname[120];
 
     std::condition_variable call_cond;
 
     std::string sSocketError;
     char sMinerId[64];
 
+    const std::string net_addr;
+    const std::string usr_login;
+    const std::string usr_pass;
+    const std::string tls_fp;
+    const double pool_weight;
+
+    /* Submits are pipelined - each one gets its own JSON-RPC id and a slot
+       in this table until the pool replies. Id 1 is reserved for login. */
+    struct submit_call
+    {
+        uint64_t iCallId;
+        uint64_t iActualDiff;
+        uint64_t iProxyTag;
+        std::chrono::steady_clock::time_point tSent;
+        bool bKeepalive; // Nobody waits for the reply, it only has to come
+        bool bReplay;
+    };
+
+    // Sized for a proxy with a full house of workers, a lone miner never gets near it
+    static constexpr size_t iMaxSubmitCalls = 256;
+    submit_call oSubmitCalls[iMaxSubmitCalls];
+    uint64_t iNextCallId;
+
+    // Back-to-back submits are coalesced here until cmd_flush
+    std::string sSubmitBuf;
+    std::chrono::steady_clock::time_point tLastSend;
+    std::atomic<bool> bPoolKeepalive;
+
+    // Written by the calling thread, picked up by the reactor
+    std::mutex send_mutex;
+    std::string sSendQueue;
+
+    // Reactor thread only
+    bool bConnActive;
+    bool bHandshaking;
+    std::chrono::steady_clock::time_point tConnStart;
+    std::chrono::steady_clock::time_point tConnDeadline;
+    std::vector<SOCKET> vWatchedFds;
+    std::string sWriteBuf;
+    size_t iRecvDataLen;
+
     struct opaque_private;
     opaque_private* prv;
     base_socket* sck;
 
     static constexpr size_t iJsonMemSize = 4096;
+    // The receive buffer starts small and doubles if a line doesn't fit
     static constexpr size_t iSockBufferSize = 4096;
+    static constexpr size_t iSockBufferMax = 256 * 1024;
 
     struct call_rsp;
     struct opq_json_val;
 
-    void jpsock_thread();
-    bool jpsock_thd_main();
+    void start_connection();
+    void sync_watches();
+    void end_connection();
+    void close_connection(const char* sError);
+    void queue_send(const char* sData, size_t iLen);
+    bool do_recv();
+    bool do_send();
     bool process_line(char* line, size_t len);
     bool process_pool_job(const opq_json_val* params);
+    bool process_pool_job(const stratum_str& jobid, const stratum_str& blob, const stratum_str& target, const stratum_str& algo);
     bool cmd_ret_wait(const char* sPacket, opq_json_val& poResult);
+    bool process_submit_reply(uint64_t iCallId, const char* sError, size_t iErrorLn);
+    size_t alloc_call_slot();
+    void fail_submit_calls();
+
+    // Call ids are only unique per pool
+    inline uint64_t trace_call_id(uint64_t iCallId) { return uint64_t(pool_id) << 32 | (iCallId & 0xFFFFFFFF); }
 
 };
 
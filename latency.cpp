@@ -0,0 +1,132 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+#include "latency.h"
+
+size_t latency_hist::bucket_of(uint32_t iMs)
+{
+    if(iMs > 0xFFFF)
+        iMs = 0xFFFF;
+
+    if(iMs < iExact)
+        return iMs;
+
+    size_t e = 5; // Highest set bit, 5 to 15
+    while((iMs >> (e + 1)) != 0)
+        e++;
+
+    size_t sub = (iMs >> (e - 4)) & (iSubBuckets - 1);
+    return iExact + (e - 5) * iSubBuckets + sub;
+}
+
+uint32_t latency_hist::bucket_top(size_t idx)
+{
+    if(idx < iExact)
+        return idx;
+
+    size_t e = (idx - iExact) / iSubBuckets + 5;
+    size_t sub = (idx - iExact) % iSubBuckets;
+    return ((iSubBuckets + sub + 1) << (e - 4)) - 1;
+}
+
+void latency_hist::add(uint32_t iMs)
+{
+    vBuckets[bucket_of(iMs)]++;
+    iCount++;
+    iSum += iMs;
+    if(iMs > iMax)
+        iMax = iMs;
+}
+
+void latency_hist::add(const latency_hist& o)
+{
+    for(size_t i=0; i < iBuckets; i++)
+        vBuckets[i] += o.vBuckets[i];
+    iCount += o.iCount;
+    iSum += o.iSum;
+    if(o.iMax > iMax)
+        iMax = o.iMax;
+}
+
+void latency_hist::add_bucket(size_t idx, uint32_t iNum)
+{
+    if(iNum == 0)
+        return;
+
+    uint32_t iTop = bucket_top(idx);
+    vBuckets[idx] += iNum;
+    iCount += iNum;
+    iSum += uint64_t(iTop) * iNum;
+    if(iTop > iMax)
+        iMax = iTop;
+}
+
+void latency_hist::clear()
+{
+    vBuckets.fill(0);
+    iCount = 0;
+    iSum = 0;
+    iMax = 0;
+}
+
+uint32_t latency_hist::quantile(double q) const
+{
+    if(iCount == 0)
+        return 0;
+
+    uint64_t iRank = (uint64_t)(q * (iCount - 1)) + 1;
+    uint64_t iSeen = 0;
+    for(size_t i=0; i < iBuckets; i++)
+    {
+        iSeen += vBuckets[i];
+        if(iSeen >= iRank)
+            return bucket_top(i) < iMax ? bucket_top(i) : iMax;
+    }
+    return iMax;
+}
+
+void latency_window::add(uint32_t iMs, uint64_t iNowMs)
+{
+    uint64_t iMinute = iNowMs / 60000;
+    size_t idx = iMinute % iMinutes;
+
+    if(vSlotMinute[idx] != iMinute)
+    {
+        vSlots[idx].clear();
+        vSlotMinute[idx] = iMinute;
+    }
+
+    vSlots[idx].add(iMs);
+}
+
+void latency_window::get(latency_hist& out, uint64_t iNowMs) const
+{
+    uint64_t iMinute = iNowMs / 60000;
+
+    out.clear();
+    for(size_t i=0; i < iMinutes; i++)
+    {
+        if(vSlotMinute[i] + iMinutes > iMinute)
+            out.add(vSlots[i]);
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <array>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fixed size latency histogram. Values are in ms and clamped to 65535. Below 32 ms every
+ * value has its own bucket, above that each power of two is split into 16 buckets, so a
+ * quantile is off by at most 1/16 of its value. The max is kept exactly.
+ *
+ * The buckets can also be kept elsewhere, in any unit, and merged in with add_bucket.
+ */
+class latency_hist
+{
+public:
+    constexpr static size_t iExact = 32;
+    constexpr static size_t iSubBuckets = 16;
+    constexpr static size_t iBuckets = iExact + (16 - 5) * iSubBuckets;
+
+    static size_t bucket_of(uint32_t iMs);
+    static uint32_t bucket_top(size_t idx);
+
+    void add(uint32_t iMs);
+    void add(const latency_hist& o);
+    // The max and the sum go by the bucket's upper edge
+    void add_bucket(size_t idx, uint32_t iNum);
+    void clear();
+
+    inline uint64_t count() const { return iCount; }
+    inline uint32_t max() const { return iMax; }
+    inline uint64_t sum() const { return iSum; }
+
+    // Upper edge of the bucket holding the q-th value, 0 if empty
+    uint32_t quantile(double q) const;
+
+private:
+    std::array<uint32_t, iBuckets> vBuckets { { } };
+    uint64_t iCount = 0;
+    uint64_t iSum = 0;
+    uint32_t iMax = 0;
+};
+
+/*
+ * Rolling window made of one histogram per minute. A query merges the slots that are
+ * still inside the window, the rest are cleared as the minutes go by.
+ */
+class latency_window
+{
+public:
+    constexpr static size_t iMinutes = 15;
+
+    void add(uint32_t iMs, uint64_t iNowMs);
+    void get(latency_hist& out, uint64_t iNowMs) const;
+
+private:
+    std::array<latency_hist, iMinutes> vSlots;
+    std::array<uint64_t, iMinutes> vSlotMinute { { } };
+};
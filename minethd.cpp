@@ -27,6 +27,7 @@
 #include <cstring>
 #include <thread>
 #include <bitset>
+#include <algorithm>
 #include "console.h"
 
 #ifdef _WIN32
@@ -74,80 +75,148 @@ void thd_setaffinity(std::thread::native_handle_type h, uint64_t cpu_id)
 #include "jconf.h"
 #include "crypto/cryptonight_aesni.h"
 #include "hwlocMemory.hpp"
+#include "flightrec.h"
+#include "probes.h"
 
+uint64_t tsc_clock::iBaseTsc = 0;
+uint64_t tsc_clock::iBaseMs = 0;
+double tsc_clock::fMsPerTick = 0.0;
+
+void tsc_clock::calibrate()
+{
+    int32_t info[4];
+    jconf::cpuid(0x80000000, 0, info);
+    if((uint32_t)info[0] < 0x80000007)
+        return;
+
+    // Invariant TSC, it ticks at the same rate in every power state and on every core
+    jconf::cpuid(0x80000007, 0, info);
+    if((info[3] & (1 << 8)) == 0)
+        return;
+
+    using namespace std::chrono;
+    steady_clock::time_point tStart = steady_clock::now();
+    uint64_t iTscStart = __rdtsc();
+    std::this_thread::sleep_for(milliseconds(50));
+    steady_clock::time_point tEnd = steady_clock::now();
+    uint64_t iTscEnd = __rdtsc();
+
+    if(iTscEnd <= iTscStart)
+        return;
+
+    iBaseTsc = iTscEnd;
+    iBaseMs = duration_cast<milliseconds>(tEnd.time_since_epoch()).count();
+    fMsPerTick = duration_cast<nanoseconds>(tEnd - tStart).count() / 1000000.0 / (iTscEnd - iTscStart);
+}
+
+const telemetry::level telemetry::vLevels[telemetry::iLevelCount] = {
+    { 1000, 128, 0 },       // 2 minutes
+    { 60000, 128, 128 },    // 2 hours
+    { 3600000, 32, 256 },   // A day and then some
+};
+
+/* The telemetry belongs to the executor, it is the only thread that touches it. Each
+   thread's rings are cache line aligned so that they never share a line. */
 telemetry::telemetry(size_t iThd)
 {
-    ppHashCounts = new uint64_t*[iThd];
-    ppTimestamps = new uint64_t*[iThd];
-    iBucketTop = new uint32_t[iThd];
+    pThreads = (thread_data*)_mm_malloc(sizeof(thread_data) * iThd, 64);
+    memset(pThreads, 0, sizeof(thread_data) * iThd);
 
     for (size_t i = 0; i < iThd; i++)
     {
-        ppHashCounts[i] = new uint64_t[iBucketSize];
-        ppTimestamps[i] = new uint64_t[iBucketSize];
-        iBucketTop[i] = 0;
-        memset(ppHashCounts[0], 0, sizeof(uint64_t) * iBucketSize);
-        memset(ppTimestamps[0], 0, sizeof(uint64_t) * iBucketSize);
+        for (size_t lvl = 0; lvl < iLevelCount; lvl++)
+            pThreads[i].vBucket[lvl] = UINT64_MAX;
     }
 }
 
-double telemetry::calc_telemetry_data(size_t iLastMilisec, size_t iThread)
+void telemetry::push_perf_value(size_t iThd, uint64_t iHashCount, uint64_t iTimestamp)
 {
-    using namespace std::chrono;
-    uint64_t iTimeNow = time_point_cast<milliseconds>(high_resolution_clock::now()).time_since_epoch().count();
+    // Zero means the thread didn't store anything yet
+    if (iTimestamp == 0)
+        return;
 
-    uint64_t iEarliestHashCnt = 0;
-    uint64_t iEarliestStamp = 0;
-    uint64_t iLastestStamp = 0;
-    uint64_t iLastestHashCnt = 0;
-    bool bHaveFullSet = false;
+    thread_data& thd = pThreads[iThd];
+    thd.oLast.iHashCount = iHashCount;
+    thd.oLast.iTimestamp = iTimestamp;
 
-    //Start at 1, buckettop points to next empty
-    for (size_t i = 1; i < iBucketSize; i++)
+    for (size_t lvl = 0; lvl < iLevelCount; lvl++)
     {
-        size_t idx = (iBucketTop[iThread] - i) & iBucketMask; //overflow expected here
-
-        if (ppTimestamps[iThread][idx] == 0)
-            break; //That means we don't have the data yet
+        const level& l = vLevels[lvl];
+        uint64_t iBucket = iTimestamp / l.iResMs;
+        if (iBucket == thd.vBucket[lvl])
+            break; // Same bucket here means same bucket in all the coarser levels
+
+        thd.vBucket[lvl] = iBucket;
+        thd.vRing[l.iOffset + thd.vTop[lvl]] = thd.oLast;
+        thd.vTop[lvl] = (thd.vTop[lvl] + 1) & (l.iLen - 1);
+        if (thd.vFill[lvl] < l.iLen)
+            thd.vFill[lvl]++;
+    }
+}
 
-        if (iLastestStamp == 0)
-        {
-            iLastestStamp = ppTimestamps[iThread][idx];
-            iLastestHashCnt = ppHashCounts[iThread][idx];
-        }
+/* Picks the finest level that reaches iLastMilisec back. The window then starts at entry
+   n-1, which is between n-1 and n buckets old. */
+bool telemetry::find_window(size_t iLastMilisec, size_t iThread, size_t& lvl, size_t& n)
+{
+    const thread_data& thd = pThreads[iThread];
 
-        if (iTimeNow - ppTimestamps[iThread][idx] > iLastMilisec)
-        {
-            bHaveFullSet = true;
-            break; //We are out of the requested time period
-        }
+    // A thread that stopped hashing has no rate for the window
+    if (thd.oLast.iTimestamp == 0 || tsc_clock::now_ms() - thd.oLast.iTimestamp > iLastMilisec)
+        return false;
 
-        iEarliestStamp = ppTimestamps[iThread][idx];
-        iEarliestHashCnt = ppHashCounts[iThread][idx];
+    for (lvl = 0; lvl < iLevelCount; lvl++)
+    {
+        const level& l = vLevels[lvl];
+        n = (iLastMilisec + l.iResMs - 1) / l.iResMs;
+        if (n < l.iLen)
+            return n > 0 && thd.vFill[lvl] > n;
     }
+    return false;
+}
 
-    if (!bHaveFullSet || iEarliestStamp == 0 || iLastestStamp == 0)
+double telemetry::calc_telemetry_data(size_t iLastMilisec, size_t iThread)
+{
+    size_t lvl, n;
+    if (!find_window(iLastMilisec, iThread, lvl, n))
         return nan("");
 
-    //Don't think that can happen, but just in case
-    if (iLastestStamp - iEarliestStamp == 0)
+    const thread_data& thd = pThreads[iThread];
+    const sample& oStart = ring_entry(thd, lvl, n - 1);
+
+    if (thd.oLast.iTimestamp <= oStart.iTimestamp)
         return nan("");
 
     double fHashes, fTime;
-    fHashes = iLastestHashCnt - iEarliestHashCnt;
-    fTime = iLastestStamp - iEarliestStamp;
+    fHashes = thd.oLast.iHashCount - oStart.iHashCount;
+    fTime = thd.oLast.iTimestamp - oStart.iTimestamp;
     fTime /= 1000.0;
 
     return fHashes / fTime;
 }
 
-void telemetry::push_perf_value(size_t iThd, uint64_t iHashCount, uint64_t iTimestamp)
+bool telemetry::calc_telemetry_range(size_t iLastMilisec, size_t iThread, double& fMin, double& fMax)
 {
-    size_t iTop = iBucketTop[iThd];
-    ppHashCounts[iThd][iTop] = iHashCount;
-    ppTimestamps[iThd][iTop] = iTimestamp;
+    size_t lvl, n;
+    if (!find_window(iLastMilisec, iThread, lvl, n) || n < 3)
+        return false;
+
+    const thread_data& thd = pThreads[iThread];
+    fMin = INFINITY;
+    fMax = 0.0;
+
+    for (size_t k = 0; k + 1 < n; k++)
+    {
+        const sample& oEnd = ring_entry(thd, lvl, k);
+        const sample& oStart = ring_entry(thd, lvl, k + 1);
+        if (oEnd.iTimestamp <= oStart.iTimestamp)
+            continue;
+
+        double fHps = (oEnd.iHashCount - oStart.iHashCount) * 1000.0 / (oEnd.iTimestamp - oStart.iTimestamp);
+        fMin = std::min(fMin, fHps);
+        fMax = std::max(fMax, fHps);
+    }
 
-    iBucketTop[iThd] = (iTop + 1) & iBucketMask;
+    return fMin != INFINITY;
 }
 
 minethd::minethd(miner_work& pWork, size_t iNo, bool double_work, bool no_prefetch, int64_t affinity)
@@ -156,8 +225,7 @@ minethd::minethd(miner_work& pWork, size_t iNo, bool double_work, bool no_prefet
     bQuit = 0;
     iThreadNo = (uint8_t)iNo;
     iJobNo = 0;
-    iHashCount = 0;
-    iTimestamp = 0;
+    pStats = nullptr;
     bNoPrefetch = no_prefetch;
     this->affinity = affinity;
 
@@ -171,6 +239,10 @@ minethd::minethd(miner_work& pWork, size_t iNo, bool double_work, bool no_prefet
 std::atomic<uint64_t> minethd::iGlobalJobNo;
 std::atomic<uint64_t> minethd::iConsumeCnt; //Threads get jobs as they are initialized
 minethd::miner_work minethd::oGlobalWork;
+std::atomic<uint64_t> minethd::iGlobalSplitNo;
+std::mutex minethd::split_mtx;
+minethd::miner_work minethd::oGlobalSplitWork;
+uint32_t minethd::iGlobalSplitShare = 0;
 uint64_t minethd::iThreadCount = 0;
 
 cryptonight_ctx* minethd_alloc_ctx()
@@ -291,9 +363,35 @@ bool minethd::self_test()
     return bResult;
 }
 
+// Never freed, the executor can read it for as long as the process lives
+minethd::thread_stats* minethd::alloc_stats()
+{
+    thread_stats* stats = new(_mm_malloc(sizeof(thread_stats), 64)) thread_stats;
+    stats->iHashCount.store(0, std::memory_order_relaxed);
+    stats->iTimestamp.store(0, std::memory_order_relaxed);
+    for(size_t i=0; i < latency_hist::iBuckets; i++)
+        stats->vHashTimes[i].store(0, std::memory_order_relaxed);
+    pStats.store(stats, std::memory_order_release);
+    return stats;
+}
+
+bool minethd::read_hash_times(hash_time_buckets& out)
+{
+    thread_stats* stats = pStats.load(std::memory_order_acquire);
+    if(stats == nullptr)
+        return false;
+
+    for(size_t i=0; i < latency_hist::iBuckets; i++)
+        out[i] = stats->vHashTimes[i].load(std::memory_order_relaxed);
+    return true;
+}
+
 std::vector<minethd*>* minethd::thread_starter(miner_work& pWork)
 {
+    tsc_clock::calibrate();
+
     iGlobalJobNo = 0;
+    iGlobalSplitNo = 0;
     iConsumeCnt = 0;
     std::vector<minethd*>* pvThreads = new std::vector<minethd*>;
 
@@ -339,6 +437,59 @@ void minethd::consume_work()
     memcpy(&oWork, &oGlobalWork, sizeof(miner_work));
     iJobNo++;
     iConsumeCnt++;
+    flight_recorder::inst()->record(flight_recorder::ev_job_consumed, oWork.iJobHandle);
+    CG_PROBE2(job_consumed, iThreadNo, oWork.iJobHandle);
+}
+
+// Split work changes rarely and there is no hurry, so a plain lock will do
+void minethd::switch_split_work(miner_work& pWork, uint32_t iShare)
+{
+    std::lock_guard<std::mutex> lck(split_mtx);
+    oGlobalSplitWork = pWork;
+    iGlobalSplitShare = pWork.bStall ? 0 : iShare;
+    iGlobalSplitNo++;
+}
+
+void minethd::consume_split_work()
+{
+    std::lock_guard<std::mutex> lck(split_mtx);
+    memcpy(&oSplitWork, &oGlobalSplitWork, sizeof(miner_work));
+    iSplitShare = iGlobalSplitShare;
+    iSplitNo = iGlobalSplitNo.load(std::memory_order_relaxed);
+
+    if(oSplitWork.bNiceHash)
+        iSplitNonce = calc_nicehash_nonce(*(uint32_t*)(oSplitWork.bWorkBlob + 39), oSplitWork.iResumeCnt);
+    else
+        iSplitNonce = calc_start_nonce(oSplitWork.iResumeCnt);
+}
+
+// Called once per main hash (or iHashes of them), true if the split job is due
+inline bool minethd::split_turn(uint32_t iHashes)
+{
+    if(iSplitNo != iGlobalSplitNo.load(std::memory_order_relaxed))
+        consume_split_work();
+
+    iSplitCredit += iSplitShare * iHashes;
+    if(iSplitCredit < iSplitScale)
+        return false;
+
+    iSplitCredit -= iSplitScale;
+    return true;
+}
+
+void minethd::split_hash(cn_hash_fun hash_fun, cryptonight_ctx* ctx)
+{
+    uint8_t bResult[32];
+
+    *(uint32_t*)(oSplitWork.bWorkBlob + 39) = ++iSplitNonce;
+    hash_fun(oSplitWork.bWorkBlob, oSplitWork.iWorkSize, bResult, ctx);
+
+    if (*(uint64_t*)(bResult + 24) < oSplitWork.iTarget)
+    {
+        flight_recorder::inst()->record(flight_recorder::ev_share_found, iSplitNonce);
+        CG_PROBE2(share_found, iThreadNo, iSplitNonce);
+        executor::inst()->push_event(ex_event(job_result(oSplitWork.iJobHandle, iSplitNonce, bResult), oSplitWork.iPoolId));
+    }
 }
 
 minethd::cn_hash_fun minethd::func_selector(bool bHaveAes, bool bNoPrefetch)
@@ -399,6 +550,13 @@ void minethd::work_main()
 
     hash_fun = func_selector(jconf::inst()->HaveHardwareAes(), bNoPrefetch);
     ctx = minethd_alloc_ctx();
+    thread_stats* stats = alloc_stats();
+    oPerf.open();
+
+    char sName[32];
+    snprintf(sName, sizeof(sName), "miner %u", (unsigned int)iThreadNo);
+    flight_recorder::inst()->set_thread_name(sName);
+    uint32_t iTraceCnt = 0;
 
     piHashVal = (uint64_t*)(result.bResult + 24);
     piNonce = (uint32_t*)(oWork.bWorkBlob + 39);
@@ -412,10 +570,12 @@ void minethd::work_main()
                 either because of network latency, or a socket problem. Since we are
                 raison d'etre of this software it us sensible to just wait until we have something*/
 
+            flight_recorder::inst()->record(flight_recorder::ev_stall_begin);
             while (iGlobalJobNo.load(std::memory_order_relaxed) == iJobNo)
                 std::this_thread::sleep_for(std::chrono::milliseconds(1));
 
             consume_work();
+            flight_recorder::inst()->record(flight_recorder::ev_stall_end);
             continue;
         }
 
@@ -424,26 +584,39 @@ void minethd::work_main()
         else
             result.iNonce = calc_start_nonce(oWork.iResumeCnt);
 
-        assert(sizeof(job_result::sJobID) == sizeof(pool_job::sJobID));
-        memcpy(result.sJobID, oWork.sJobID, sizeof(job_result::sJobID));
+        result.iJobHandle = oWork.iJobHandle;
 
         while(iGlobalJobNo.load(std::memory_order_relaxed) == iJobNo)
         {
             if ((iCount & 0x1F) == 0) //Store stats every 32 hashes
             {
-                using namespace std::chrono;
-                uint64_t iStamp = time_point_cast<milliseconds>(high_resolution_clock::now()).time_since_epoch().count();
-                iHashCount.store(iCount, std::memory_order_relaxed);
-                iTimestamp.store(iStamp, std::memory_order_relaxed);
+                stats->iHashCount.store(iCount, std::memory_order_relaxed);
+                stats->iTimestamp.store(tsc_clock::now_ms(), std::memory_order_relaxed);
             }
             iCount++;
 
+            if(split_turn(1))
+            {
+                split_hash(hash_fun, ctx);
+                continue;
+            }
+
             *piNonce = ++result.iNonce;
 
+            uint64_t iStart = tsc_clock::now_us();
             hash_fun(oWork.bWorkBlob, oWork.iWorkSize, result.bResult, ctx);
+            uint64_t iHashUs = tsc_clock::now_us() - iStart;
+            stats->add_hash_time(iHashUs);
+
+            if ((++iTraceCnt & 0x3F) == 0) // One in 64
+                flight_recorder::inst()->record_span(flight_recorder::ev_hash, iStart, (uint32_t)iHashUs);
 
             if (*piHashVal < oWork.iTarget)
+            {
+                flight_recorder::inst()->record(flight_recorder::ev_share_found, result.iNonce);
+                CG_PROBE2(share_found, iThreadNo, result.iNonce);
                 executor::inst()->push_event(ex_event(result, oWork.iPoolId));
+            }
 
             std::this_thread::yield();
         }
@@ -488,6 +661,7 @@ void minethd::double_work_main()
         pin_thd_affinity();
 
     cn_hash_fun_dbl hash_fun;
+    cn_hash_fun split_fun;
     cryptonight_ctx* ctx0;
     cryptonight_ctx* ctx1;
     uint64_t iCount = 0;
@@ -496,11 +670,20 @@ void minethd::double_work_main()
     uint8_t bDoubleHashOut[64];
     uint8_t bDoubleWorkBlob[sizeof(miner_work::bWorkBlob) * 2];
     uint32_t iNonce;
+    uint64_t iNextStats = 0;
     job_result res;
 
     hash_fun = func_dbl_selector(jconf::inst()->HaveHardwareAes(), bNoPrefetch);
+    split_fun = func_selector(jconf::inst()->HaveHardwareAes(), bNoPrefetch);
     ctx0 = minethd_alloc_ctx();
     ctx1 = minethd_alloc_ctx();
+    thread_stats* stats = alloc_stats();
+    oPerf.open();
+
+    char sName[32];
+    snprintf(sName, sizeof(sName), "miner %u", (unsigned int)iThreadNo);
+    flight_recorder::inst()->set_thread_name(sName);
+    uint32_t iTraceCnt = 0;
 
     piHashVal0 = (uint64_t*)(bDoubleHashOut + 24);
     piHashVal1 = (uint64_t*)(bDoubleHashOut + 32 + 24);
@@ -521,10 +704,12 @@ void minethd::double_work_main()
             either because of network latency, or a socket problem. Since we are
             raison d'etre of this software it us sensible to just wait until we have something*/
 
+            flight_recorder::inst()->record(flight_recorder::ev_stall_begin);
             while (iGlobalJobNo.load(std::memory_order_relaxed) == iJobNo)
                 std::this_thread::sleep_for(std::chrono::milliseconds(1));
 
             consume_work();
+            flight_recorder::inst()->record(flight_recorder::ev_stall_end);
             piNonce1 = prep_double_work(bDoubleWorkBlob);
             continue;
         }
@@ -534,16 +719,22 @@ void minethd::double_work_main()
         else
             iNonce = calc_start_nonce(oWork.iResumeCnt);
 
-        assert(sizeof(job_result::sJobID) == sizeof(pool_job::sJobID));
-
         while (iGlobalJobNo.load(std::memory_order_relaxed) == iJobNo)
         {
-            if ((iCount & 0xF) == 0) //Store stats every 32 hashes
+            // Store stats every 32 hashes, a split hash can leave iCount odd
+            if (iCount >= iNextStats)
+            {
+                stats->iHashCount.store(iCount, std::memory_order_relaxed);
+                stats->iTimestamp.store(tsc_clock::now_ms(), std::memory_order_relaxed);
+                iNextStats = iCount + 32;
+            }
+
+            // A split hash takes about half the time of a double hash
+            if(split_turn(2))
             {
-                using namespace std::chrono;
-                uint64_t iStamp = time_point_cast<milliseconds>(high_resolution_clock::now()).time_since_epoch().count();
-                iHashCount.store(iCount, std::memory_order_relaxed);
-                iTimestamp.store(iStamp, std::memory_order_relaxed);
+                iCount++;
+                split_hash(split_fun, ctx0);
+                continue;
             }
 
             iCount += 2;
@@ -551,13 +742,27 @@ void minethd::double_work_main()
             *piNonce0 = ++iNonce;
             *piNonce1 = ++iNonce;
 
+            uint64_t iStart = tsc_clock::now_us();
             hash_fun(bDoubleWorkBlob, oWork.iWorkSize, bDoubleHashOut, ctx0, ctx1);
+            uint64_t iHashUs = tsc_clock::now_us() - iStart;
+            stats->add_hash_time(iHashUs);
+
+            if ((++iTraceCnt & 0x1F) == 0) // One in 32, two hashes each
+                flight_recorder::inst()->record_span(flight_recorder::ev_hash, iStart, (uint32_t)iHashUs);
 
             if (*piHashVal0 < oWork.iTarget)
-                executor::inst()->push_event(ex_event(job_result(oWork.sJobID, iNonce-1, bDoubleHashOut), oWork.iPoolId));
+            {
+                flight_recorder::inst()->record(flight_recorder::ev_share_found, iNonce-1);
+                CG_PROBE2(share_found, iThreadNo, iNonce-1);
+                executor::inst()->push_event(ex_event(job_result(oWork.iJobHandle, iNonce-1, bDoubleHashOut), oWork.iPoolId));
+            }
 
             if (*piHashVal1 < oWork.iTarget)
-                executor::inst()->push_event(ex_event(job_result(oWork.sJobID, iNonce, bDoubleHashOut + 32), oWork.iPoolId));
+            {
+                flight_recorder::inst()->record(flight_recorder::ev_share_found, iNonce);
+                CG_PROBE2(share_found, iThreadNo, iNonce);
+                executor::inst()->push_event(ex_event(job_result(oWork.iJobHandle, iNonce, bDoubleHashOut + 32), oWork.iPoolId));
+            }
 
             std::this_thread::yield();
         }
@@ -2,21 +2,104 @@
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <vector>
+#include <chrono>
 #include "crypto/cryptonight.h"
+#include "perfctr.h"
+#include "latency.h"
 
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+/* Millisecond clock for the hash loops and the telemetry. Reading the TSC is one instruction,
+   a clock call can be a vDSO trip or a VM exit. It is calibrated against steady_clock once at
+   start. CPUs without an invariant TSC stay on steady_clock. */
+class tsc_clock
+{
+public:
+    static void calibrate();
+
+    static inline uint64_t now_ms()
+    {
+        if(fMsPerTick > 0.0)
+            return iBaseMs + (uint64_t)((__rdtsc() - iBaseTsc) * fMsPerTick);
+
+        using namespace std::chrono;
+        return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    // For measuring durations only, it doesn't share a base with now_ms()
+    static inline uint64_t now_us()
+    {
+        if(fMsPerTick > 0.0)
+            return (uint64_t)((__rdtsc() - iBaseTsc) * fMsPerTick * 1000.0);
+
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    static uint64_t iBaseTsc;
+    static uint64_t iBaseMs;
+    static double fMsPerTick;
+};
+
+/* Hashrate history in three cascading rings per thread: one entry per second, per minute
+   and per hour. An entry is the first sample seen in its bucket, so the average over any
+   window is the difference between the newest sample and one ring entry. Covers a bit over
+   a day in a fixed 4.6 kB per thread. */
 class telemetry
 {
 public:
     telemetry(size_t iThd);
     void push_perf_value(size_t iThd, uint64_t iHashCount, uint64_t iTimestamp);
+
+    // Average over the last iLastMilisec, NaN until we have that much history
     double calc_telemetry_data(size_t iLastMilisec, size_t iThread);
 
+    // Slowest and fastest whole bucket in the same window, false until we have two of them
+    bool calc_telemetry_range(size_t iLastMilisec, size_t iThread, double& fMin, double& fMax);
+
 private:
-    constexpr static size_t iBucketSize = 2 << 11; //Power of 2 to simplify calculations
-    constexpr static size_t iBucketMask = iBucketSize - 1;
-    uint32_t* iBucketTop;
-    uint64_t** ppHashCounts;
-    uint64_t** ppTimestamps;
+    struct sample
+    {
+        uint64_t iHashCount;
+        uint64_t iTimestamp;
+    };
+
+    struct level
+    {
+        uint64_t iResMs;
+        size_t iLen; // Power of 2
+        size_t iOffset;
+    };
+
+    constexpr static size_t iLevelCount = 3;
+    constexpr static size_t iRingTotal = 128 + 128 + 32;
+    static const level vLevels[iLevelCount];
+
+    struct alignas(64) thread_data
+    {
+        sample oLast;
+        uint64_t vBucket[iLevelCount]; // Bucket number of the newest entry
+        uint32_t vTop[iLevelCount];    // Next entry to write
+        uint32_t vFill[iLevelCount];
+        sample vRing[iRingTotal];
+    };
+
+    thread_data* pThreads;
+
+    // k = 0 is the newest entry
+    inline const sample& ring_entry(const thread_data& thd, size_t lvl, size_t k)
+    {
+        const level& l = vLevels[lvl];
+        return thd.vRing[l.iOffset + ((thd.vTop[lvl] - 1 - k) & (l.iLen - 1))];
+    }
+
+    bool find_window(size_t iLastMilisec, size_t iThread, size_t& lvl, size_t& n);
 };
 
 class minethd
@@ -24,23 +107,22 @@ class minethd
 public:
     struct miner_work
     {
-        char        sJobID[64];
         uint8_t     bWorkBlob[112];
         uint64_t    iTarget;
         size_t      iPoolId;
+        uint32_t    iJobHandle;
         uint32_t    iWorkSize;
         uint32_t    iResumeCnt;
         bool        bNiceHash;
         bool        bStall;
 
-        miner_work() : iPoolId(0), iWorkSize(0), bStall(true) { }
+        miner_work() : iPoolId(0), iJobHandle(0), iWorkSize(0), bStall(true) { }
 
-        miner_work(const char* sJobID, const uint8_t* bWork, uint32_t iWorkSize, uint32_t iResumeCnt,
+        miner_work(uint32_t iJobHandle, const uint8_t* bWork, uint32_t iWorkSize, uint32_t iResumeCnt,
             uint64_t iTarget, bool bNiceHash, size_t iPoolId) :  iTarget(iTarget), iPoolId(iPoolId),
-            iWorkSize(iWorkSize), iResumeCnt(iResumeCnt), bNiceHash(bNiceHash), bStall(false)
+            iJobHandle(iJobHandle), iWorkSize(iWorkSize), iResumeCnt(iResumeCnt), bNiceHash(bNiceHash), bStall(false)
         {
             assert(iWorkSize <= sizeof(bWorkBlob));
-            memcpy(this->sJobID, sJobID, sizeof(miner_work::sJobID));
             memcpy(this->bWorkBlob, bWork, iWorkSize);
         }
 
@@ -54,21 +136,20 @@ public:
             iResumeCnt = from.iResumeCnt;
             iTarget = from.iTarget;
             iPoolId = from.iPoolId;
+            iJobHandle = from.iJobHandle;
             bNiceHash = from.bNiceHash;
             bStall = from.bStall;
 
             assert(iWorkSize <= sizeof(bWorkBlob));
-            memcpy(sJobID, from.sJobID, sizeof(sJobID));
             memcpy(bWorkBlob, from.bWorkBlob, iWorkSize);
 
             return *this;
         }
 
         miner_work(miner_work&& from) : iTarget(from.iTarget), iPoolId(from.iPoolId),
-            iWorkSize(from.iWorkSize), bStall(from.bStall)
+            iJobHandle(from.iJobHandle), iWorkSize(from.iWorkSize), bStall(from.bStall)
         {
             assert(iWorkSize <= sizeof(bWorkBlob));
-            memcpy(sJobID, from.sJobID, sizeof(sJobID));
             memcpy(bWorkBlob, from.bWorkBlob, iWorkSize);
         }
 
@@ -80,11 +161,11 @@ public:
             iResumeCnt = from.iResumeCnt;
             iTarget = from.iTarget;
             iPoolId = from.iPoolId;
+            iJobHandle = from.iJobHandle;
             bNiceHash = from.bNiceHash;
             bStall = from.bStall;
 
             assert(iWorkSize <= sizeof(bWorkBlob));
-            memcpy(sJobID, from.sJobID, sizeof(sJobID));
             memcpy(bWorkBlob, from.bWorkBlob, iWorkSize);
 
             return *this;
@@ -92,13 +173,65 @@ public:
     };
 
     static void switch_work(miner_work& pWork);
+
+    // A second job that every thread mines next to the main one. It gets iShare out of
+    // every iSplitScale hashes, without stalling or reconnecting anything.
+    static void switch_split_work(miner_work& pWork, uint32_t iShare);
+    constexpr static uint32_t iSplitScale = 1024;
+
+    // NiceHash mode leaves this blob byte - the top byte of the nonce - alone
+    static constexpr size_t iNonceTopByte = 42;
     static std::vector<minethd*>* thread_starter(miner_work& pWork);
     static bool self_test();
 
-    std::atomic<uint64_t> iHashCount;
-    std::atomic<uint64_t> iTimestamp;
+    // Zero until the thread is up
+    inline uint64_t get_hash_count()
+    {
+        thread_stats* stats = pStats.load(std::memory_order_acquire);
+        return stats != nullptr ? stats->iHashCount.load(std::memory_order_relaxed) : 0;
+    }
+
+    // tsc_clock::now_ms() of the last get_hash_count() update
+    inline uint64_t get_timestamp()
+    {
+        thread_stats* stats = pStats.load(std::memory_order_acquire);
+        return stats != nullptr ? stats->iTimestamp.load(std::memory_order_relaxed) : 0;
+    }
+
+    // False until the thread is up, or if the counters aren't available
+    inline bool read_counters(perf_counters::sample& out) { return oPerf.read(out); }
+
+    // Hash times are kept in 10 us units, see latency_hist for the buckets
+    constexpr static uint32_t iHashTimeUnitUs = 10;
+    typedef std::array<uint32_t, latency_hist::iBuckets> hash_time_buckets;
+
+    // Cumulative count per bucket, false until the thread is up
+    bool read_hash_times(hash_time_buckets& out);
 
 private:
+    /* Written by the owning thread only, read by the executor. Each one sits on a cache line
+       of its own and is allocated by its thread after pinning, so that it ends up on the
+       thread's NUMA node. */
+    struct alignas(64) thread_stats
+    {
+        std::atomic<uint64_t> iHashCount;
+        std::atomic<uint64_t> iTimestamp;
+
+        // Time of every hash call, a double thread times both hashes as one
+        alignas(64) std::atomic<uint32_t> vHashTimes[latency_hist::iBuckets];
+
+        inline void add_hash_time(uint64_t iUs)
+        {
+            uint64_t iUnits = iUs / iHashTimeUnitUs;
+            std::atomic<uint32_t>& b = vHashTimes[latency_hist::bucket_of(iUnits < 0xFFFF ? iUnits : 0xFFFF)];
+            b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    };
+
+    std::atomic<thread_stats*> pStats;
+    thread_stats* alloc_stats();
+    perf_counters oPerf;
+
     typedef void (*cn_hash_fun)(const void*, size_t, void*, cryptonight_ctx*);
     typedef void (*cn_hash_fun_dbl)(const void*, size_t, void*, cryptonight_ctx* __restrict, cryptonight_ctx* __restrict);
 
@@ -121,6 +254,9 @@ private:
     void work_main();
     void double_work_main();
     void consume_work();
+    void consume_split_work();
+    bool split_turn(uint32_t iHashes);
+    void split_hash(cn_hash_fun hash_fun, cryptonight_ctx* ctx);
     void pin_thd_affinity();
     uint32_t* prep_double_work(uint8_t bDoubleWorkBlob[sizeof(miner_work::bWorkBlob) * 2]);
 
@@ -141,5 +277,16 @@ private:
 
     miner_work oWork;
     static miner_work oGlobalWork;
+
+    static std::atomic<uint64_t> iGlobalSplitNo;
+    static std::mutex split_mtx;
+    static miner_work oGlobalSplitWork;
+    static uint32_t iGlobalSplitShare;
+
+    miner_work oSplitWork;
+    uint64_t iSplitNo = 0;
+    uint32_t iSplitShare = 0;
+    uint32_t iSplitCredit = 0;
+    uint32_t iSplitNonce = 0;
 };
 
@@ -24,24 +24,41 @@ struct pool_job
     }
 };
 
+// The job is referred to by its job_registry handle
 struct job_result
 {
-    char        sJobID[64];
     uint8_t     bResult[32];
+    uint64_t    iProxyTag; // Non-zero for shares found by a proxy worker
+    uint32_t    iJobHandle;
     uint32_t    iNonce;
 
-    job_result() {}
-    job_result(const char* sJobID, uint32_t iNonce, const uint8_t* bResult) : iNonce(iNonce)
+    job_result() : iProxyTag(0), iJobHandle(0) {}
+    job_result(uint32_t iJobHandle, uint32_t iNonce, const uint8_t* bResult) : iProxyTag(0),
+        iJobHandle(iJobHandle), iNonce(iNonce)
     {
-        memcpy(this->sJobID, sJobID, sizeof(job_result::sJobID));
         memcpy(this->bResult, bResult, sizeof(job_result::bResult));
     }
 };
 
+// Pool reply to a submit call. Submits are asynchronous, so the reply is routed
+// back to the executor as an event. An empty sError means the share was accepted.
+struct submit_result
+{
+    std::string sError;
+    uint64_t    iActualDiff;
+    uint64_t    iProxyTag;
+    uint32_t    iCallTime;
+    bool        bNetError;
+    bool        bReplay; // Share from the outage buffer
+
+    submit_result(uint64_t iActualDiff, uint64_t iProxyTag, uint32_t iCallTime) :
+        iActualDiff(iActualDiff), iProxyTag(iProxyTag), iCallTime(iCallTime), bNetError(false), bReplay(false) {}
+};
+
 enum ex_event_name { EV_INVALID_VAL, EV_SOCK_READY, EV_SOCK_ERROR,
-    EV_POOL_HAVE_JOB, EV_MINER_HAVE_RESULT, EV_PERF_TICK, EV_RECONNECT,
+    EV_POOL_HAVE_JOB, EV_POOL_SUBMIT_RESULT, EV_MINER_HAVE_RESULT, EV_PERF_TICK, EV_RECONNECT,
     EV_SWITCH_POOL, EV_DEV_POOL_EXIT, EV_USR_HASHRATE, EV_USR_RESULTS, EV_USR_CONNSTAT,
-    EV_HASHRATE_LOOP, EV_HTML_HASHRATE, EV_HTML_RESULTS, EV_HTML_CONNSTAT, EV_HTML_JSON };
+    EV_HASHRATE_LOOP };
 
 /*
    This is how I learned to stop worrying and love c++11 =).
@@ -63,12 +80,14 @@ struct ex_event
         pool_job oPoolJob;
         job_result oJobResult;
         std::string sSocketError;
+        submit_result oSubmitResult;
     };
 
     ex_event() { iName = EV_INVALID_VAL; iPoolId = 0;}
     ex_event(std::string&& err, size_t id) : iName(EV_SOCK_ERROR), iPoolId(id), sSocketError(std::move(err)) { }
     ex_event(job_result dat, size_t id) : iName(EV_MINER_HAVE_RESULT), iPoolId(id), oJobResult(dat) {}
     ex_event(pool_job dat, size_t id) : iName(EV_POOL_HAVE_JOB), iPoolId(id), oPoolJob(dat) {}
+    ex_event(submit_result&& dat, size_t id) : iName(EV_POOL_SUBMIT_RESULT), iPoolId(id), oSubmitResult(std::move(dat)) {}
     ex_event(ex_event_name ev, size_t id = 0) : iName(ev), iPoolId(id) {}
 
     // Delete the copy operators to make sure we are moving only what is needed
@@ -85,6 +104,9 @@ struct ex_event
         case EV_SOCK_ERROR:
             new (&sSocketError) std::string(std::move(from.sSocketError));
             break;
+        case EV_POOL_SUBMIT_RESULT:
+            new (&oSubmitResult) submit_result(std::move(from.oSubmitResult));
+            break;
         case EV_MINER_HAVE_RESULT:
             oJobResult = from.oJobResult;
             break;
@@ -102,6 +124,8 @@ struct ex_event
 
         if(iName == EV_SOCK_ERROR)
             sSocketError.~basic_string();
+        else if(iName == EV_POOL_SUBMIT_RESULT)
+            oSubmitResult.~submit_result();
 
         iName = from.iName;
         iPoolId = from.iPoolId;
@@ -112,6 +136,9 @@ struct ex_event
             new (&sSocketError) std::string();
             sSocketError = std::move(from.sSocketError);
             break;
+        case EV_POOL_SUBMIT_RESULT:
+            new (&oSubmitResult) submit_result(std::move(from.oSubmitResult));
+            break;
         case EV_MINER_HAVE_RESULT:
             oJobResult = from.oJobResult;
             break;
@@ -129,5 +156,7 @@ struct ex_event
     {
         if(iName == EV_SOCK_ERROR)
             sSocketError.~basic_string();
+        else if(iName == EV_POOL_SUBMIT_RESULT)
+            oSubmitResult.~submit_result();
     }
 };
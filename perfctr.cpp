@@ -0,0 +1,154 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+
+#include <string.h>
+
+#include "perfctr.h"
+#include "console.h"
+
+#ifdef __linux__
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+// Only the first thread to fail says why
+static std::atomic<bool> bReported(false);
+
+static int perf_open(uint32_t type, uint64_t config)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // This thread, any CPU it runs on
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cache_event(uint64_t cache)
+{
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+#pragma GCC optimize ("Os")
+bool perf_counters::open()
+{
+    vFd[cycles] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    int err = errno;
+    vFd[instructions] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    vFd[llc_misses] = perf_open(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_LL));
+    vFd[dtlb_misses] = perf_open(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_DTLB));
+
+    bool bAny = false;
+    for(size_t i=0; i < counter_count; i++)
+        bAny |= vFd[i] != -1;
+
+    if(bAny)
+    {
+        bOpen.store(true, std::memory_order_release);
+        return true;
+    }
+
+    if(bReported.exchange(true))
+        return false;
+
+    if(err == EACCES || err == EPERM)
+    {
+        int iParanoid = -1;
+        FILE* f = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+        if(f != nullptr)
+        {
+            if(fscanf(f, "%d", &iParanoid) != 1)
+                iParanoid = -1;
+            fclose(f);
+        }
+
+        printer::inst()->print_msg(L1, "Hardware counters are not available, perf_event_paranoid is %d. "
+            "Set it to 2 or lower to see them.", iParanoid);
+    }
+    else if(err == ENOENT || err == EOPNOTSUPP)
+        printer::inst()->print_msg(L1, "Hardware counters are not available on this CPU or VM.");
+    else
+        printer::inst()->print_msg(L1, "Hardware counters are not available: %s.", strerror(err));
+
+    return false;
+}
+#pragma GCC reset_options
+
+bool perf_counters::read(sample& out) const
+{
+    if(!bOpen.load(std::memory_order_acquire))
+        return false;
+
+    bool bAny = false;
+    for(size_t i=0; i < counter_count; i++)
+    {
+        uint64_t val[3]; // value, time enabled, time running
+        out.vValid[i] = vFd[i] != -1 && ::read(vFd[i], val, sizeof(val)) == sizeof(val) && val[2] != 0;
+
+        if(out.vValid[i])
+        {
+            out.vCount[i] = val[2] < val[1] ? (uint64_t)((double)val[0] * val[1] / val[2]) : val[0];
+            bAny = true;
+        }
+        else
+            out.vCount[i] = 0;
+    }
+
+    return bAny;
+}
+
+perf_counters::~perf_counters()
+{
+    for(size_t i=0; i < counter_count; i++)
+    {
+        if(vFd[i] != -1)
+            close(vFd[i]);
+    }
+}
+
+#else
+
+bool perf_counters::open()
+{
+    return false;
+}
+
+bool perf_counters::read(sample& out) const
+{
+    return false;
+}
+
+perf_counters::~perf_counters()
+{
+}
+
+#endif // __linux__
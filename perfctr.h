@@ -0,0 +1,33 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+/*
+ * Hardware counters of one miner thread, read through perf_event_open on Linux. The thread
+ * opens them for itself and anyone may read them afterwards. Each counter is opened on its
+ * own, so a CPU or VM that lacks one still gives us the rest. Kernel time is left out, that
+ * is all perf_event_paranoid 2 lets an unprivileged user see anyway.
+ */
+class perf_counters
+{
+public:
+    enum counter { cycles, instructions, llc_misses, dtlb_misses, counter_count };
+
+    struct sample
+    {
+        uint64_t vCount[counter_count];
+        bool vValid[counter_count];
+    };
+
+    ~perf_counters();
+
+    // Call from the thread to be measured, false if none of the counters could be opened
+    bool open();
+
+    // Any thread, counts are scaled up if the kernel had to multiplex the counters
+    bool read(sample& out) const;
+
+private:
+    int vFd[counter_count] = { -1, -1, -1, -1 };
+    std::atomic<bool> bOpen { false };
+};
@@ -0,0 +1,27 @@
+#pragma once
+
+/*
+ * USDT probes for bpftrace, perf and SystemTap. A probe is a single nop until something
+ * attaches to it, so they stay in release builds. Built without sys/sdt.h they are gone.
+ *
+ *   bpftrace -e 'usdt:./CryptoGoblin:cryptogoblin:submit_result { @rtt = hist(arg1); }'
+ *
+ * Provider "cryptogoblin", probes and their arguments:
+ *   job_consumed   - thread, job handle
+ *   share_found    - thread, nonce
+ *   submit_start   - pool id, job handle
+ *   submit_end     - pool id, job handle, outcome (0 sent, 1 dropped as stale, 2 buffered, 3 dev pool)
+ *   submit_result  - pool id, round trip in ms, accepted
+ *   pool_job       - pool id, difficulty
+ *   reconnect      - pool id, retry delay in seconds
+ *   alloc_ctx      - large pages, locked, failed
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define CG_PROBE2(name, a, b) DTRACE_PROBE2(cryptogoblin, name, a, b)
+#define CG_PROBE3(name, a, b, c) DTRACE_PROBE3(cryptogoblin, name, a, b, c)
+#else
+#define CG_PROBE2(name, a, b)
+#define CG_PROBE3(name, a, b, c)
+#endif
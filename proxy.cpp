@@ -0,0 +1,493 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "proxy.h"
+#include "jpsock.h"
+#include "executor.h"
+#include "minethd.h"
+#include "jconf.h"
+#include "console.h"
+
+#include "rapidjson/document.h"
+#include "jext.h"
+
+using namespace rapidjson;
+
+class proxy_client : public reactor_handler
+{
+public:
+    proxy_client(SOCKET fd, size_t iSlot, uint64_t iSerial) : hSocket(fd), iSlot(iSlot), iSerial(iSerial) {}
+
+    void on_io(bool bRead, bool bWrite);
+    void on_timeout();
+
+    bool send_line(const char* sData, size_t iLen);
+
+    SOCKET hSocket;
+    size_t iSlot;
+    uint64_t iSerial;
+    bool bLoggedIn = false;
+
+private:
+    std::string sRecvBuf;
+    std::string sSendBuf;
+    bool bWatchWrite = false;
+
+    // Nobody sends us more than a submit, anything longer is garbage
+    static constexpr size_t iMaxLineLen = 4096;
+
+    bool do_recv();
+    bool do_send();
+    bool process_line(char* line);
+    bool on_login(const char* sId);
+    bool on_submit(const char* sId, const Value& params);
+    bool send_status(const char* sId, const char* sStatus);
+    bool send_error(const char* sId, const char* sError);
+};
+
+proxy* proxy::oInst = nullptr;
+
+proxy::proxy()
+{
+    iWorkerCount = 0;
+}
+
+#pragma GCC optimize ("Os")
+bool proxy::start(uint16_t iPort)
+{
+    sock_init();
+
+    hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(hListen == INVALID_SOCKET)
+    {
+        printer::inst()->print_msg(L0, "Stratum proxy failed to start: unable to create a socket.");
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(hListen, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(iPort);
+
+    if(bind(hListen, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(hListen, 64) != 0 || !sock_set_nonblock(hListen))
+    {
+        printer::inst()->print_msg(L0, "Stratum proxy failed to start: unable to listen on port %u.", (unsigned int)iPort);
+        sock_close(hListen);
+        hListen = INVALID_SOCKET;
+        return false;
+    }
+
+    reactor::inst()->call([this]() { reactor::inst()->watch(hListen, this, false); });
+    printer::inst()->print_msg(L1, "Stratum proxy listening on port %u.", (unsigned int)iPort);
+    return true;
+}
+
+void proxy::on_io(bool bRead, bool bWrite)
+{
+    do_accept();
+}
+
+void proxy::on_timeout()
+{
+    tDeadline = time_point::max();
+}
+
+void proxy::do_accept()
+{
+    while(true)
+    {
+        SOCKET fd = accept(hListen, nullptr, nullptr);
+        if(fd == INVALID_SOCKET)
+            return;
+
+        size_t iSlot;
+        for(iSlot = 1; iSlot <= iMaxWorkers; iSlot++)
+        {
+            if(vSlots[iSlot] == nullptr)
+                break;
+        }
+
+        if(iSlot > iMaxWorkers || !sock_set_nonblock(fd))
+        {
+            printer::inst()->print_msg(L1, "Stratum proxy is full, turning a worker away.");
+            sock_close(fd);
+            continue;
+        }
+
+        proxy_client* client = new proxy_client(fd, iSlot, iNextSerial++);
+        client->tDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(jconf::inst()->GetCallTimeout());
+
+        if(!reactor::inst()->watch(fd, client, false))
+        {
+            sock_close(fd);
+            delete client;
+            continue;
+        }
+
+        vSlots[iSlot] = client;
+        iWorkerCount++;
+        printer::inst()->print_msg(L3, "Proxy worker %u connected.", (unsigned int)iSlot);
+    }
+}
+
+void proxy::drop_client(proxy_client* client)
+{
+    reactor::inst()->unwatch(client->hSocket, client);
+    sock_close(client->hSocket);
+
+    vPending.erase(std::remove_if(vPending.begin(), vPending.end(),
+        [client](const pending_share& p) { return p.iClientSerial == client->iSerial; }), vPending.end());
+
+    vSlots[client->iSlot] = nullptr;
+    iWorkerCount--;
+    printer::inst()->print_msg(L3, "Proxy worker %u disconnected.", (unsigned int)client->iSlot);
+    delete client;
+}
+#pragma GCC reset_options
+
+#pragma GCC optimize ("O2")
+void proxy::push_job(const pool_job& oJob, size_t pool_id, uint32_t iJobHandle)
+{
+    // The slot byte has to be part of the blob
+    if(oJob.iWorkLen <= minethd::iNonceTopByte)
+        return;
+
+    proxy_job job;
+    job.oJob = oJob;
+    job.iPoolId = pool_id;
+    job.iJobHandle = iJobHandle;
+
+    // Short targets are what everyone understands, rounding down only makes the shares harder
+    uint64_t iTarget = oJob.iTarget;
+    uint32_t iTarget32 = (uint32_t)(iTarget >> 32);
+    if(iTarget32 != 0)
+    {
+        jpsock::bin2hex((const unsigned char*)&iTarget32, 4, job.sTarget);
+        job.sTarget[8] = '\0';
+    }
+    else
+    {
+        jpsock::bin2hex((const unsigned char*)&iTarget, 8, job.sTarget);
+        job.sTarget[16] = '\0';
+    }
+
+    reactor::inst()->post([this, job]() {
+        if(vJobs.size() == iJobHistory)
+            vJobs.erase(vJobs.begin());
+        vJobs.push_back(job);
+
+        for(size_t i = 1; i <= iMaxWorkers; i++)
+        {
+            proxy_client* client = vSlots[i];
+            if(client != nullptr && client->bLoggedIn)
+                send_job(client, vJobs.back());
+        }
+    });
+}
+
+static void format_job(char* buf, size_t len, const char* sHead, uint8_t iSlot, const pool_job& oJob, const char* sTarget, const char* sTail)
+{
+    uint8_t bBlob[sizeof(pool_job::bWorkBlob)];
+    char sBlob[sizeof(pool_job::bWorkBlob) * 2 + 1];
+
+    memcpy(bBlob, oJob.bWorkBlob, oJob.iWorkLen);
+    bBlob[minethd::iNonceTopByte] = iSlot;
+    jpsock::bin2hex(bBlob, oJob.iWorkLen, sBlob);
+    sBlob[oJob.iWorkLen * 2] = '\0';
+
+    snprintf(buf, len, "%s{\"blob\":\"%s\",\"job_id\":\"%s\",\"target\":\"%s\"}%s\n",
+        sHead, sBlob, oJob.sJobID, sTarget, sTail);
+}
+
+void proxy::send_job(proxy_client* client, const proxy_job& job)
+{
+    char buf[512];
+    format_job(buf, sizeof(buf), "{\"jsonrpc\":\"2.0\",\"method\":\"job\",\"params\":", (uint8_t)client->iSlot,
+        job.oJob, job.sTarget, "}");
+
+    if(!client->send_line(buf, strlen(buf)))
+        drop_client(client);
+}
+
+const proxy::proxy_job* proxy::find_job(const char* sJobId)
+{
+    for(size_t i = vJobs.size(); i > 0; i--)
+    {
+        if(strcmp(vJobs[i-1].oJob.sJobID, sJobId) == 0)
+            return &vJobs[i-1];
+    }
+    return nullptr;
+}
+
+uint64_t proxy::add_pending(proxy_client* client, std::string&& sCallId)
+{
+    pending_share p;
+    p.iTag = iNextTag++;
+    p.iClientSerial = client->iSerial;
+    p.iSlot = client->iSlot;
+    p.sCallId = std::move(sCallId);
+    vPending.emplace_back(std::move(p));
+    return vPending.back().iTag;
+}
+
+void proxy::submit_reply(uint64_t iTag, const std::string& sError)
+{
+    reactor::inst()->post([this, iTag, sError]() {
+        auto it = std::find_if(vPending.begin(), vPending.end(), [iTag](const pending_share& p) { return p.iTag == iTag; });
+        if(it == vPending.end())
+            return;
+
+        pending_share p = std::move(*it);
+        vPending.erase(it);
+
+        proxy_client* client = vSlots[p.iSlot];
+        if(client == nullptr || client->iSerial != p.iClientSerial)
+            return;
+
+        char buf[512];
+        if(sError.empty())
+        {
+            snprintf(buf, sizeof(buf), "{\"id\":%s,\"jsonrpc\":\"2.0\",\"error\":null,\"result\":{\"status\":\"OK\"}}\n",
+                p.sCallId.c_str());
+        }
+        else
+        {
+            // The pool's text goes back into a JSON string, so keep only what can't break it
+            std::string sMsg(sError, 0, 256);
+            for(char& c : sMsg)
+            {
+                if(c == '"' || c == '\\' || (unsigned char)c < 0x20)
+                    c = ' ';
+            }
+
+            snprintf(buf, sizeof(buf), "{\"id\":%s,\"jsonrpc\":\"2.0\",\"error\":{\"code\":-1,\"message\":\"%s\"},\"result\":null}\n",
+                p.sCallId.c_str(), sMsg.c_str());
+        }
+
+        if(!client->send_line(buf, strlen(buf)))
+            drop_client(client);
+    });
+}
+
+void proxy_client::on_io(bool bRead, bool bWrite)
+{
+    if(!do_recv() || !do_send())
+        return proxy::inst()->drop_client(this);
+
+    bool bWant = !sSendBuf.empty();
+    if(bWant != bWatchWrite)
+    {
+        reactor::inst()->update(hSocket, this, bWant);
+        bWatchWrite = bWant;
+    }
+}
+
+void proxy_client::on_timeout()
+{
+    printer::inst()->print_msg(L2, "Proxy worker %u didn't log in in time.", (unsigned int)iSlot);
+    proxy::inst()->drop_client(this);
+}
+
+bool proxy_client::send_line(const char* sData, size_t iLen)
+{
+    sSendBuf.append(sData, iLen);
+
+    // A worker that doesn't read its jobs is dead weight
+    if(sSendBuf.size() > 64 * iMaxLineLen)
+        return false;
+
+    if(!do_send())
+        return false;
+
+    bool bWant = !sSendBuf.empty();
+    if(bWant != bWatchWrite)
+    {
+        reactor::inst()->update(hSocket, this, bWant);
+        bWatchWrite = bWant;
+    }
+    return true;
+}
+
+bool proxy_client::do_send()
+{
+    while(!sSendBuf.empty())
+    {
+        int ret = ::send(hSocket, sSendBuf.data(), (int)sSendBuf.size(), SOCK_SEND_FLAGS);
+        if(ret <= 0)
+            return ret < 0 && sock_would_block();
+
+        sSendBuf.erase(0, ret);
+    }
+    return true;
+}
+
+bool proxy_client::do_recv()
+{
+    char buf[iMaxLineLen];
+
+    while(true)
+    {
+        int ret = ::recv(hSocket, buf, sizeof(buf), 0);
+        if(ret == 0)
+            return false;
+
+        if(ret < 0)
+            return sock_would_block();
+
+        sRecvBuf.append(buf, ret);
+
+        size_t iStart = 0, iEnd;
+        while((iEnd = sRecvBuf.find('\n', iStart)) != std::string::npos)
+        {
+            sRecvBuf[iEnd] = '\0';
+            if(iEnd > iStart && !process_line(&sRecvBuf[iStart]))
+                return false;
+            iStart = iEnd + 1;
+        }
+        sRecvBuf.erase(0, iStart);
+
+        if(sRecvBuf.size() > iMaxLineLen)
+            return false;
+    }
+}
+
+bool proxy_client::process_line(char* line)
+{
+    Document doc;
+    if(doc.ParseInsitu(line).HasParseError() || !doc.IsObject())
+        return false;
+
+    const Value* method = GetObjectMember(doc, "method");
+    const Value* id = GetObjectMember(doc, "id");
+    const Value* params = GetObjectMember(doc, "params");
+
+    if(method == nullptr || !method->IsString() || id == nullptr)
+        return false;
+
+    // We echo the id back, so only take the kinds we can print without escaping
+    char sId[72];
+    if(id->IsUint64())
+        snprintf(sId, sizeof(sId), "%llu", (long long unsigned int)id->GetUint64());
+    else if(id->IsString() && id->GetStringLength() < 64 && strpbrk(id->GetString(), "\"\\") == nullptr)
+        snprintf(sId, sizeof(sId), "\"%s\"", id->GetString());
+    else
+        return false;
+
+    const char* sMethod = method->GetString();
+    if(strcmp(sMethod, "submit") == 0)
+    {
+        if(!bLoggedIn || params == nullptr || !params->IsObject())
+            return send_error(sId, "Unauthenticated");
+        return on_submit(sId, *params);
+    }
+
+    if(strcmp(sMethod, "login") == 0)
+        return on_login(sId);
+
+    if(strcmp(sMethod, "keepalived") == 0)
+        return send_status(sId, "KEEPALIVED");
+
+    return send_error(sId, "Unsupported method");
+}
+
+bool proxy_client::on_login(const char* sId)
+{
+    proxy* px = proxy::inst();
+    if(px->vJobs.empty())
+    {
+        send_error(sId, "No job available yet");
+        return false;
+    }
+
+    const proxy::proxy_job& job = px->vJobs.back();
+
+    char sHead[128];
+    snprintf(sHead, sizeof(sHead), "{\"id\":%s,\"jsonrpc\":\"2.0\",\"error\":null,\"result\":{\"id\":\"%u\",\"job\":",
+        sId, (unsigned int)iSlot);
+
+    char buf[768];
+    format_job(buf, sizeof(buf), sHead, (uint8_t)iSlot, job.oJob, job.sTarget, ",\"status\":\"OK\"}}");
+
+    bLoggedIn = true;
+    tDeadline = time_point::max();
+    printer::inst()->print_msg(L3, "Proxy worker %u logged in.", (unsigned int)iSlot);
+
+    return send_line(buf, strlen(buf));
+}
+
+bool proxy_client::on_submit(const char* sId, const Value& params)
+{
+    const Value* jobid = GetObjectMember(params, "job_id");
+    const Value* nonce = GetObjectMember(params, "nonce");
+    const Value* result = GetObjectMember(params, "result");
+
+    if(jobid == nullptr || nonce == nullptr || result == nullptr || !jobid->IsString() ||
+        !nonce->IsString() || !result->IsString() || nonce->GetStringLength() != 8 || result->GetStringLength() != 64)
+        return send_error(sId, "Malformed share");
+
+    uint32_t iNonce;
+    uint8_t bResult[32];
+    if(!jpsock::hex2bin(nonce->GetString(), 8, (unsigned char*)&iNonce) ||
+        !jpsock::hex2bin(result->GetString(), 64, bResult))
+        return send_error(sId, "Malformed share");
+
+    // Anything outside the worker's own slot could collide with someone else's work
+    if((iNonce >> 24) != iSlot)
+        return send_error(sId, "Nonce outside of the worker's range, is nicehash_nonce enabled?");
+
+    proxy* px = proxy::inst();
+    const proxy::proxy_job* job = px->find_job(jobid->GetString());
+    if(job == nullptr)
+        return send_error(sId, "Block expired");
+
+    // A worker that sends junk must not get our upstream login rejected or banned
+    if(((uint64_t*)bResult)[3] >= job->oJob.iTarget)
+        return send_error(sId, "Low difficulty share");
+
+    job_result oResult(job->iJobHandle, iNonce, bResult);
+    oResult.iProxyTag = px->add_pending(this, std::string(sId));
+    executor::inst()->push_event(ex_event(oResult, job->iPoolId));
+    return true;
+}
+
+bool proxy_client::send_status(const char* sId, const char* sStatus)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "{\"id\":%s,\"jsonrpc\":\"2.0\",\"error\":null,\"result\":{\"status\":\"%s\"}}\n", sId, sStatus);
+    return send_line(buf, strlen(buf));
+}
+
+bool proxy_client::send_error(const char* sId, const char* sError)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "{\"id\":%s,\"jsonrpc\":\"2.0\",\"error\":{\"code\":-1,\"message\":\"%s\"},\"result\":null}\n", sId, sError);
+    return send_line(buf, strlen(buf));
+}
+#pragma GCC reset_options
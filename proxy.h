@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "msgstruct.h"
+#include "reactor.h"
+
+/*
+ * Stratum proxy for mining farms. Downstream miners connect to proxy_port and share our
+ * pool connection. Every worker gets its own value of the top nonce byte - the same byte
+ * a NiceHash pool keeps for itself - so the workers have to run with nicehash_nonce
+ * enabled. Slot 0 is left to our own miner threads.
+ *
+ * Everything here runs on the reactor thread. Jobs come in from the executor through
+ * push_job, shares go to the executor as EV_MINER_HAVE_RESULT carrying a proxy tag, and
+ * the pool's verdict comes back with that tag through submit_reply.
+ */
+
+class proxy_client;
+
+class proxy : public reactor_handler
+{
+public:
+    static proxy* inst()
+    {
+        if (oInst == nullptr) oInst = new proxy;
+        return oInst;
+    };
+
+    bool start(uint16_t iPort);
+
+    // Executor thread
+    void push_job(const pool_job& oJob, size_t pool_id, uint32_t iJobHandle);
+    void submit_reply(uint64_t iTag, const std::string& sError);
+
+    inline size_t get_worker_count() { return iWorkerCount; }
+
+    // The top nonce byte is the slot
+    static constexpr size_t iMaxWorkers = 255;
+
+    void on_io(bool bRead, bool bWrite);
+    void on_timeout();
+
+private:
+    proxy();
+    static proxy* oInst;
+
+    friend class proxy_client;
+
+    struct proxy_job
+    {
+        pool_job oJob;
+        size_t iPoolId;
+        uint32_t iJobHandle;
+        char sTarget[17];
+    };
+
+    // A share that went upstream and is waiting for the pool
+    struct pending_share
+    {
+        uint64_t iTag;
+        uint64_t iClientSerial;
+        size_t iSlot;
+        std::string sCallId;
+    };
+
+    // Jobs we still take shares for, newest last
+    static constexpr size_t iJobHistory = 4;
+    std::vector<proxy_job> vJobs;
+
+    SOCKET hListen = INVALID_SOCKET;
+    proxy_client* vSlots[iMaxWorkers + 1] = {};
+    std::atomic<size_t> iWorkerCount;
+    uint64_t iNextSerial = 1;
+    uint64_t iNextTag = 1;
+    std::vector<pending_share> vPending;
+
+    void do_accept();
+    void send_job(proxy_client* client, const proxy_job& job);
+    const proxy_job* find_job(const char* sJobId);
+    void drop_client(proxy_client* client);
+    uint64_t add_pending(proxy_client* client, std::string&& sCallId);
+};
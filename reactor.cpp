@@ -0,0 +1,353 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+#include <future>
+#include <algorithm>
+
+#include "reactor.h"
+#include "console.h"
+#include "flightrec.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#elif !defined(_WIN32)
+#include <poll.h>
+#endif
+
+#ifndef _WIN32
+#include <signal.h>
+#include <pthread.h>
+#endif
+
+// minethd.cpp
+void thd_setaffinity(std::thread::native_handle_type h, uint64_t cpu_id);
+
+reactor* reactor::oInst = nullptr;
+
+reactor::reactor(const char* sName, int64_t iCpu) : iCpu(iCpu)
+{
+    snprintf(this->sName, sizeof(this->sName), "%s", sName);
+
+    sock_init();
+
+#ifndef _WIN32
+    // A pool hanging up on us is a socket error, not a reason to die
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+#if defined(__linux__)
+    iEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    iWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(iEpollFd == -1 || iWakeFd == -1)
+    {
+        printer::inst()->print_msg(L0, "Unable to create the network reactor.");
+        exit(1);
+    }
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    epoll_ctl(iEpollFd, EPOLL_CTL_ADD, iWakeFd, &ev);
+#elif !defined(_WIN32)
+    if(pipe(iWakePipe) != 0)
+    {
+        printer::inst()->print_msg(L0, "Unable to create the network reactor.");
+        exit(1);
+    }
+
+    fcntl(iWakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(iWakePipe[1], F_SETFL, O_NONBLOCK);
+#endif
+
+    std::thread thd(&reactor::reactor_thread, this);
+    oReactorThd = thd.get_id();
+    thd.detach();
+}
+
+void reactor::post(std::function<void()>&& fun)
+{
+    std::unique_lock<std::mutex> mlock(post_mutex);
+    vPosted.emplace_back(std::move(fun));
+
+    if(!bWakePending)
+    {
+        bWakePending = true;
+        mlock.unlock();
+        wakeup();
+    }
+}
+
+void reactor::call(std::function<void()>&& fun)
+{
+    if(std::this_thread::get_id() == oReactorThd)
+    {
+        fun();
+        return;
+    }
+
+    std::promise<void> done;
+    post([&]() { fun(); done.set_value(); });
+    done.get_future().wait();
+}
+
+void reactor::wakeup()
+{
+#if defined(__linux__)
+    uint64_t one = 1;
+    if(write(iWakeFd, &one, sizeof(one)) < 0) {}
+#elif !defined(_WIN32)
+    char c = 0;
+    if(write(iWakePipe[1], &c, 1) < 0) {}
+#endif
+}
+
+void reactor::run_posted()
+{
+    std::vector<std::function<void()>> vRun;
+
+    // Drain the wakeup first, anything posted after this point will signal again
+#if defined(__linux__)
+    uint64_t cnt;
+    if(read(iWakeFd, &cnt, sizeof(cnt)) < 0) {}
+#elif !defined(_WIN32)
+    char buf[64];
+    while(read(iWakePipe[0], buf, sizeof(buf)) > 0) {}
+#endif
+
+    std::unique_lock<std::mutex> mlock(post_mutex);
+    vRun.swap(vPosted);
+    bWakePending = false;
+    mlock.unlock();
+
+    for(std::function<void()>& fun : vRun)
+        fun();
+}
+
+bool reactor::watch(SOCKET fd, reactor_handler* handler, bool bWrite)
+{
+    watch_entry e = { iNextWatchId++, fd, handler, bWrite };
+
+#if defined(__linux__)
+    epoll_event ev = {};
+    ev.events = EPOLLIN | (bWrite ? EPOLLOUT : 0);
+    ev.data.u64 = e.iWatchId;
+    if(epoll_ctl(iEpollFd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        return false;
+#endif
+
+    vWatched.push_back(e);
+    return true;
+}
+
+bool reactor::update(SOCKET fd, reactor_handler* handler, bool bWrite)
+{
+    for(watch_entry& e : vWatched)
+    {
+        if(e.fd != fd || e.handler != handler)
+            continue;
+
+        if(e.bWrite == bWrite)
+            return true;
+
+#if defined(__linux__)
+        epoll_event ev = {};
+        ev.events = EPOLLIN | (bWrite ? EPOLLOUT : 0);
+        ev.data.u64 = e.iWatchId;
+        if(epoll_ctl(iEpollFd, EPOLL_CTL_MOD, fd, &ev) != 0)
+            return false;
+#endif
+        e.bWrite = bWrite;
+        return true;
+    }
+
+    return false;
+}
+
+void reactor::unwatch(SOCKET fd, reactor_handler* handler)
+{
+    for(size_t i = 0; i < vWatched.size(); i++)
+    {
+        if(vWatched[i].fd != fd || vWatched[i].handler != handler)
+            continue;
+
+#if defined(__linux__)
+        epoll_ctl(iEpollFd, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+        vWatched.erase(vWatched.begin() + i);
+        return;
+    }
+}
+
+reactor::watch_entry* reactor::find_watch(uint64_t iWatchId)
+{
+    for(watch_entry& e : vWatched)
+    {
+        if(e.iWatchId == iWatchId)
+            return &e;
+    }
+    return nullptr;
+}
+
+void reactor::dispatch(uint64_t iWatchId, bool bRead, bool bWrite)
+{
+    watch_entry* e = find_watch(iWatchId);
+    if(e != nullptr)
+        e->handler->on_io(bRead, bWrite);
+}
+
+int reactor::next_timeout_ms()
+{
+    using namespace std::chrono;
+    reactor_handler::time_point tNext = reactor_handler::time_point::max();
+    for(watch_entry& e : vWatched)
+        tNext = std::min(tNext, e.handler->tDeadline);
+
+    if(tNext == reactor_handler::time_point::max())
+        return iMaxWaitMs;
+
+    steady_clock::time_point now = steady_clock::now();
+    if(tNext <= now)
+        return 0;
+
+    // Round up, we don't want to wake up just before the deadline and spin
+    int64_t ms = duration_cast<milliseconds>(tNext - now).count() + 1;
+    return (int)std::min<int64_t>(ms, iMaxWaitMs);
+}
+
+void reactor::run_timeouts()
+{
+    reactor_handler::time_point now = std::chrono::steady_clock::now();
+    std::vector<reactor_handler*> vDue;
+
+    for(watch_entry& e : vWatched)
+    {
+        if(e.handler->tDeadline <= now && std::find(vDue.begin(), vDue.end(), e.handler) == vDue.end())
+            vDue.push_back(e.handler);
+    }
+
+    for(reactor_handler* h : vDue)
+    {
+        if(h->tDeadline <= now)
+            h->on_timeout();
+    }
+}
+
+void reactor::pin_thread()
+{
+    if(iCpu < 0)
+        return;
+
+#ifdef _WIN32
+    thd_setaffinity(GetCurrentThread(), iCpu);
+#else
+    thd_setaffinity(pthread_self(), iCpu);
+#endif
+}
+
+#if defined(__linux__)
+void reactor::reactor_thread()
+{
+    constexpr size_t iMaxEvents = 64;
+    epoll_event events[iMaxEvents];
+    pin_thread();
+    flight_recorder::inst()->set_thread_name(sName);
+
+    while(true)
+    {
+        int n = epoll_wait(iEpollFd, events, iMaxEvents, next_timeout_ms());
+
+        for(int i = 0; i < n; i++)
+        {
+            if(events[i].data.u64 == 0)
+                continue;
+
+            uint32_t ev = events[i].events;
+            bool bErr = (ev & (EPOLLERR | EPOLLHUP)) != 0;
+            dispatch(events[i].data.u64, bErr || (ev & EPOLLIN) != 0, bErr || (ev & EPOLLOUT) != 0);
+        }
+
+        run_posted();
+        run_timeouts();
+    }
+}
+#else
+void reactor::reactor_thread()
+{
+    std::vector<pollfd> vPoll;
+    std::vector<uint64_t> vIds;
+    pin_thread();
+    flight_recorder::inst()->set_thread_name(sName);
+
+    while(true)
+    {
+        vPoll.clear();
+        vIds.clear();
+
+#ifndef _WIN32
+        pollfd wake = {};
+        wake.fd = iWakePipe[0];
+        wake.events = POLLIN;
+        vPoll.push_back(wake);
+        vIds.push_back(0);
+#endif
+
+        for(watch_entry& e : vWatched)
+        {
+            pollfd p = {};
+            p.fd = e.fd;
+            p.events = POLLIN | (e.bWrite ? POLLOUT : 0);
+            vPoll.push_back(p);
+            vIds.push_back(e.iWatchId);
+        }
+
+        int timeout = next_timeout_ms();
+        int n;
+#ifdef _WIN32
+        if(vPoll.empty())
+        {
+            Sleep(timeout);
+            n = 0;
+        }
+        else
+            n = WSAPoll(vPoll.data(), (ULONG)vPoll.size(), timeout);
+#else
+        n = poll(vPoll.data(), vPoll.size(), timeout);
+#endif
+
+        for(size_t i = 0; n > 0 && i < vPoll.size(); i++)
+        {
+            if(vIds[i] == 0 || vPoll[i].revents == 0)
+                continue;
+
+            short ev = vPoll[i].revents;
+            bool bErr = (ev & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+            dispatch(vIds[i], bErr || (ev & POLLIN) != 0, bErr || (ev & POLLOUT) != 0);
+        }
+
+        run_posted();
+        run_timeouts();
+    }
+}
+#endif
@@ -0,0 +1,106 @@
+#pragma once
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <stdint.h>
+
+#include "socks.h"
+
+/*
+ * All pool sockets live on a single network thread. Sockets are non-blocking and the
+ * thread waits on all of them at once (epoll on Linux, poll everywhere else).
+ *
+ * Handlers are only ever called on the reactor thread. Other threads talk to it with
+ * post() (fire and forget) or call() (wait until it has run). watch / unwatch / update
+ * and the deadlines are reactor thread only.
+ *
+ * inst() is the pool reactor. The web server runs a second one of its own, so that
+ * nothing it does can hold up a submit.
+ */
+
+class reactor_handler
+{
+public:
+    virtual ~reactor_handler() {}
+
+    // bRead / bWrite are readiness hints, an error or hangup sets both
+    virtual void on_io(bool bRead, bool bWrite) = 0;
+    // Has to move or clear the deadline, otherwise it gets called again straight away
+    virtual void on_timeout() = 0;
+
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    // on_timeout is called once the deadline passes, time_point::max() means no deadline
+    time_point tDeadline = time_point::max();
+};
+
+class reactor
+{
+public:
+    static reactor* inst()
+    {
+        if (oInst == nullptr) oInst = new reactor("network", -1);
+        return oInst;
+    };
+
+    // iCpu pins the thread, -1 means no affinity
+    reactor(const char* sName, int64_t iCpu);
+
+    void post(std::function<void()>&& fun);
+    void call(std::function<void()>&& fun);
+
+    bool watch(SOCKET fd, reactor_handler* handler, bool bWrite);
+    bool update(SOCKET fd, reactor_handler* handler, bool bWrite);
+    void unwatch(SOCKET fd, reactor_handler* handler);
+
+private:
+    static reactor* oInst;
+
+    char sName[16];
+    int64_t iCpu;
+
+    void reactor_thread();
+    void pin_thread();
+    void wakeup();
+    void run_posted();
+    void run_timeouts();
+    int next_timeout_ms();
+
+    std::mutex post_mutex;
+    std::vector<std::function<void()>> vPosted;
+    bool bWakePending = false;
+    std::thread::id oReactorThd;
+
+    /* Every watch gets a fresh id, events carry the id and not the socket, so an event
+       that was already fetched for a socket that got closed (and its number reused) in
+       the meantime can't end up at the wrong handler. */
+    struct watch_entry
+    {
+        uint64_t iWatchId;
+        SOCKET fd;
+        reactor_handler* handler;
+        bool bWrite;
+    };
+    std::vector<watch_entry> vWatched;
+    uint64_t iNextWatchId = 1;
+
+    watch_entry* find_watch(uint64_t iWatchId);
+    void dispatch(uint64_t iWatchId, bool bRead, bool bWrite);
+
+#ifdef _WIN32
+    // There is no cheap way to interrupt WSAPoll, so posts are picked up on the next wakeup
+    static constexpr int iMaxWaitMs = 10;
+#else
+    // Upper bound on a single wait, so that deadlines get checked even without a wakeup
+    static constexpr int iMaxWaitMs = 1000;
+#endif
+
+#if defined(__linux__)
+    int iEpollFd;
+    int iWakeFd;
+#elif !defined(_WIN32)
+    int iWakePipe[2];
+#endif
+};
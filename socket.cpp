@@ -27,6 +27,9 @@
 #include "console.h"
 #include "executor.h"
 
+#include <mutex>
+#include <unordered_map>
+
 #ifndef CONF_NO_TLS
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -37,10 +40,40 @@
 #endif
 #endif
 
+namespace
+{
+struct dns_entry
+{
+    std::vector<sock_addr> vIpv4;
+    std::vector<sock_addr> vIpv6;
+    std::chrono::steady_clock::time_point tExpires;
+};
+
+// Lookups come from the executor, drops can come from the reactor thread
+std::mutex dns_cache_mutex;
+std::unordered_map<std::string, dns_entry> dns_cache;
+
+void dns_cache_drop(const char* key)
+{
+    std::unique_lock<std::mutex> lck(dns_cache_mutex);
+    dns_cache.erase(key);
+}
+
+void shuffle_into(std::vector<sock_addr>& out, std::vector<sock_addr> in)
+{
+    for(size_t i = in.size(); i > 1; i--)
+        std::swap(in[i - 1], in[rand() % i]);
+    out.swap(in);
+}
+}
+
 plain_socket::plain_socket(jpsock* err_callback) : pCallback(err_callback)
 {
     hSocket = INVALID_SOCKET;
-    pSockAddr = nullptr;
+    bConnecting = false;
+    iNextAddr = 0;
+    iLastConnectErr = 0;
+    sDnsKey[0] = '\0';
 }
 
 bool plain_socket::set_hostname(const char* sAddr)
@@ -64,123 +97,341 @@ bool plain_socket::set_hostname(const char* sAddr)
     if ((sPort = strchr(sAddrMb, ':')) == nullptr)
         return pCallback->set_socket_error("CONNECT error: Pool port number not specified, please use format <hostname>:<port>.");
 
+    snprintf(sDnsKey, sizeof(sDnsKey), "%s", sAddrMb);
+
     sPort[0] = '\0';
     sPort++;
 
-    addrinfo hints = { 0 };
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-
-    pAddrRoot = nullptr;
-    int err;
-    if ((err = getaddrinfo(sAddrMb, sPort, &hints, &pAddrRoot)) != 0)
-        return pCallback->set_socket_error_strerr("CONNECT error: GetAddrInfo: ", err);
+    snprintf(sHostOnly, sizeof(sHostOnly), "%s", sAddrMb);
 
-    addrinfo *ptr = pAddrRoot;
-    std::vector<addrinfo*> ipv4;
-    std::vector<addrinfo*> ipv6;
+    dns_entry entry;
+    std::unique_lock<std::mutex> lck(dns_cache_mutex);
+    auto it = dns_cache.find(sDnsKey);
+    if (it != dns_cache.end() && it->second.tExpires > std::chrono::steady_clock::now())
+        entry = it->second;
+    lck.unlock();
 
-    while (ptr != nullptr)
+    if (entry.vIpv4.empty() && entry.vIpv6.empty())
     {
-        if (ptr->ai_family == AF_INET)
-            ipv4.push_back(ptr);
-        if (ptr->ai_family == AF_INET6)
-            ipv6.push_back(ptr);
-        ptr = ptr->ai_next;
+        addrinfo hints = { 0 };
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+
+        addrinfo *pAddrRoot = nullptr;
+        int err;
+        if ((err = getaddrinfo(sAddrMb, sPort, &hints, &pAddrRoot)) != 0)
+            return pCallback->set_socket_error_strerr("CONNECT error: GetAddrInfo: ", err);
+
+        for (addrinfo *ptr = pAddrRoot; ptr != nullptr; ptr = ptr->ai_next)
+        {
+            if ((ptr->ai_family != AF_INET && ptr->ai_family != AF_INET6) || ptr->ai_addrlen > sizeof(sockaddr_storage))
+                continue;
+
+            sock_addr a;
+            memset(&a, 0, sizeof(a));
+            memcpy(&a.addr, ptr->ai_addr, ptr->ai_addrlen);
+            a.len = (socklen_t)ptr->ai_addrlen;
+            (ptr->ai_family == AF_INET ? entry.vIpv4 : entry.vIpv6).push_back(a);
+        }
+
+        freeaddrinfo(pAddrRoot);
+
+        if (entry.vIpv4.empty() && entry.vIpv6.empty())
+            return pCallback->set_socket_error("CONNECT error: I found some DNS records but no IPv4 or IPv6 addresses.");
+
+        entry.tExpires = std::chrono::steady_clock::now() + std::chrono::seconds(iDnsCacheTime);
+        lck.lock();
+        dns_cache[sDnsKey] = entry;
+        lck.unlock();
     }
 
-    if (ipv4.empty() && ipv6.empty())
+    // Shuffle within the family to spread the load, then interleave starting with the preferred family
+    std::vector<sock_addr> first, second;
+    if (jconf::inst()->PreferIpv4())
     {
-        freeaddrinfo(pAddrRoot);
-        pAddrRoot = nullptr;
-        return pCallback->set_socket_error("CONNECT error: I found some DNS records but no IPv4 or IPv6 addresses.");
+        shuffle_into(first, entry.vIpv4);
+        shuffle_into(second, entry.vIpv6);
     }
-    else if (!ipv4.empty() && ipv6.empty())
-        pSockAddr = ipv4[rand() % ipv4.size()];
-    else if (ipv4.empty() && !ipv6.empty())
-        pSockAddr = ipv6[rand() % ipv6.size()];
-    else if (!ipv4.empty() && !ipv6.empty())
+    else
     {
-        if(jconf::inst()->PreferIpv4())
-            pSockAddr = ipv4[rand() % ipv4.size()];
-        else
-            pSockAddr = ipv6[rand() % ipv6.size()];
+        shuffle_into(first, entry.vIpv6);
+        shuffle_into(second, entry.vIpv4);
     }
 
-    hSocket = socket(pSockAddr->ai_family, pSockAddr->ai_socktype, pSockAddr->ai_protocol);
-
-    if (hSocket == INVALID_SOCKET)
+    vAddrs.clear();
+    for (size_t i = 0; i < first.size() || i < second.size(); i++)
     {
-        freeaddrinfo(pAddrRoot);
-        pAddrRoot = nullptr;
-        return pCallback->set_socket_error_strerr("CONNECT error: Socket creation failed ");
+        if (i < first.size())
+            vAddrs.push_back(first[i]);
+        if (i < second.size())
+            vAddrs.push_back(second[i]);
     }
 
+    iNextAddr = 0;
     return true;
 }
 
 bool plain_socket::connect()
 {
-    char tmphostname[MAXHOSTLEN];
-    char tmpip[MAXHOSTLEN];
-    int ret = ::connect(hSocket, pSockAddr->ai_addr, (int)pSockAddr->ai_addrlen);
+    iLastConnectErr = 0;
+    bConnecting = true;
 
-    getnameinfo((struct sockaddr *)pSockAddr->ai_addr, pSockAddr->ai_addrlen, tmphostname, MAXHOSTLEN, NULL, 0, 0);
-    getnameinfo((struct sockaddr *)pSockAddr->ai_addr, pSockAddr->ai_addrlen, tmpip, MAXHOSTLEN, NULL, 0, NI_NUMERICHOST);
-    snprintf(hostname, sizeof(hostname), "%s (%s)", tmpip, tmphostname);
+    if (!start_attempt())
+        return connect_failed() == 0;
 
-    freeaddrinfo(pAddrRoot);
-    pAddrRoot = nullptr;
+    return true;
+}
 
-    if (ret != 0)
-        return pCallback->set_socket_error_strerr("CONNECT error: ");
+bool plain_socket::start_attempt()
+{
+    while (iNextAddr < vAddrs.size())
+    {
+        const sock_addr& a = vAddrs[iNextAddr++];
+        SOCKET fd = socket(a.addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
 
-    return true;
+        if (fd == INVALID_SOCKET)
+        {
+            iLastConnectErr = sock_errno();
+            continue;
+        }
+
+        if (!sock_set_nonblock(fd))
+        {
+            iLastConnectErr = sock_errno();
+            sock_close(fd);
+            continue;
+        }
+
+        if (::connect(fd, (const sockaddr*)&a.addr, a.len) != 0 && !sock_would_block())
+        {
+            iLastConnectErr = sock_errno();
+            sock_close(fd);
+            continue;
+        }
+
+        vAttempts.push_back(fd);
+        tNextAttempt = std::chrono::steady_clock::now() + std::chrono::milliseconds(iAttemptDelay);
+        return true;
+    }
+
+    return false;
 }
 
-int plain_socket::recv(char* buf, unsigned int len)
+int plain_socket::connect_failed()
 {
-    int ret = ::recv(hSocket, buf, len, 0);
+    // The addresses might have moved, look them up again next time
+    dns_cache_drop(sDnsKey);
 
-    if(ret == 0)
-        pCallback->set_socket_error("RECEIVE error: socket closed");
-    if(ret == SOCKET_ERROR || ret < 0)
-        pCallback->set_socket_error_strerr("RECEIVE error: ");
+    if (iLastConnectErr == 0)
+        return pCallback->set_socket_error("CONNECT error: No address to connect to"), -1;
+
+    sock_set_errno(iLastConnectErr);
+    return pCallback->set_socket_error_strerr("CONNECT error: "), -1;
+}
+
+plain_socket::time_point plain_socket::next_attempt_time()
+{
+    if (!bConnecting || iNextAddr >= vAddrs.size())
+        return time_point::max();
+    return tNextAttempt;
+}
+
+int plain_socket::on_attempt_timer()
+{
+    if (!bConnecting)
+        return 0;
+
+    if (!start_attempt() && vAttempts.empty())
+        return connect_failed();
+
+    return 0;
+}
 
-    return ret;
+void plain_socket::get_fds(std::vector<SOCKET>& fds)
+{
+    fds.clear();
+    if (bConnecting)
+        fds = vAttempts;
+    else if (hSocket != INVALID_SOCKET)
+        fds.push_back(hSocket);
+}
+
+void plain_socket::close_fd(SOCKET fd)
+{
+    pCallback->release_fd(fd);
+    sock_close(fd);
 }
 
-bool plain_socket::send(const char* buf)
+int plain_socket::handshake()
 {
-    int pos = 0, slen = strlen(buf);
-    while (pos != slen)
+    if (!bConnecting)
+        return 1;
+
+    bool bFailed = false;
+    for (size_t i = 0; i < vAttempts.size();)
     {
-        int ret = ::send(hSocket, buf + pos, slen - pos, 0);
-        if (ret == SOCKET_ERROR)
+        SOCKET fd = vAttempts[i];
+
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&err, &errlen) != 0)
+            err = sock_errno();
+
+        if (err != 0)
         {
-            pCallback->set_socket_error_strerr("SEND error: ");
-            return false;
+            iLastConnectErr = err;
+            close_fd(fd);
+            vAttempts.erase(vAttempts.begin() + i);
+            bFailed = true;
+            continue;
         }
-        else
-            pos += ret;
+
+        // No error and no peer means that we are still waiting
+        sockaddr_storage peer;
+        socklen_t peerlen = sizeof(peer);
+        if (getpeername(fd, (struct sockaddr*)&peer, &peerlen) != 0)
+        {
+            i++;
+            continue;
+        }
+
+        // We have a winner, everyone else can go home
+        for (SOCKET other : vAttempts)
+        {
+            if (other != fd)
+                close_fd(other);
+        }
+        vAttempts.clear();
+
+        hSocket = fd;
+        bConnecting = false;
+
+        char tmpip[MAXHOSTLEN];
+        getnameinfo((struct sockaddr *)&peer, peerlen, tmpip, MAXHOSTLEN, NULL, 0, NI_NUMERICHOST);
+        snprintf(hostname, sizeof(hostname), "%s (%s)", tmpip, sHostOnly);
+        return 1;
     }
 
-    return true;
+    // Don't wait for the timer if one of them failed
+    if (bFailed)
+        start_attempt();
+
+    if (vAttempts.empty())
+        return connect_failed();
+
+    return 0;
+}
+
+int plain_socket::recv(char* buf, unsigned int len)
+{
+    int ret = ::recv(hSocket, buf, len, 0);
+
+    if(ret > 0)
+        return ret;
+
+    if(ret == 0)
+        return pCallback->set_socket_error("RECEIVE error: socket closed"), -1;
+
+    if(sock_would_block())
+        return 0;
+
+    return pCallback->set_socket_error_strerr("RECEIVE error: "), -1;
+}
+
+int plain_socket::send(const char* buf, unsigned int len)
+{
+    int ret = ::send(hSocket, buf, len, SOCK_SEND_FLAGS);
+
+    if (ret >= 0)
+        return ret;
+
+    if (sock_would_block())
+        return 0;
+
+    return pCallback->set_socket_error_strerr("SEND error: "), -1;
 }
 
-void plain_socket::close(bool free)
+void plain_socket::close()
 {
+    for (SOCKET fd : vAttempts)
+        close_fd(fd);
+    vAttempts.clear();
+
     if(hSocket != INVALID_SOCKET)
     {
-        sock_close(hSocket);
+        close_fd(hSocket);
         hSocket = INVALID_SOCKET;
     }
+
+    bConnecting = false;
 }
 
 #ifndef CONF_NO_TLS
-tls_socket::tls_socket(jpsock* err_callback) : pCallback(err_callback)
+namespace
+{
+/* Client session cache, shared by all pool connections. The executor reads it when
+   setting up a connection, the reactor thread writes it when the pool sends a session. */
+std::mutex tls_cache_mutex;
+std::unordered_map<std::string, SSL_SESSION*> tls_cache;
+
+void tls_cache_put(const char* key, SSL_SESSION* sess)
+{
+    std::unique_lock<std::mutex> lck(tls_cache_mutex);
+    SSL_SESSION*& entry = tls_cache[key];
+    if(entry != nullptr)
+        SSL_SESSION_free(entry);
+    entry = sess;
+}
+
+void tls_cache_drop(const char* key)
 {
+    std::unique_lock<std::mutex> lck(tls_cache_mutex);
+    auto it = tls_cache.find(key);
+    if(it != tls_cache.end())
+    {
+        SSL_SESSION_free(it->second);
+        tls_cache.erase(it);
+    }
+}
+
+// SSL_set_session takes its own reference, so we only need the lock while we do it
+bool tls_cache_apply(const char* key, SSL* ssl)
+{
+    std::unique_lock<std::mutex> lck(tls_cache_mutex);
+    auto it = tls_cache.find(key);
+    return it != tls_cache.end() && SSL_set_session(ssl, it->second) == 1;
+}
+}
+
+SSL_CTX* tls_socket::ctx = nullptr;
+
+tls_socket::tls_socket(jpsock* err_callback) : plain_socket(err_callback)
+{
+    sCacheKey[0] = '\0';
+}
+
+int tls_socket::new_session_cb(SSL* ssl, SSL_SESSION* sess)
+{
+    tls_socket* sck = (tls_socket*)SSL_get_app_data(ssl);
+    if(sck == nullptr)
+        return 0;
+
+    sck->keep_session(sess);
+    return 1; // We are keeping the reference
+}
+
+void tls_socket::keep_session(SSL_SESSION* sess)
+{
+    if(bVerified)
+    {
+        tls_cache_put(sCacheKey, sess);
+        return;
+    }
+
+    if(pPendingSession != nullptr)
+        SSL_SESSION_free(pPendingSession);
+    pPendingSession = sess;
 }
 
 void tls_socket::print_error()
@@ -191,7 +442,10 @@ void tls_socket::print_error()
     char *buf = nullptr;
     size_t len = BIO_get_mem_data(err_bio, &buf);
 
-    pCallback->set_socket_error(buf, len);
+    if(len == 0)
+        pCallback->set_socket_error("TLS error: unknown error");
+    else
+        pCallback->set_socket_error(buf, len);
 
     BIO_free(err_bio);
 }
@@ -207,6 +461,13 @@ void tls_socket::init_ctx()
     if(ctx == nullptr)
         return;
 
+    // We keep our send buffer around, but it may move and grow between the retries
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // We do our own caching, OpenSSL doesn't know which pool a session belongs to
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+
     if(jconf::inst()->TlsSecureAlgos())
     {
         SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 | SSL_OP_NO_COMPRESSION);
@@ -225,22 +486,13 @@ bool tls_socket::set_hostname(const char* sAddr)
         }
     }
 
-    if((bio = BIO_new_ssl_connect(ctx)) == nullptr)
-    {
-        print_error();
+    if(!plain_socket::set_hostname(sAddr))
         return false;
-    }
 
-    if(BIO_set_conn_hostname(bio, sAddr) != 1)
-    {
-        print_error();
-        return false;
-    }
-
-    BIO_get_ssl(bio, &ssl);
-    if(ssl == nullptr)
+    if((ssl = SSL_new(ctx)) == nullptr)
     {
         print_error();
+        close();
         return false;
     }
 
@@ -249,35 +501,105 @@ bool tls_socket::set_hostname(const char* sAddr)
         if(SSL_set_cipher_list(ssl, "HIGH:!aNULL:!kRSA:!PSK:!SRP:!MD5:!RC4:!SHA1") != 1)
         {
             print_error();
+            close();
             return false;
         }
     }
 
+    SSL_set_app_data(ssl, this);
+    snprintf(sCacheKey, sizeof(sCacheKey), "%s", sAddr);
+    tls_cache_apply(sCacheKey, ssl);
+
+    SSL_set_connect_state(ssl);
     return true;
 }
 
 bool tls_socket::connect()
 {
-    if(BIO_do_connect(bio) != 1)
+    bWantWrite = false;
+    return plain_socket::connect();
+}
+
+int tls_socket::ssl_result(int ret, const char* sClosed, bool bRead)
+{
+    switch(SSL_get_error(ssl, ret))
     {
+    case SSL_ERROR_WANT_READ:
+        if(bRead)
+            bWantWrite = false;
+        return 0;
+    case SSL_ERROR_WANT_WRITE:
+        if(bRead)
+            bWantWrite = true;
+        return 0;
+    case SSL_ERROR_ZERO_RETURN:
+        return pCallback->set_socket_error(sClosed), -1;
+    case SSL_ERROR_SYSCALL:
+        if(ERR_peek_error() == 0)
+        {
+            if(ret == 0 || errno == 0)
+                return pCallback->set_socket_error(sClosed), -1;
+            return pCallback->set_socket_error_strerr(bRead ? "RECEIVE error: " : "SEND error: "), -1;
+        }
+        bFatalError = true;
         print_error();
-        return false;
+        return -1;
+    default:
+        bFatalError = true;
+        print_error();
+        return -1;
+    }
+}
+
+int tls_socket::handshake()
+{
+    if(plain_socket::wants_write())
+    {
+        int ret = plain_socket::handshake();
+        if(ret != 1)
+            return ret;
+
+        if(SSL_set_fd(ssl, (int)hSocket) != 1)
+        {
+            print_error();
+            return -1;
+        }
     }
 
-    // Get IP and reverse hostname
-    struct sockaddr_in addr;
-    socklen_t addr_size = sizeof(struct sockaddr_in);
-    char tmphostname[MAXHOSTLEN];
-    getpeername(BIO_get_fd(bio,NULL), (struct sockaddr *)&addr, &addr_size);
-    getnameinfo((struct sockaddr *)&addr, addr_size, tmphostname, MAXHOSTLEN, NULL, 0, 0);
-    snprintf(hostname, sizeof(hostname), "%s (%s)", inet_ntoa(addr.sin_addr), tmphostname);
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl);
+    if(ret != 1)
+    {
+        ret = ssl_result(ret, "CONNECT error: socket closed during the TLS handshake", true);
+
+        // Don't offer the same session again if it was part of the problem
+        if(ret < 0)
+            tls_cache_drop(sCacheKey);
+        return ret;
+    }
 
-    if(BIO_do_handshake(bio) != 1)
+    bWantWrite = false;
+
+    // The session only made it into the cache after its certificate passed the check
+    bResumed = SSL_session_reused(ssl) == 1;
+    if(!bResumed && !check_fingerprint())
     {
-        print_error();
-        return false;
+        tls_cache_drop(sCacheKey);
+        return -1;
+    }
+
+    bVerified = true;
+    if(pPendingSession != nullptr)
+    {
+        tls_cache_put(sCacheKey, pPendingSession);
+        pPendingSession = nullptr;
     }
 
+    return 1;
+}
+
+bool tls_socket::check_fingerprint()
+{
     /* Step 1: verify a server certificate was presented during the negotiation */
     X509* cert = SSL_get_peer_certificate(ssl);
     if(cert == nullptr)
@@ -317,7 +639,7 @@ bool tls_socket::connect()
         BIO_write(b64, md, dlen);
         BIO_flush(b64);
 
-        const char* conf_md = jconf::inst()->GetTlsFingerprint();
+        const char* conf_md = pCallback->get_tls_fp();
         char *b64_md = nullptr;
         size_t b64_len = BIO_get_mem_data(bmem, &b64_md);
 
@@ -345,36 +667,57 @@ bool tls_socket::connect()
 
 int tls_socket::recv(char* buf, unsigned int len)
 {
-    int ret = BIO_read(bio, buf, len);
+    ERR_clear_error();
+    int ret = SSL_read(ssl, buf, len);
 
-    if(ret == 0)
-        pCallback->set_socket_error("RECEIVE error: socket closed");
-    if(ret < 0)
-        print_error();
+    if(ret > 0)
+    {
+        bWantWrite = false;
+        return ret;
+    }
 
-    return ret;
+    return ssl_result(ret, "RECEIVE error: socket closed", true);
 }
 
-bool tls_socket::send(const char* buf)
+int tls_socket::send(const char* buf, unsigned int len)
 {
-    return BIO_puts(bio, buf) > 0;
+    ERR_clear_error();
+    int ret = SSL_write(ssl, buf, len);
+
+    if(ret > 0)
+        return ret;
+
+    return ssl_result(ret, "SEND error: socket closed", false);
 }
 
-void tls_socket::close(bool free)
+void tls_socket::close()
 {
-    if(bio == nullptr || ssl == nullptr)
-        return;
-
-    if(!free)
+    if(ssl != nullptr)
     {
-        sock_close(BIO_get_fd(bio, nullptr));
+        /* OpenSSL won't resume a session that wasn't shut down, but a pool that just
+           dropped the TCP connection is no reason to throw it away. TLS errors are. */
+        if(!bFatalError)
+        {
+            SSL_set_quiet_shutdown(ssl, 1);
+            SSL_shutdown(ssl);
+        }
+        else
+            tls_cache_drop(sCacheKey);
+
+        SSL_free(ssl);
+        ssl = nullptr;
     }
-    else
+
+    if(pPendingSession != nullptr)
     {
-        BIO_free_all(bio);
-        ssl = nullptr;
-        bio = nullptr;
+        SSL_SESSION_free(pPendingSession);
+        pPendingSession = nullptr;
     }
+
+    bWantWrite = false;
+    bResumed = false;
+    bVerified = false;
+    bFatalError = false;
+    plain_socket::close();
 }
 #endif
-
@@ -1,21 +1,66 @@
 #pragma once
+#include <vector>
+#include <chrono>
+
 #include "socks.h"
 
 #define MAXHOSTLEN 120
 
 class jpsock;
 
+/*
+ * Sockets are non-blocking and are driven by the reactor thread, only set_hostname
+ * gets called from the executor (before the connection is handed over to the reactor).
+ *
+ * connect() starts the connection, handshake() is then called on every readiness
+ * event until it stops returning 0. recv and send return the number of bytes, 0 if
+ * the call would block and -1 on error - the error is set on the callback object.
+ *
+ * While connecting there can be more than one socket in flight (see plain_socket),
+ * get_fds lists all of them, and on_attempt_timer has to be called at next_attempt_time.
+ * Before a socket gets closed, jpsock::release_fd is called with it.
+ */
+
+// Resolved pool address
+struct sock_addr
+{
+    sockaddr_storage addr;
+    socklen_t len;
+};
 class base_socket
 {
 public:
     virtual bool set_hostname(const char* sAddr) = 0;
     virtual bool connect() = 0;
+    virtual int handshake() = 0;
     virtual int recv(char* buf, unsigned int len) = 0;
-    virtual bool send(const char* buf) = 0;
-    virtual void close(bool free) = 0;
+    virtual int send(const char* buf, unsigned int len) = 0;
+    virtual void close() = 0;
+
+    // True if the last call couldn't continue until the socket is writable
+    virtual bool wants_write() = 0;
+    virtual void get_fds(std::vector<SOCKET>& fds) = 0;
+
+    typedef std::chrono::steady_clock::time_point time_point;
+    virtual time_point next_attempt_time() = 0;
+    virtual int on_attempt_timer() = 0;
+
+    virtual bool is_tls() { return false; }
+    // Only meaningful once handshake() returned 1
+    virtual bool is_resumed() { return false; }
+
     char hostname[MAXHOSTLEN];
 };
 
+/*
+ * Name lookups are cached for iDnsCacheTime, and a cache entry is dropped as soon as
+ * none of its addresses would take a connection.
+ *
+ * Connects are done RFC 8305 style - addresses alternate between the families, starting
+ * with the preferred one, and if an attempt didn't succeed within iAttemptDelay we start
+ * the next one in parallel. A failed attempt starts the next one straight away. The first
+ * socket to connect wins and the rest get closed.
+ */
 class plain_socket : public base_socket
 {
 public:
@@ -23,39 +68,82 @@ public:
 
     bool set_hostname(const char* sAddr);
     bool connect();
+    int handshake();
     int recv(char* buf, unsigned int len);
-    bool send(const char* buf);
-    void close(bool free);
+    int send(const char* buf, unsigned int len);
+    void close();
+
+    bool wants_write() { return bConnecting; }
+    void get_fds(std::vector<SOCKET>& fds);
+
+    time_point next_attempt_time();
+    int on_attempt_timer();
+
+    // getaddrinfo doesn't tell us the record TTL, so this is a fixed upper bound
+    static constexpr size_t iDnsCacheTime = 300;
+    static constexpr size_t iAttemptDelay = 250;
+
+protected:
+    bool start_attempt();
+    int connect_failed();
+    void close_fd(SOCKET fd);
 
-private:
     jpsock* pCallback;
-    addrinfo *pSockAddr;
-    addrinfo *pAddrRoot;
+    std::vector<sock_addr> vAddrs;
+    size_t iNextAddr;
+
+    std::vector<SOCKET> vAttempts;
+    time_point tNextAttempt;
+    int iLastConnectErr;
+
     SOCKET hSocket;
+    bool bConnecting;
+    char sHostOnly[MAXHOSTLEN];
+    char sDnsKey[256];
 };
 
 typedef struct ssl_ctx_st SSL_CTX;
-typedef struct bio_st BIO;
 typedef struct ssl_st SSL;
+typedef struct ssl_session_st SSL_SESSION;
 
-class tls_socket : public base_socket
+class tls_socket : public plain_socket
 {
 public:
     tls_socket(jpsock* err_callback);
 
     bool set_hostname(const char* sAddr);
     bool connect();
+    int handshake();
     int recv(char* buf, unsigned int len);
-    bool send(const char* buf);
-    void close(bool free);
+    int send(const char* buf, unsigned int len);
+    void close();
+
+    bool wants_write() { return plain_socket::wants_write() || bWantWrite; }
+
+    bool is_tls() { return true; }
+    bool is_resumed() { return bResumed; }
 
 private:
-    void init_ctx();
+    static void init_ctx();
+    static int new_session_cb(SSL* ssl, SSL_SESSION* sess);
+
     void print_error();
+    int ssl_result(int ret, const char* sClosed, bool bRead);
+    bool check_fingerprint();
+    void keep_session(SSL_SESSION* sess);
 
-    jpsock* pCallback;
+    // Shared by all connections, so that they can share the session cache too
+    static SSL_CTX* ctx;
 
-    SSL_CTX* ctx = nullptr;
-    BIO* bio = nullptr;
     SSL* ssl = nullptr;
+    bool bWantWrite = false;
+    bool bResumed = false;
+    bool bFatalError = false;
+
+    /* Sessions are cached per pool address. A session that shows up before we checked
+       the certificate is parked here and only goes into the cache once the check passed,
+       so a resumed session never needs the certificate digest again. */
+    char sCacheKey[256];
+    SSL_SESSION* pPendingSession = nullptr;
+    bool bVerified = false;
 };
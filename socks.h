@@ -26,6 +26,30 @@ inline void sock_close(SOCKET s)
     closesocket(s);
 }
 
+inline bool sock_set_nonblock(SOCKET s)
+{
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode) == 0;
+}
+
+inline bool sock_would_block()
+{
+    int err = WSAGetLastError();
+    return err == WSAEWOULDBLOCK || err == WSAEINPROGRESS;
+}
+
+#define SOCK_SEND_FLAGS 0
+
+inline void sock_set_errno(int err)
+{
+    WSASetLastError(err);
+}
+
+inline int sock_errno()
+{
+    return WSAGetLastError();
+}
+
 inline const char* sock_strerror(char* buf, size_t len)
 {
     buf[0] = '\0';
@@ -60,6 +84,7 @@ inline const char* sock_gai_strerror(int err, char* buf, size_t len)
 #include <netdb.h>  /* Needed for getaddrinfo() and freeaddrinfo() */
 #include <unistd.h> /* Needed for close() */
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #if defined(__FreeBSD__)
 #include <netinet/in.h> /* Needed for IPPROTO_TCP */
@@ -77,6 +102,33 @@ inline void sock_close(SOCKET s)
     close(s);
 }
 
+inline bool sock_set_nonblock(SOCKET s)
+{
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags != -1 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+inline bool sock_would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS;
+}
+
+#ifdef MSG_NOSIGNAL
+#define SOCK_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SOCK_SEND_FLAGS 0
+#endif
+
+inline void sock_set_errno(int err)
+{
+    errno = err;
+}
+
+inline int sock_errno()
+{
+    return errno;
+}
+
 inline const char* sock_strerror(char* buf, size_t len)
 {
     buf[0] = '\0';
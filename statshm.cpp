@@ -0,0 +1,101 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+
+#include <string.h>
+
+#include "statshm.h"
+#include "console.h"
+
+stats_shm* stats_shm::oInst = nullptr;
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "The stats segment needs lock-free atomics.");
+
+#pragma GCC optimize ("Os")
+bool stats_shm::start(const char* sName)
+{
+    // Anyone on the host may read our stats, nobody else may write them
+    int fd = shm_open(sName, O_RDWR | O_CREAT, 0644);
+    if(fd == -1 || ftruncate(fd, sizeof(stats_segment)) != 0)
+    {
+        if(fd != -1)
+            close(fd);
+        printer::inst()->print_msg(L0, "Stats segment %s failed to start: unable to create it.", sName);
+        return false;
+    }
+
+    void* mem = mmap(nullptr, sizeof(stats_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(mem == MAP_FAILED)
+    {
+        printer::inst()->print_msg(L0, "Stats segment %s failed to start: unable to map it.", sName);
+        return false;
+    }
+
+    // A segment left over from an older run is simply taken over
+    pShm = (stats_segment*)mem;
+    pShm->iSeq.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memset(&pShm->oData, 0, sizeof(pShm->oData));
+    pShm->iMagic = stats_segment::iStatsMagic;
+    pShm->iVersion = stats_segment::iStatsVersion;
+    pShm->iSize = sizeof(stats_segment);
+    pShm->iSeq.store(2, std::memory_order_release);
+
+    printer::inst()->print_msg(L1, "Publishing stats in shared memory segment %s.", sName);
+    return true;
+}
+#pragma GCC reset_options
+
+void stats_shm::publish(const stats_payload& oData)
+{
+    uint32_t iSeq = pShm->iSeq.load(std::memory_order_relaxed);
+    pShm->iSeq.store(iSeq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    memcpy(&pShm->oData, &oData, sizeof(oData));
+
+    pShm->iSeq.store(iSeq + 2, std::memory_order_release);
+}
+
+#else
+
+bool stats_shm::start(const char* sName)
+{
+    printer::inst()->print_msg(L0, "The stats segment is not supported on Windows.");
+    return false;
+}
+
+void stats_shm::publish(const stats_payload& oData)
+{
+}
+
+#endif // _WIN32
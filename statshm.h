@@ -0,0 +1,68 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+/*
+ * Stats segment for node-local monitoring. The executor copies its numbers into a named
+ * POSIX shared memory segment on every tick, readers map it read-only and never make the
+ * miner do anything. The payload is guarded by a seqlock: a reader copies it out and
+ * retries if iSeq was odd or changed in the meantime.
+ *
+ * This header is the whole interface, tools/cg-stats.cpp shows how to read it. Bump
+ * iStatsVersion on any change to the layout.
+ */
+
+struct stats_thread
+{
+    uint64_t iHashCount;
+    uint64_t iTimestamp; // ms on the miner's monotonic clock, when iHashCount was stored
+};
+
+struct stats_payload
+{
+    static constexpr size_t iMaxThreads = 256;
+
+    uint64_t iUpdateMs;  // ms since the epoch, set on every tick
+    uint64_t iPoolDiff;
+    uint64_t iAccepted;
+    uint64_t iRejected;
+    uint64_t iTopDiff[10];
+    uint32_t iThreadCount;
+    uint32_t bPoolUp;
+    char     sPool[128]; // Address of the pool we mine on, empty if none
+    stats_thread vThreads[iMaxThreads];
+};
+
+struct stats_segment
+{
+    static constexpr uint32_t iStatsMagic = 0x74736763; // "cgst"
+    static constexpr uint32_t iStatsVersion = 2;
+
+    uint32_t iMagic;
+    uint32_t iVersion;
+    std::atomic<uint32_t> iSeq; // Odd while the miner writes
+    uint32_t iSize;             // sizeof(stats_segment)
+    stats_payload oData;
+};
+
+class stats_shm
+{
+public:
+    static stats_shm* inst()
+    {
+        if (oInst == nullptr) oInst = new stats_shm;
+        return oInst;
+    };
+
+    bool start(const char* sName);
+    inline bool is_running() { return pShm != nullptr; }
+
+    // Executor thread
+    void publish(const stats_payload& oData);
+
+private:
+    stats_shm() {}
+    static stats_shm* oInst;
+
+    stats_segment* pShm = nullptr;
+};
@@ -0,0 +1,292 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+#include <string.h>
+
+#include "stratum.h"
+
+namespace
+{
+
+struct scanner
+{
+    const char* p;
+    const char* end;
+
+    scanner(const char* line, size_t len) : p(line), end(line + len) {}
+
+    inline void skip_ws()
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+            p++;
+    }
+
+    inline bool expect(char c)
+    {
+        skip_ws();
+        if(p >= end || *p != c)
+            return false;
+        p++;
+        return true;
+    }
+
+    inline bool peek(char c)
+    {
+        skip_ws();
+        return p < end && *p == c;
+    }
+
+    // Strings we care about never contain escapes, bail out if they do
+    bool read_string(stratum_str& out)
+    {
+        if(!expect('"'))
+            return false;
+
+        out.str = p;
+        while(p < end && *p != '"')
+        {
+            if(*p == '\\')
+                return false;
+            p++;
+        }
+
+        if(p >= end)
+            return false;
+
+        out.len = p - out.str;
+        p++;
+        return true;
+    }
+
+    bool read_uint(uint64_t& out)
+    {
+        skip_ws();
+        if(p >= end || *p < '0' || *p > '9')
+            return false;
+
+        out = 0;
+        while(p < end && *p >= '0' && *p <= '9')
+        {
+            uint64_t n = out * 10 + (*p - '0');
+            if(n < out)
+                return false;
+            out = n;
+            p++;
+        }
+        return true;
+    }
+
+    bool read_null()
+    {
+        skip_ws();
+        if(end - p < 4 || memcmp(p, "null", 4) != 0)
+            return false;
+        p += 4;
+        return true;
+    }
+
+    // Skips over any value, we are not validating here - the DOM parser does that
+    bool skip_value()
+    {
+        skip_ws();
+        if(p >= end)
+            return false;
+
+        if(*p == '"')
+        {
+            p++;
+            while(p < end && *p != '"')
+                p += (*p == '\\') ? 2 : 1;
+            if(p >= end)
+                return false;
+            p++;
+            return true;
+        }
+
+        if(*p == '{' || *p == '[')
+        {
+            size_t depth = 0;
+            while(p < end)
+            {
+                char c = *p++;
+                if(c == '"')
+                {
+                    while(p < end && *p != '"')
+                        p += (*p == '\\') ? 2 : 1;
+                    if(p >= end)
+                        return false;
+                    p++;
+                }
+                else if(c == '{' || c == '[')
+                    depth++;
+                else if(c == '}' || c == ']')
+                {
+                    if(--depth == 0)
+                        return true;
+                }
+            }
+            return false;
+        }
+
+        const char* start = p;
+        while(p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+            p++;
+        return p != start;
+    }
+
+    // Walks the members of an object, cb gets called with each key and has to consume the value
+    template<typename F>
+    bool for_each_member(F cb)
+    {
+        if(!expect('{'))
+            return false;
+
+        if(peek('}'))
+        {
+            p++;
+            return true;
+        }
+
+        while(true)
+        {
+            stratum_str key;
+            if(!read_string(key) || !expect(':'))
+                return false;
+
+            if(!cb(key))
+                return false;
+
+            if(peek(','))
+            {
+                p++;
+                continue;
+            }
+
+            return expect('}');
+        }
+    }
+};
+
+inline bool key_is(const stratum_str& key, const char* name, size_t len)
+{
+    return key.len == len && memcmp(key.str, name, len) == 0;
+}
+
+#define KEY_IS(key, name) key_is(key, name, sizeof(name) - 1)
+
+} // namespace
+
+bool stratum_fast_parse(const char* line, size_t len, stratum_msg& msg)
+{
+    scanner sc(line, len);
+
+    bool bHaveMethod = false, bHaveParams = false, bHaveId = false;
+    bool bHaveResult = false, bHaveError = false;
+    msg.type = stratum_msg::msg_none;
+    msg.oJobId.str = msg.oBlob.str = msg.oTarget.str = msg.oAlgo.str = nullptr;
+    msg.oError.str = nullptr;
+    msg.oError.len = 0;
+    msg.iCallId = 0;
+
+    bool bParsed = sc.for_each_member([&](const stratum_str& key) -> bool {
+        if(KEY_IS(key, "method"))
+        {
+            stratum_str method;
+            if(!sc.read_string(method) || !KEY_IS(method, "job"))
+                return false;
+            bHaveMethod = true;
+            return true;
+        }
+        else if(KEY_IS(key, "params"))
+        {
+            bHaveParams = true;
+            return sc.for_each_member([&](const stratum_str& pkey) -> bool {
+                if(KEY_IS(pkey, "job_id"))
+                    return sc.read_string(msg.oJobId);
+                else if(KEY_IS(pkey, "blob"))
+                    return sc.read_string(msg.oBlob);
+                else if(KEY_IS(pkey, "target"))
+                    return sc.read_string(msg.oTarget);
+                else if(KEY_IS(pkey, "algo"))
+                    return sc.read_string(msg.oAlgo);
+                else
+                    return sc.skip_value();
+            });
+        }
+        else if(KEY_IS(key, "id"))
+        {
+            // Job notifications can carry a null id
+            if(sc.peek('n'))
+                return sc.read_null();
+            bHaveId = true;
+            return sc.read_uint(msg.iCallId);
+        }
+        else if(KEY_IS(key, "error"))
+        {
+            if(sc.peek('n'))
+                return sc.read_null();
+
+            bHaveError = true;
+            return sc.for_each_member([&](const stratum_str& ekey) -> bool {
+                if(KEY_IS(ekey, "message"))
+                    return sc.read_string(msg.oError);
+                else
+                    return sc.skip_value();
+            });
+        }
+        else if(KEY_IS(key, "result"))
+        {
+            bHaveResult = true;
+            return sc.skip_value();
+        }
+        else
+            return sc.skip_value();
+    });
+
+    if(!bParsed)
+        return false;
+
+    if(bHaveMethod)
+    {
+        if(!bHaveParams || msg.oJobId.str == nullptr || msg.oBlob.str == nullptr || msg.oTarget.str == nullptr)
+            return false;
+
+        msg.type = stratum_msg::msg_job;
+        return true;
+    }
+
+    // Login replies carry the first job and need the DOM
+    if(!bHaveId || msg.iCallId == 1)
+        return false;
+
+    if(bHaveError)
+    {
+        if(msg.oError.str == nullptr)
+            return false;
+    }
+    else if(!bHaveResult)
+        return false;
+
+    msg.type = stratum_msg::msg_reply;
+    return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fast path for the two messages that make up nearly all of our traffic - job
+ * notifications and replies to our submits. We don't build a DOM, we just walk
+ * the line once and point into it. Nothing is allocated and the line is not
+ * modified.
+ *
+ * Anything unusual (escaped strings, unknown methods, login replies, malformed
+ * input) makes stratum_fast_parse return false, in that case the caller should
+ * hand the line to the full rapidjson parser, which will also do the error reporting.
+ */
+
+struct stratum_str
+{
+    const char* str;
+    size_t len;
+};
+
+struct stratum_msg
+{
+    enum msg_type { msg_none, msg_job, msg_reply };
+
+    msg_type type;
+
+    // msg_job
+    stratum_str oJobId;
+    stratum_str oBlob;
+    stratum_str oTarget;
+    stratum_str oAlgo; // Optional, oAlgo.str is nullptr if the pool didn't say
+
+    // msg_reply, oError.str is nullptr if the call succeeded
+    uint64_t iCallId;
+    stratum_str oError;
+};
+
+bool stratum_fast_parse(const char* line, size_t len, stratum_msg& msg);
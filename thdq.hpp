@@ -49,6 +49,12 @@ public:
         cond_.notify_one();
     }
 
+    bool empty()
+    {
+        std::unique_lock<std::mutex> mlock(mutex_);
+        return queue_.empty();
+    }
+
 private:
     std::mutex mutex_;
     std::queue<T> queue_;
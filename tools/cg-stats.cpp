@@ -0,0 +1,130 @@
+/*
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  *
+  * Additional permission under GNU GPL version 3 section 7
+  *
+  * If you modify this Program, or any covered work, by linking or combining
+  * it with OpenSSL (or a modified version of that library), containing parts
+  * covered by the terms of OpenSSL License and SSLeay License, the licensors
+  * of this Program grant you additional permission to convey the resulting work.
+  *
+  */
+
+
+/*
+ * Reader for the stats segment, see statshm.h. Takes two samples at least a second apart
+ * to work out the hashrate, so it never needs anything from the miner itself. Threads
+ * only store their count every 32 hashes, so slow ones can take a few seconds.
+ *
+ * Usage: cg-stats /name
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../statshm.h"
+
+static bool read_sample(const stats_segment* pShm, stats_payload& oData)
+{
+    for(size_t i = 0; i < 1000; i++)
+    {
+        uint32_t iSeq = pShm->iSeq.load(std::memory_order_acquire);
+        if((iSeq & 1) == 0)
+        {
+            memcpy(&oData, &pShm->oData, sizeof(oData));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(pShm->iSeq.load(std::memory_order_relaxed) == iSeq)
+                return true;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    return false;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc != 2)
+    {
+        printf("Usage: %s /stats_shm_name\n", argv[0]);
+        return 1;
+    }
+
+    int fd = shm_open(argv[1], O_RDONLY, 0);
+    if(fd == -1)
+    {
+        printf("Unable to open %s, is the miner running with stats_shm_name set?\n", argv[1]);
+        return 1;
+    }
+
+    void* mem = mmap(nullptr, sizeof(stats_segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED)
+    {
+        printf("Unable to map %s.\n", argv[1]);
+        return 1;
+    }
+
+    const stats_segment* pShm = (const stats_segment*)mem;
+    if(pShm->iMagic != stats_segment::iStatsMagic || pShm->iVersion != stats_segment::iStatsVersion ||
+        pShm->iSize != sizeof(stats_segment))
+    {
+        printf("%s is not a stats segment of this version.\n", argv[1]);
+        return 1;
+    }
+
+    stats_payload oA, oB;
+    if(!read_sample(pShm, oA))
+        return 1;
+
+    for(size_t iWait = 0; iWait < 10; iWait++)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        if(!read_sample(pShm, oB))
+            return 1;
+
+        bool bAllMoved = true;
+        for(size_t i = 0; i < oB.iThreadCount && i < stats_payload::iMaxThreads; i++)
+            bAllMoved &= oB.vThreads[i].iTimestamp != oA.vThreads[i].iTimestamp;
+        if(bAllMoved)
+            break;
+    }
+
+    printf("Pool      : %s (%s)\n", oB.sPool[0] != '\0' ? oB.sPool : "none", oB.bPoolUp ? "up" : "down");
+    printf("Difficulty: %llu\n", (unsigned long long)oB.iPoolDiff);
+    printf("Shares    : %llu accepted, %llu rejected\n", (unsigned long long)oB.iAccepted, (unsigned long long)oB.iRejected);
+    printf("Top diffs :");
+    for(size_t i = 0; i < 10; i++)
+        printf(" %llu", (unsigned long long)oB.iTopDiff[i]);
+    printf("\n");
+
+    double fTotal = 0.0;
+    for(size_t i = 0; i < oB.iThreadCount && i < stats_payload::iMaxThreads; i++)
+    {
+        const stats_thread& a = oA.vThreads[i];
+        const stats_thread& b = oB.vThreads[i];
+        double fHps = 0.0;
+        if(b.iTimestamp > a.iTimestamp)
+            fHps = (b.iHashCount - a.iHashCount) * 1000.0 / (b.iTimestamp - a.iTimestamp);
+        fTotal += fHps;
+        printf("Thread %3zu: %10.1f H/s %14llu hashes\n", i, fHps, (unsigned long long)b.iHashCount);
+    }
+    printf("Total     : %10.1f H/s\n", fTotal);
+    return 0;
+}
@@ -115,14 +115,14 @@ extern const char sHtmlCommonHeader [] =
 extern const char sHtmlHashrateBodyHigh [] =
     "<div class=data>"
     "<table>"
-        "<tr><th>Thread ID</th><th>2.5s</th><th>60s</th><th>15m</th><th rowspan='%u'>H/s</td></tr>";
+        "<tr><th>Thread ID</th><th>5s</th><th>60s</th><th>15m</th><th>1h</th><th>24h</th><th rowspan='%u'>H/s</td></tr>";
 
 extern const char sHtmlHashrateTableRow [] =
-    "<tr><th>%u</th><td>%s</td><td>%s</td><td>%s</td></tr>";
+    "<tr><th>%u</th><td>%s</td><td>%s</td><td>%s</td><td>%s</td><td>%s</td></tr>";
 
 extern const char sHtmlHashrateBodyLow [] =
-        "<tr><th>Totals:</th><td>%s</td><td>%s</td><td>%s</td></tr>"
-        "<tr><th>Highest:</th><td>%s</td><td colspan='2'></td></tr>"
+        "<tr><th>Totals:</th><td>%s</td><td>%s</td><td>%s</td><td>%s</td><td>%s</td></tr>"
+        "<tr><th>Highest:</th><td>%s</td><td colspan='4'></td></tr>"
     "</table>"
     "</div></div></body></html>";
 
@@ -132,6 +132,8 @@ extern const char sHtmlConnectionBodyHigh [] =
         "<tr><th>Pool address</th><td>%s</td></tr>"
         "<tr><th>Connected since</th><td>%s</td></tr>"
         "<tr><th>Pool ping time</th><td>%u ms</td></tr>"
+        "<tr><th>Submit latency (15m)</th><td>%s</td></tr>"
+        "<tr><th>TLS handshakes</th><td>%s</td></tr>"
     "</table>"
     "<h4>Network error log</h4>"
     "<table>"
@@ -171,8 +173,17 @@ extern const char sHtmlResultBodyLow[] =
     "</table></div></div></body></html>";
 
 extern const char sJsonApiThdHashrate[] =
+    "[%s,%s,%s,%s,%s]";
+
+extern const char sJsonApiThdRange[] =
+    "[[%s,%s],[%s,%s],[%s,%s],[%s,%s]]";
+
+extern const char sJsonApiThdCounters[] =
     "[%s,%s,%s]";
 
+extern const char sJsonApiThdHashTimes[] =
+    "{\"p50\":%s,\"p99\":%s,\"max\":%s,\"jitter\":%s,\"flag\":\"%s\"}";
+
 extern const char sJsonApiResultError[] =
     "{\"count\":%llu,\"last_seen\":%llu,\"text\":\"%s\"}";
 
@@ -183,6 +194,9 @@ extern const char sJsonApiFormat [] =
 "{"
     "\"hashrate\":{"
         "\"threads\":[%s],"
+        "\"range\":[%s],"
+        "\"counters\":[%s],"
+        "\"hash_times\":[%s],"
         "\"total\":%s,"
         "\"highest\":%s"
     "},"
@@ -201,6 +215,7 @@ extern const char sJsonApiFormat [] =
         "\"pool\": \"%s\","
         "\"uptime\":%llu,"
         "\"ping\":%llu,"
+        "\"latency\":{\"p50\":%u,\"p90\":%u,\"p99\":%u,\"max\":%u,\"count\":%llu},"
         "\"error_log\":[%s]"
     "}"
 "}";
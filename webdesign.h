@@ -19,6 +19,9 @@ extern const char sHtmlResultTableRow[];
 extern const char sHtmlResultBodyLow[];
 
 extern const char sJsonApiThdHashrate[];
+extern const char sJsonApiThdRange[];
+extern const char sJsonApiThdCounters[];
+extern const char sJsonApiThdHashTimes[];
 extern const char sJsonApiResultError[];
 extern const char sJsonApiConnectionError[];
 extern const char sJsonApiFormat[];